@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "ctq_reader.h"
+#include "ctq_writer.h"
+#include "tei_generator.hh"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct benchOptions {
+    TeiGenerator::Options gen;
+    size_t      iterations  = 2000;
+    int         encode_runs = 3;
+    std::string ctq_file    = "bench.ctq";
+    std::string json_file;
+    bool        string_pool = false;
+    bool        trie_variants = false;
+    size_t      find_cache  = 16 << 20;
+};
+
+struct benchResult {
+    std::string name;
+    size_t      samples;
+    double      mean_us;
+    double      p50_us;
+    double      p99_us;
+    double      throughput; // items per second
+    std::string unit;
+    double      value = 0;  // a measured quantity other than a rate, e.g. a size or a hit rate
+    std::string value_unit;
+};
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --entries N      entries to generate (default 20000)\n"
+              << "  --senses N       max senses per entry (default 3)\n"
+              << "  --glosses N      max glosses per sense (default 4)\n"
+              << "  --cjk RATIO      share of CJK headwords (default 0.5)\n"
+              << "  --seed N         generator seed (default 42)\n"
+              << "  --iterations N   queries per micro benchmark (default 2000)\n"
+              << "  --runs N         encode runs, best is kept (default 3)\n"
+              << "  --out FILE       ctq file to write (default bench.ctq)\n"
+              << "  --string_pool B  write a string pool when B is 1 (default 0)\n"
+              << "  --trie_variants B  compare find latency and file size of the trie variants when B is 1 (default 0)\n"
+              << "  --find_cache N   find cache bytes of the cached benchmark (default 16 MiB)\n"
+              << "  --json FILE      write results as JSON to FILE ('-' for stdout)\n";
+}
+
+static bool parse_args(int argc, char **argv, benchOptions &opts) {
+    opts.gen.entry_cnt = 20000;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help" || i + 1 >= argc) {
+            return false;
+        }
+
+        const char *value = argv[++i];
+
+        if      (arg == "--entries")    opts.gen.entry_cnt   = std::stoul(value);
+        else if (arg == "--senses")     opts.gen.max_senses  = std::stoul(value);
+        else if (arg == "--glosses")    opts.gen.max_glosses = std::stoul(value);
+        else if (arg == "--cjk")        opts.gen.cjk_ratio   = std::stod(value);
+        else if (arg == "--seed")       opts.gen.seed        = std::stoull(value);
+        else if (arg == "--iterations") opts.iterations      = std::stoul(value);
+        else if (arg == "--runs")       opts.encode_runs     = std::max(1, std::stoi(value));
+        else if (arg == "--out")        opts.ctq_file        = value;
+        else if (arg == "--json")       opts.json_file       = value;
+        else if (arg == "--string_pool") opts.string_pool    = std::stoi(value) != 0;
+        else if (arg == "--trie_variants") opts.trie_variants = std::stoi(value) != 0;
+        else if (arg == "--find_cache") opts.find_cache     = std::stoul(value);
+        else return false;
+    }
+
+    return true;
+}
+
+// latencies in microseconds
+static benchResult summarize(const std::string &name, std::vector<double> lat) {
+    benchResult res { name, lat.size(), 0, 0, 0, 0, "ops/s" };
+
+    if (lat.empty()) return res;
+
+    double total = 0;
+    for (const auto l : lat) total += l;
+
+    std::sort(lat.begin(), lat.end());
+
+    res.mean_us = total / lat.size();
+    res.p50_us  = lat[lat.size() / 2];
+    res.p99_us  = lat[std::min(lat.size() - 1, lat.size() * 99 / 100)];
+    res.throughput = total > 0 ? lat.size() / (total / 1e6) : 0;
+
+    return res;
+}
+
+static benchResult measure(const std::string &name, size_t iterations, const std::function<void(size_t)> &fn) {
+    std::vector<double> lat;
+    lat.reserve(iterations);
+
+    for (size_t i = 0; i < iterations; ++i) {
+        auto start = bench_clock::now();
+        fn(i);
+        lat.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+    }
+
+    return summarize(name, std::move(lat));
+}
+
+static void print_json(std::ostream &os, const benchOptions &opts, const std::vector<benchResult> &results) {
+    os << "{\n"
+       << "  \"config\": { \"entries\": " << opts.gen.entry_cnt
+       << ", \"max_senses\": " << opts.gen.max_senses
+       << ", \"max_glosses\": " << opts.gen.max_glosses
+       << ", \"cjk_ratio\": " << opts.gen.cjk_ratio
+       << ", \"seed\": " << opts.gen.seed
+       << ", \"iterations\": " << opts.iterations
+       << ", \"string_pool\": " << (opts.string_pool ? "true" : "false")
+       << ", \"find_cache\": " << opts.find_cache
+       << ", \"trie_variants\": " << (opts.trie_variants ? "true" : "false") << " },\n"
+       << "  \"results\": [\n";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto &r = results[i];
+
+        os << "    { \"name\": \"" << r.name << "\""
+           << ", \"samples\": " << r.samples
+           << ", \"mean_us\": " << r.mean_us
+           << ", \"p50_us\": " << r.p50_us
+           << ", \"p99_us\": " << r.p99_us
+           << ", \"throughput\": " << r.throughput
+           << ", \"unit\": \"" << r.unit << "\""
+           << ", \"value\": " << r.value
+           << ", \"value_unit\": \"" << r.value_unit << "\" }"
+           << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    os << "  ]\n}\n";
+}
+
+static void print_table(std::ostream &os, const std::vector<benchResult> &results) {
+    char line[200];
+
+    snprintf(line, sizeof line, "%-22s %8s %12s %12s %12s %20s %20s\n", "benchmark", "samples", "mean(us)", "p50(us)", "p99(us)", "throughput", "value");
+    os << line;
+
+    for (const auto &r : results) {
+        char throughput[32] = "-", value[32] = "-";
+
+        if (!r.unit.empty()) snprintf(throughput, sizeof throughput, "%.2f %s", r.throughput, r.unit.c_str());
+        if (!r.value_unit.empty()) snprintf(value, sizeof value, "%.2f %s", r.value, r.value_unit.c_str());
+
+        snprintf(line, sizeof line, "%-22s %8zu %12.2f %12.2f %12.2f %20s %20s\n", r.name.c_str(), r.samples, r.mean_us, r.p50_us, r.p99_us, throughput, value);
+        os << line;
+    }
+}
+
+int main(int argc, char **argv) {
+    benchOptions opts;
+
+    if (!parse_args(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    TeiGenerator generator(opts.gen);
+    std::string tei = generator.generate();
+    const auto &headwords = generator.headwords();
+    std::vector<benchResult> results;
+
+    CTQ::WriteOptions write_options;
+    write_options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    write_options.string_pool = opts.string_pool;
+
+    // macro: encode
+    {
+        std::vector<double> runs;
+
+        for (int i = 0; i < opts.encode_runs; ++i) {
+            auto start = bench_clock::now();
+
+            if (CTQ::write(tei.data(), tei.size(), opts.ctq_file, write_options) != 0) {
+                std::cerr << "write failed" << std::endl;
+                return 1;
+            }
+
+            runs.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+        }
+
+        double best = *std::min_element(runs.begin(), runs.end()) / 1e6;
+        benchResult res = summarize("encode", runs);
+
+        res.throughput = tei.size() / best / (1 << 20);
+        res.unit = "MiB/s";
+        results.push_back(res);
+
+        res.name = "encode_entries";
+        res.throughput = opts.gen.entry_cnt / best;
+        res.unit = "entries/s";
+        results.push_back(res);
+    }
+
+    CTQ::Reader reader(opts.ctq_file, true);
+    CTQ::QueryContext ctx;
+    size_t word_cnt = headwords.size();
+
+    // micro: find
+    results.push_back(measure("find_exact", opts.iterations, [&](size_t i) {
+        reader.find(ctx, headwords[(i * 7919) % word_cnt], 0, 0, 1);
+    }));
+
+    results.push_back(measure("find_prefix", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        reader.find(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 0, 20, 1);
+    }));
+
+    results.push_back(measure("find_filtered", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        reader.find(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 0, 20, 1, "noun%", 3);
+    }));
+
+    // micro: a prefix searched in headwords and notes, one walk with a path set against a walk per path
+    const CTQ::PathSet multi_paths { 1, 3 };
+
+    results.push_back(measure("find_paths", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        reader.find(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 0, 20, multi_paths);
+    }));
+
+    results.push_back(measure("find_per_path", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        const std::string keyword = word.substr(0, std::min<size_t>(word.size(), 3)) + "%";
+        reader.find(ctx, keyword, 0, 20, 1);
+        reader.find(ctx, keyword, 0, 20, 3);
+    }));
+
+    // micro: pagination totals and suggestion dropdowns
+    results.push_back(measure("count_prefix", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        reader.count(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 1);
+    }));
+
+    results.push_back(measure("complete", opts.iterations, [&](size_t i) {
+        const std::string &word = headwords[(i * 7919) % word_cnt];
+        reader.complete(word.substr(0, std::min<size_t>(word.size(), 3)), 10, 1);
+    }));
+
+    // micro: autocomplete traffic, prefixes of the 1000 first headwords on a reader with a find cache, hit rate in the last row
+    {
+        CTQ::ReaderOptions cache_options;
+        cache_options.find_cache = opts.find_cache;
+
+        CTQ::Reader cached(opts.ctq_file, cache_options);
+        size_t hot_cnt = std::min<size_t>(word_cnt, 1000);
+
+        results.push_back(measure("find_cached", opts.iterations, [&](size_t i) {
+            const std::string &word = headwords[(i * 7919) % hot_cnt];
+            cached.find(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 0, 20, 1);
+        }));
+
+        ctq_reader_stats cache_stats = cached.stats();
+        uint64_t lookups = cache_stats.find_cache_hits + cache_stats.find_cache_misses;
+
+        results.push_back({ "find_cache_hits", lookups, 0, 0, 0, 0, "", lookups ? 100.0 * cache_stats.find_cache_hits / lookups : 0, "%" });
+    }
+
+    // micro: get on a freshly opened reader, then on a reader that has already served the entry
+    results.push_back(measure("get_cold", std::min<size_t>(opts.iterations, 200), [&](size_t i) {
+        CTQ::Reader cold(opts.ctq_file);
+        cold.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt));
+    }));
+
+    for (size_t i = 0; i < opts.iterations; ++i) {
+        reader.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt));
+    }
+
+    results.push_back(measure("get_warm", opts.iterations, [&](size_t i) {
+        reader.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt));
+    }));
+
+    // micro: get on a reader holding every cluster decompressed, its open time and memory in the preload row
+    {
+        CTQ::ReaderOptions preload_options;
+        preload_options.preload = true;
+
+        CTQ::Reader preloaded(opts.ctq_file, preload_options);
+        ctq_reader_stats load_stats = preloaded.stats();
+        double load_us = load_stats.load_ns / 1e3;
+
+        results.push_back({ "preload", 1, load_us, load_us, load_us, 0, "", load_stats.preload_bytes / 1024.0, "KiB" });
+
+        results.push_back(measure("get_preloaded", opts.iterations, [&](size_t i) {
+            preloaded.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt));
+        }));
+    }
+
+    // macro: cluster size picked from sampled entries, the tuning time and chosen size in the tune row, then get on the tuned file
+    {
+        std::vector<CTQ::ClusterSizeTrial> trials;
+        CTQ::WriteOptions tuned_options = write_options;
+        auto start = bench_clock::now();
+
+        tuned_options.cluster_size = CTQ::tune_cluster_size(tei.data(), tei.size(), write_options, trials);
+
+        double tune_us = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+
+        if (tuned_options.cluster_size == 0 || CTQ::write(tei.data(), tei.size(), opts.ctq_file + "_tuned", tuned_options) != 0) {
+            std::cerr << "write failed" << std::endl;
+            return 1;
+        }
+
+        results.push_back({ "tune_cluster_size", 1, tune_us, tune_us, tune_us, 0, "", (double)tuned_options.cluster_size, "bytes" });
+
+        CTQ::Reader tuned(opts.ctq_file + "_tuned");
+
+        results.push_back(measure("get_tuned", opts.iterations, [&](size_t i) {
+            tuned.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt));
+        }));
+    }
+
+    // micro: list view rows, headwords and first translation only
+    const std::vector<std::string> row_paths { "/entry/form/orth", "/entry/sense/cit/quote" };
+
+    results.push_back(measure("get_paths", opts.iterations, [&](size_t i) {
+        reader.get(TeiGenerator::entry_id((i * 7919) % opts.gen.entry_cnt), row_paths);
+    }));
+
+    // macro: result pages, a prefix find then a get per entry, on clusters in document order, ordered by first headword,
+    // then ordered by a co-access log of other pages, so the log does not replay the measured queries.
+    // Clusters decompressed per page in the page_clusters rows
+    {
+        auto page_keyword = [&](size_t word_idx) {
+            const std::string &word = headwords[word_idx % word_cnt];
+            return word.substr(0, std::min<size_t>(word.size(), 2)) + "%";
+        };
+
+        CTQ::WriteOptions ordered_options = write_options;
+        CTQ::WriteOptions logged_options = write_options;
+        std::set<uint64_t> logged;
+
+        ordered_options.order_path = "/entry/form/orth";
+
+        for (size_t i = 0; i < opts.iterations; ++i) {
+            reader.find(ctx, page_keyword(i * 6007 + word_cnt / 2), 0, 20, 1);
+
+            for (size_t k = 0; k < ctx.size(); ++k) {
+                for (size_t n = 0; n < ctx[k].id_cnt; ++n) {
+                    if (logged.insert(ctx[k].ids[n]).second) {
+                        logged_options.entry_order.push_back(ctx[k].ids[n]);
+                    }
+                }
+            }
+        }
+
+        if (CTQ::write(tei.data(), tei.size(), opts.ctq_file + "_ordered", ordered_options) != 0 || CTQ::write(tei.data(), tei.size(), opts.ctq_file + "_logged", logged_options) != 0) {
+            std::cerr << "write failed" << std::endl;
+            return 1;
+        }
+
+        for (const std::string suffix : { "", "_ordered", "_logged" }) {
+            CTQ::Reader paged(opts.ctq_file + suffix);
+
+            results.push_back(measure("result_page" + suffix, opts.iterations, [&](size_t i) {
+                paged.find(ctx, page_keyword(i * 7919), 0, 20, 1);
+
+                for (size_t k = 0; k < ctx.size(); ++k) {
+                    for (size_t n = 0; n < ctx[k].id_cnt; ++n) {
+                        paged.get(ctx[k].ids[n]);
+                    }
+                }
+            }));
+
+            results.push_back({ "page_clusters" + suffix, opts.iterations, 0, 0, 0, 0, "", (double)paged.stats().clusters_read / opts.iterations, "clusters" });
+        }
+    }
+
+    // macro: file size and find latency of each trie variant
+    if (opts.trie_variants) {
+        for (unsigned bits : { 7, 8, 15, 16 }) {
+            const std::string suffix = "_t" + std::to_string(bits);
+            const std::string filename = opts.ctq_file + suffix;
+            CTQ::WriteOptions variant_options = write_options;
+
+            variant_options.trie_variant = bits;
+
+            if (CTQ::write(tei.data(), tei.size(), filename, variant_options) != 0) {
+                std::cerr << "write failed" << std::endl;
+                return 1;
+            }
+
+            CTQ::Reader variant(filename);
+
+            results.push_back(measure("find_exact" + suffix, opts.iterations, [&](size_t i) {
+                variant.find(ctx, headwords[(i * 7919) % word_cnt], 0, 0, 1);
+            }));
+
+            results.push_back(measure("find_prefix" + suffix, opts.iterations, [&](size_t i) {
+                const std::string &word = headwords[(i * 7919) % word_cnt];
+                variant.find(ctx, word.substr(0, std::min<size_t>(word.size(), 3)) + "%", 0, 20, 1);
+            }));
+
+            results.push_back({ "file_size" + suffix, 1, 0, 0, 0, 0, "", std::ifstream(filename, std::ios::binary | std::ios::ate).tellg() / 1024.0, "KiB" });
+        }
+    }
+
+    std::cout << opts.gen.entry_cnt << " entries, " << tei.size() / (1 << 20) << " MiB of TEI" << std::endl;
+    print_table(std::cout, results);
+
+    if (opts.json_file == "-") {
+        print_json(std::cout, opts, results);
+    } else if (opts.json_file.size()) {
+        std::ofstream ofs(opts.json_file);
+        print_json(ofs, opts, results);
+    }
+
+    return 0;
+}
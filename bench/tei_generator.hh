@@ -0,0 +1,125 @@
+#ifndef CTQ_TEI_GENERATOR_HH
+#define CTQ_TEI_GENERATOR_HH
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * @brief Deterministic generator of JMdict shaped TEI dictionaries.
+ */
+class TeiGenerator {
+public:
+    struct Options {
+        size_t   entry_cnt  = 10000;
+        unsigned max_forms  = 3;
+        unsigned max_senses = 3;
+        unsigned max_glosses = 4;
+        double   cjk_ratio  = 0.5; // share of forms written in CJK
+        uint64_t seed       = 42;
+    };
+
+    explicit TeiGenerator(const Options &options) : m_options(options), m_state(options.seed) {}
+
+    std::string generate() {
+        std::string out;
+
+        m_state = m_options.seed;
+        m_headwords.clear();
+
+        out += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<TEI xmlns=\"http://www.tei-c.org/ns/1.0\" version=\"5.0\"><text><body>\n";
+
+        for (size_t i = 0; i < m_options.entry_cnt; ++i) {
+            entry(out, entry_id(i));
+        }
+
+        out += "</body></text></TEI>\n";
+
+        return out;
+    }
+
+    /** @brief Headwords of the last generated dictionary, in document order. */
+    const std::vector<std::string> &headwords() const { return m_headwords; }
+
+    /** @brief Xml id of the i-th generated entry. */
+    static uint64_t entry_id(size_t i) { return 1000000 + i * 10; }
+
+private:
+    uint64_t next() {
+        m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return m_state >> 33;
+    }
+
+    unsigned range(unsigned lo, unsigned hi) { return lo + next() % (hi - lo + 1); }
+
+    static void append_utf8(std::string &out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // skewed towards a small set of frequent characters, like real headwords
+    std::string word(bool cjk) {
+        std::string s;
+        unsigned len = cjk ? range(1, 4) : range(2, 9);
+
+        for (unsigned i = 0; i < len; ++i) {
+            unsigned r = next() % 1000;
+            unsigned rank = (r * r) / 1000;
+
+            if (cjk) {
+                append_utf8(s, (i % 2 ? 0x3041 + rank % 86 : 0x4E00 + rank * 7));
+            } else {
+                s += (char)('a' + rank % 26);
+            }
+        }
+
+        return s;
+    }
+
+    void entry(std::string &out, uint64_t id) {
+        static const char *pos[] = { "noun (common) (futsuumeishi)", "Godan verb with 'ku' ending", "adjective (keiyoushi)", "adverb (fukushi)", "interjection (kandoushi)" };
+        
+        out += "<entry xml:id=\"a" + std::to_string(id) + "\">";
+
+        for (unsigned i = 0, n = range(1, m_options.max_forms); i < n; ++i) {
+            bool cjk = (next() % 1000) < m_options.cjk_ratio * 1000;
+
+            out += cjk ? "<form type=\"k_ele\"><orth>" : "<form type=\"r_ele\"><orth>";
+            m_headwords.push_back(word(cjk));
+            out += m_headwords.back();
+            out += "</orth></form>";
+        }
+
+        for (unsigned i = 0, n = range(1, m_options.max_senses); i < n; ++i) {
+            out += "<sense><note type=\"pos\">";
+            out += pos[next() % 5];
+            out += "</note>";
+
+            for (unsigned j = 0, m = range(1, m_options.max_glosses); j < m; ++j) {
+                out += "<cit type=\"trans\"><quote>" + word(false);
+
+                if (next() % 2) out += " " + word(false);
+
+                out += "</quote></cit>";
+            }
+
+            out += "</sense>";
+        }
+
+        out += "</entry>\n";
+    }
+
+    Options  m_options;
+    uint64_t m_state;
+    std::vector<std::string> m_headwords;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef CTQ_FOLD_HH
+#define CTQ_FOLD_HH
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+/**
+ * @brief Folding rules of the normalized trie, combined as flags.
+ *
+ * width is the subset of NFKC found in dictionaries: full width ASCII and ideographic space to ASCII,
+ * half width katakana to full width, with the voiced sound marks composed with their kana.
+ * lower folds ASCII, Latin-1, Greek and Cyrillic capitals, and their full width forms.
+ */
+struct FoldRules {
+    static constexpr uint32_t kana  = 1 << 0; // katakana to hiragana
+    static constexpr uint32_t width = 1 << 1;
+    static constexpr uint32_t lower = 1 << 2;
+    static constexpr uint32_t all   = kana | width | lower;
+};
+
+namespace fold_detail {
+
+inline size_t decode_utf8(std::string_view s, size_t i, uint32_t &cp) {
+    const unsigned char c = s[i];
+    size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+
+    if (len == 0 || i + len > s.size()) {
+        cp = c; // invalid bytes are copied as is by fold_key
+        return 1;
+    }
+
+    cp = len == 1 ? c : c & (0x7F >> len);
+
+    for (size_t k = 1; k < len; ++k) {
+        if ((s[i + k] & 0xC0) != 0x80) {
+            cp = c;
+            return 1;
+        }
+
+        cp = (cp << 6) | (s[i + k] & 0x3F);
+    }
+
+    return len;
+}
+
+inline void encode_utf8(uint32_t cp, std::string &out) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// half width katakana U+FF61..U+FF9F, the sound marks as their combining forms
+inline uint32_t full_width_kana(uint32_t cp) {
+    static const uint16_t table[] = {
+        0x3002, 0x300C, 0x300D, 0x3001, 0x30FB, 0x30F2, 0x30A1, 0x30A3, 0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3, 0x30FC,
+        0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF, 0x30B1, 0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF,
+        0x30C1, 0x30C4, 0x30C6, 0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD, 0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8, 0x30DB, 0x30DE, 0x30DF,
+        0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9, 0x30EA, 0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3, 0x3099, 0x309A
+    };
+
+    return table[cp - 0xFF61];
+}
+
+// kana composed with the combining voiced (U+3099) or semi-voiced (U+309A) mark, 0 if none
+inline uint32_t compose_kana(uint32_t cp, uint32_t mark) {
+    const bool katakana = cp >= 0x30A1 && cp <= 0x30FE;
+    const uint32_t offset = katakana ? 0x60 : 0;
+    const uint32_t h = cp - offset;
+    const bool ha_row = h >= 0x306F && h <= 0x307B && (h - 0x306F) % 3 == 0;
+
+    if (mark == 0x309A) {
+        return ha_row ? cp + 2 : 0;
+    }
+
+    if ((h >= 0x304B && h <= 0x3061 && (h - 0x304B) % 2 == 0) || (h >= 0x3064 && h <= 0x3068 && (h - 0x3064) % 2 == 0) || ha_row || h == 0x309D) {
+        return cp + 1;
+    }
+
+    if (h == 0x3046) {
+        return katakana ? 0x30F4 : 0x3094;
+    }
+
+    if (cp >= 0x30EF && cp <= 0x30F2) { // ワ ヰ ヱ ヲ
+        return cp + 8;
+    }
+
+    return 0;
+}
+
+inline uint32_t to_lower(uint32_t cp) {
+    if ((cp >= 'A' && cp <= 'Z') || (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) || (cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2) || (cp >= 0x410 && cp <= 0x42F) || (cp >= 0xFF21 && cp <= 0xFF3A)) {
+        return cp + 0x20;
+    }
+
+    if (cp >= 0x400 && cp <= 0x40F) {
+        return cp + 0x50;
+    }
+
+    return cp;
+}
+
+}
+
+/**
+ * @brief s folded by rules, FoldRules flags. Keys and keywords folded by the same rules compare equal.
+ */
+inline std::string fold_key(std::string_view s, uint32_t rules) {
+    using namespace fold_detail;
+
+    std::string ret;
+    uint32_t last = 0; // last code point written, composed with a following sound mark
+    size_t last_pos = 0;
+
+    ret.reserve(s.size());
+
+    for (size_t i = 0; i < s.size();) {
+        uint32_t cp;
+        size_t len = decode_utf8(s, i, cp);
+
+        if (len == 1 && cp >= 0x80) {
+            ret += s[i++];
+            last = 0;
+            continue;
+        }
+
+        i += len;
+
+        if (rules & FoldRules::width) {
+            if (cp >= 0xFF01 && cp <= 0xFF5E) {
+                cp -= 0xFEE0;
+            } else if (cp == 0x3000) {
+                cp = ' ';
+            } else if (cp >= 0xFF61 && cp <= 0xFF9F) {
+                cp = full_width_kana(cp);
+            }
+
+            uint32_t composed = (cp == 0x3099 || cp == 0x309A) && last ? compose_kana(last, cp) : 0;
+
+            if (composed) {
+                ret.resize(last_pos);
+                cp = composed;
+            }
+        }
+
+        last     = cp;
+        last_pos = ret.size();
+
+        if ((rules & FoldRules::kana) && ((cp >= 0x30A1 && cp <= 0x30F6) || cp == 0x30FD || cp == 0x30FE)) {
+            cp -= 0x60;
+        }
+
+        if (rules & FoldRules::lower) {
+            cp = to_lower(cp);
+        }
+
+        encode_utf8(cp, ret);
+    }
+
+    return ret;
+}
+
+#endif
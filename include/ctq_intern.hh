@@ -0,0 +1,106 @@
+#ifndef CTQ_INTERN_HH
+#define CTQ_INTERN_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Distinct strings with provisional ids, in their order of first appearance.
+ *
+ * Strings are copied back to back into arena blocks that never move, the hash table keys are views of them.
+ * Ids are remapped once to the sorted or trie order when the alphabets are built.
+ */
+class InternTable {
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    InternTable() = default;
+    InternTable(InternTable &&) = default;
+    InternTable &operator=(InternTable &&) = default;
+
+    // id of s, added when missing
+    uint32_t intern(std::string_view s) {
+        auto it = m_ids.find(s);
+
+        if (it != m_ids.end()) return it->second;
+
+        std::string_view stored = store(s);
+        uint32_t id = m_symbols.size();
+
+        m_symbols.push_back(stored);
+        m_ids.emplace(stored, id);
+
+        return id;
+    }
+
+    // id of s, npos when missing
+    inline uint32_t find(std::string_view s) const {
+        auto it = m_ids.find(s);
+        return it != m_ids.end() ? it->second : npos;
+    }
+
+    inline std::string_view operator[](uint32_t id) const { return m_symbols[id]; }
+    inline size_t size() const { return m_symbols.size(); }
+
+    void merge(const InternTable &other) {
+        for (const auto e : other.m_symbols) {
+            intern(e);
+        }
+    }
+
+    // strings sorted, as built into the alphabets
+    std::vector<std::string> sorted() const {
+        std::vector<std::string_view> views(m_symbols);
+        std::sort(views.begin(), views.end());
+
+        return std::vector<std::string>(views.begin(), views.end());
+    }
+
+    // approximate heap usage
+    size_t bytes() const {
+        const size_t node_overhead = 2 * sizeof(void*);
+
+        return m_blocks.size() * block_size + m_large_bytes + m_symbols.capacity() * sizeof m_symbols[0]
+            + m_ids.bucket_count() * sizeof(void*) + m_ids.size() * (node_overhead + sizeof(std::pair<std::string_view, uint32_t>));
+    }
+
+private:
+    static constexpr size_t block_size = 1 << 16;
+
+    std::string_view store(std::string_view s) {
+        if (s.size() > block_size) {
+            m_large.emplace_back(new char[s.size()]);
+            m_large_bytes += s.size();
+            memcpy(m_large.back().get(), s.data(), s.size());
+
+            return std::string_view(m_large.back().get(), s.size());
+        }
+
+        if (m_blocks.empty() || m_used + s.size() > block_size) {
+            m_blocks.emplace_back(new char[block_size]);
+            m_used = 0;
+        }
+
+        char *p = m_blocks.back().get() + m_used;
+
+        memcpy(p, s.data(), s.size());
+        m_used += s.size();
+
+        return std::string_view(p, s.size());
+    }
+
+    std::vector<std::unique_ptr<char[]>>           m_blocks;
+    std::vector<std::unique_ptr<char[]>>           m_large; // longer than a block
+    size_t                                         m_large_bytes = 0;
+    size_t                                         m_used = 0; // in the last block
+    std::vector<std::string_view>                  m_symbols;
+    std::unordered_map<std::string_view, uint32_t> m_ids;
+};
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef CTQ_READER_H
 #define CTQ_READER_H
 
-#define CTQ_WRITER_MAX_SUPPORTED_VERSION "0.0.1"
+#define CTQ_WRITER_MAX_SUPPORTED_VERSION "0.1.0"
 #define CTQ_WRITER_MIN_SUPPORTED_VERSION "0.0.1"
 
 #ifdef __cplusplus
@@ -15,64 +15,431 @@ extern "C" {
 #endif
 
 typedef struct ctq_ctx_internal ctq_ctx;
+typedef struct ctq_multi_ctx_internal ctq_multi_ctx;
+typedef struct ctq_query_ctx_internal ctq_query_ctx;
 typedef struct {
     const char *key;
     uint64_t   *ids;
     size_t      id_cnt;
 } ctq_find_ret;
 
+typedef struct {
+    const char  *path;
+    const char **texts;
+    size_t       text_cnt;
+} ctq_get_paths_ret;
+
+#define CTQ_STATS_LATENCY_BUCKETS 20
+
+/**
+ * @brief Reader counters since creation or last reset.
+ * 
+ * Latency bucket i counts calls which took less than 2^i microseconds,
+ * the last bucket counts the slower ones.
+ */
+typedef struct ctq_reader_stats {
+    uint64_t find_calls;
+    uint64_t get_calls;
+    uint64_t clusters_read;
+    uint64_t compressed_bytes;
+    uint64_t decompressed_bytes;
+    uint64_t decompression_ns;
+    uint64_t trie_iterations;
+    uint64_t postings_scanned;
+    uint64_t filter_evaluations;
+    uint64_t find_cache_hits;
+    uint64_t find_cache_misses;
+    uint64_t find_cache_evictions;
+    uint64_t find_latency_us[CTQ_STATS_LATENCY_BUCKETS];
+    uint64_t get_latency_us[CTQ_STATS_LATENCY_BUCKETS];
+    uint64_t load_ns;       // open time, preload included, not reset
+    uint64_t preload_bytes; // decompressed clusters held in memory, not reset
+    uint64_t find_cache_bytes; // results held by the find cache, not reset
+} ctq_reader_stats;
+
 ctq_ctx      *ctq_create_reader(const char *filename);
+ctq_ctx      *ctq_create_preloaded_reader(const char *filename, unsigned thread_cnt);
 void          ctq_destroy_reader(ctq_ctx *ctx);
+int           ctq_reload(ctq_ctx *ctx, const char *filename);
 ctq_find_ret *ctq_find(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx);
+ctq_find_ret *ctq_find_normalized(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx);
+ctq_find_ret *ctq_find_paths(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, const int *path_idxs, size_t path_cnt, const char *filter, int filter_path_idx);
+long          ctq_count(const ctq_ctx *ctx, const char *keyword, int path_idx, const char *filter, int filter_path_idx, size_t limit);
+char        **ctq_complete(const ctq_ctx *ctx, const char *prefix, size_t k, int path_idx);
 char         *ctq_get (ctq_ctx *ctx, uint64_t id);
+ctq_get_paths_ret *ctq_get_paths(ctq_ctx *ctx, uint64_t id, const char **paths, size_t path_cnt);
 const char   *ctq_writer_version(const ctq_ctx *ctx);
 const char   *ctq_reader_version(const ctq_ctx *ctx);
+int           ctq_stats(const ctq_ctx *ctx, ctq_reader_stats *stats);
+
+// results of ctq_find_into are owned by query and valid until its next use, ordered by key like ctq_find
+ctq_query_ctx *ctq_create_query_ctx(void);
+void           ctq_destroy_query_ctx(ctq_query_ctx *query);
+long           ctq_find_into(const ctq_ctx *ctx, ctq_query_ctx *query, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx, const ctq_find_ret **ret);
 
 void ctq_find_ret_free(ctq_find_ret *arr);
+void ctq_get_paths_ret_free(ctq_get_paths_ret *arr);
+void ctq_complete_free(char **arr);
+
+ctq_multi_ctx *ctq_create_multi_reader(const char **filenames, size_t cnt);
+void           ctq_destroy_multi_reader(ctq_multi_ctx *ctx);
+ctq_find_ret  *ctq_multi_find(const ctq_multi_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx);
+char          *ctq_multi_get (ctq_multi_ctx *ctx, uint64_t id);
 
 #ifdef __cplusplus
 }
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <set>
 #include <exception>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <initializer_list>
 
 #include "ctq_util.hh"
-#include "xcdat.hpp"
-
-using trie_type = xcdat::trie_8_type;
+#include "ctq_trie.hh"
 
 namespace CTQ {
 
+class FindCache;
+class WorkerPool;
+
+/**
+ * @brief Path indexes matched by a query, as a bitset.
+ * 
+ * Empty, or holding 0, it matches any path like a path_idx of 0.
+ */
+class PathSet {
+public:
+    PathSet() = default;
+    PathSet(std::initializer_list<int> path_idxs) : PathSet(path_idxs.begin(), path_idxs.end()) {}
+
+    template<typename It>
+    PathSet(It begin, It end) {
+        for (; begin != end; ++begin) insert(*begin);
+    }
+
+    void insert(int path_idx) {
+        if (path_idx <= 0) {
+            m_any = true;
+            return;
+        }
+
+        if (m_bits.size() <= (size_t)path_idx >> 6) {
+            m_bits.resize(((size_t)path_idx >> 6) + 1);
+        }
+
+        m_bits[path_idx >> 6] |= 1ULL << (path_idx & 63);
+    }
+
+    inline bool any() const { return m_any || m_bits.empty(); }
+
+    inline bool contains(uint64_t path_idx) const {
+        return any() || ((path_idx >> 6) < m_bits.size() && (m_bits[path_idx >> 6] >> (path_idx & 63)) & 1);
+    }
+
+    inline const std::vector<uint64_t> &bits() const { return m_bits; }
+
+private:
+    std::vector<uint64_t> m_bits;
+    bool                  m_any = false;
+};
+
+/**
+ * @brief Reusable storage for find results.
+ * 
+ * Keys and ids are stored in flat arenas which are cleared, not freed, between queries.
+ * Views returned by operator[] are valid until the next query or reset.
+ * Calls which do not take a context use one kept by the calling thread.
+ */
+class QueryContext {
+public:
+    struct Entry {
+        std::string_view key;
+        const uint64_t  *ids;
+        size_t           id_cnt;
+    };
+
+    void reset();
+
+    inline size_t size() const { return m_ranges.size(); }
+    inline bool   empty() const { return m_ranges.empty(); }
+
+    inline Entry operator[](size_t index) const {
+        const Range &r = m_ranges[index];
+
+        return Entry{ std::string_view(m_keys.data() + r.key_start, r.key_len), m_ids.data() + r.id_start, r.id_cnt };
+    }
+
+private:
+    friend class Reader;
+    friend class FindCache;
+
+    struct Range {
+        size_t key_start;
+        size_t key_len;
+        size_t id_start;
+        size_t id_cnt;
+    };
+
+    std::string           m_keys;
+    std::vector<uint64_t> m_ids;
+    std::vector<Range>    m_ranges;
+    std::vector<bool>     m_seen; // by entry index
+    std::vector<uint32_t> m_seen_idx;
+    std::string           m_decoded;
+};
+
+/**
+ * @brief Counters updated by a Reader when built with CTQ_READER_STATS.
+ */
+struct StatsCounters {
+    std::atomic<uint64_t> find_calls{0};
+    std::atomic<uint64_t> get_calls{0};
+    std::atomic<uint64_t> clusters_read{0};
+    std::atomic<uint64_t> compressed_bytes{0};
+    std::atomic<uint64_t> decompressed_bytes{0};
+    std::atomic<uint64_t> decompression_ns{0};
+    std::atomic<uint64_t> trie_iterations{0};
+    std::atomic<uint64_t> postings_scanned{0};
+    std::atomic<uint64_t> filter_evaluations{0};
+    std::atomic<uint64_t> find_cache_hits{0};
+    std::atomic<uint64_t> find_cache_misses{0};
+    std::atomic<uint64_t> find_cache_evictions{0};
+    std::atomic<uint64_t> find_latency_us[CTQ_STATS_LATENCY_BUCKETS] = {};
+    std::atomic<uint64_t> get_latency_us[CTQ_STATS_LATENCY_BUCKETS] = {};
+};
+
+struct ReaderOptions {
+    bool     enable_filters = false;
+    bool     preload        = false; // decompresses every cluster at open, get then does no I/O
+    unsigned thread_cnt     = 0;     // preload threads, 0 for all cores
+    size_t   find_cache     = 0;     // bytes of find results kept for repeated queries, 0 for no cache
+};
+
 class Reader {
 public:
     Reader(const std::string &filename, bool enable_filters = false);
+    Reader(const std::string &filename, const ReaderOptions &options);
     ~Reader();
 
-    std::map<std::string, std::vector<uint64_t>> find(const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0) const;
+    /**
+     * @brief Entries whose texts at path_idx match keyword, a prefix when it ends with %.
+     * 
+     * normalized folds keyword with the fold rules of the file and walks the trie of folded keys,
+     * keys are listed as written. Throws for files written without fold rules.
+     */
+    std::map<std::string, std::vector<uint64_t>> find(const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+    size_t find(QueryContext &ctx, const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+
+    /**
+     * @brief Entries found at any of the paths, with a single walk of the trie.
+     */
+    std::map<std::string, std::vector<uint64_t>> find(const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+    size_t find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+
+    /**
+     * @brief Number of entries find would return without offset and count, at most limit when set.
+     * 
+     * Ids are not collected. An exact keyword without filter is counted on its posting list alone.
+     */
+    size_t count(const std::string &keyword, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, size_t limit = 0) const;
+    size_t count(QueryContext &ctx, const std::string &keyword, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, size_t limit = 0) const;
+    size_t count(const std::string &keyword, const PathSet &paths, const std::string &filter = "", int filter_path_idx = 0, size_t limit = 0) const;
+    size_t count(QueryContext &ctx, const std::string &keyword, const PathSet &paths, const std::string &filter = "", int filter_path_idx = 0, size_t limit = 0) const;
+
+    /**
+     * @brief The first k keys starting with prefix which have entries, at path_idx when set.
+     * 
+     * Postings are only read to check a key has entries at path_idx.
+     */
+    std::vector<std::string> complete(const std::string &prefix, size_t k, int path_idx = 0) const;
+    std::vector<std::string> complete(const std::string &prefix, size_t k, const PathSet &paths) const;
+
     std::string get(uint64_t id);
+
+    /**
+     * @brief Texts of an entry found at the given paths, by path.
+     * 
+     * Subtrees outside of the paths are skipped, their texts are not decoded.
+     */
+    std::map<std::string, std::vector<std::string>> get(uint64_t id, const std::vector<std::string> &paths);
+
+    /**
+     * @brief Texts of an entry in document order, empty if the file has no entries.
+     * 
+     * On column clusters only the structure and text columns are decoded.
+     */
+    std::vector<std::string> get_texts(uint64_t id);
     std::string get_writer_version() const;
     std::string get_reader_version() const;
 
+    /** @brief Snapshot of the counters, all zeros when built without CTQ_READER_STATS. */
+    ctq_reader_stats stats() const;
+    void reset_stats();
+
+    inline const FileLayout &layout() const { return m_layout; }
+
 public:
     const bool filter_support;
 
 private:
+    friend class MultiReader;
+
+    // cluster of the entry at or after id, preloaded or decoded into m_cluster up to the entry end when possible, -1 if there is none
+    long read_entry_cluster(uint64_t id, uint32_t &data_pos, const char *&cluster);
+    void preload(uint64_t clusters_end, unsigned thread_cnt);
+    // views into the string pool, or into buf which is overwritten
+    std::string_view trie_text(uint32_t trie_id, std::string &buf) const;
+    std::string_view decode_text(uint32_t text_id, std::string &buf) const;
+
+    template<typename P>
+    size_t find_postings(const Contiguous2dArray<P> &id_mapping, QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) const;
+    template<typename P>
+    size_t count_postings(const Contiguous2dArray<P> &id_mapping, QueryContext &ctx, const std::string &keyword, const PathSet &paths, const std::string &filter, int filter_path_idx, size_t limit) const;
+    template<typename P>
+    std::vector<std::string> complete_keys(const Contiguous2dArray<P> &id_mapping, const std::string &prefix, size_t k, const PathSet &paths) const;
+    // whether a text of the entry matches the filter, at filter_path_idx when set
+    template<typename P>
+    bool match_filter(const Contiguous2dArray<P> &id_mapping, uint32_t entry_idx, const std::string &clean_filter, bool exact_match, int filter_path_idx, std::string &buf, uint64_t &evaluations) const;
+
     std::ifstream                          input;
-    trie_type                              ch_trie;
+    AnyTrie                                ch_trie;
     std::vector<std::string>               xml_alphabet;
     std::vector<uint64_t>                  ids;
-    std::vector<uint16_t>                  pos;
+    std::vector<uint32_t>                  pos;
     std::vector<uint32_t>                  cluster_offset_idx;
     Contiguous2dArray<uint32_t>            id_mapping;
+    Contiguous2dArray<uint64_t>            id_mapping_wide; // used instead of id_mapping when postings are 8 bytes
     Contiguous2dArray<uint32_t>            paths_mapping;
-    std::vector<uint32_t>                  cluster_offsets;
+    std::vector<uint64_t>                  cluster_offsets;
+    std::vector<uint32_t>                  ch_trie_ids; // cluster text id -> ch_trie id, empty when identical
+    Contiguous2dArray<char>                m_string_pool; // ch_trie id -> text, empty unless written with a string pool
+    AnyTrie                                m_fold_trie; // keys folded by the fold rules of the layout, empty without
+    Contiguous2dArray<uint32_t>            m_fold_mapping; // m_fold_trie id -> ch_trie ids
     long                                   m_header_end;
     uint32_t                               m_writer_version_major;
     uint32_t                               m_writer_version_minor;
     uint32_t                               m_writer_version_patch;
+    FileLayout                             m_layout;
+    mutable StatsCounters                  m_stats;
+    std::vector<char>                      m_compressed; // read buffers of get, reused between calls
+    std::vector<char>                      m_cluster;
+    long                                   m_cluster_idx = -1; // cluster held by m_cluster, reused by the next get of one of its entries
+    long                                   m_cluster_len = 0;  // bytes decoded into m_cluster
+    bool                                   m_cluster_whole = false;
+    std::vector<char>                      m_arena; // preloaded clusters, back to back
+    std::vector<uint64_t>                  m_arena_offsets; // cluster idx -> start in m_arena, then the arena size
+    uint64_t                               m_load_ns = 0;
+    std::unique_ptr<FindCache>             m_find_cache;
+};
+
+/**
+ * @brief A Reader whose file can be replaced while queries run.
+ * 
+ * A query pins the current Reader in a hazard record, without lock. Records are reused once released
+ * and added when all are held, so a query never waits for another one. reload() swaps the new Reader in
+ * then frees the previous one once no record holds it, in-flight queries finish on the previous file.
+ * get follows the rules of Reader, concurrent gets need a preloaded reader.
+ */
+class ReloadableReader {
+    struct HazardRecord {
+        std::atomic<Reader*>      reader{nullptr};
+        std::atomic<bool>         used{false};
+        std::atomic<const void*>  thread{nullptr}; // tag of the thread holding the record
+        HazardRecord             *next = nullptr;
+    };
+
+public:
+    // keeps a Reader alive until destroyed
+    class Snapshot {
+    public:
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+        Snapshot(Snapshot &&other) : m_record(other.m_record), m_reader(other.m_reader) { other.m_record = nullptr; }
+        ~Snapshot();
+
+        inline Reader *operator->() const { return m_reader; }
+        inline Reader &operator*() const { return *m_reader; }
+
+    private:
+        friend class ReloadableReader;
+        Snapshot(HazardRecord *record, Reader *reader) : m_record(record), m_reader(reader) {}
+
+        HazardRecord *m_record;
+        Reader       *m_reader;
+    };
+
+    ReloadableReader(const std::string &filename, const ReaderOptions &options = {});
+    ~ReloadableReader();
+
+    Snapshot acquire() const;
+
+    /**
+     * @brief Opens filename with the options of the handle and swaps it in.
+     * 
+     * Throws reader_exception and keeps the current file when filename cannot be opened.
+     * Returns once no query runs on the previous file. Stats start over with the new file.
+     * Must not be called while holding a Snapshot: the previous file is then only retired,
+     * and freed by a later reload or the destructor, since waiting for the caller would never end.
+     */
+    void reload(const std::string &filename);
+
+    // reloads so far
+    inline uint64_t generation() const { return m_generation.load(std::memory_order_relaxed); }
+
+    std::map<std::string, std::vector<uint64_t>> find(const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+    size_t find(QueryContext &ctx, const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+    size_t find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter = "", int filter_path_idx = 0, bool normalized = false) const;
+    size_t count(const std::string &keyword, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0, size_t limit = 0) const;
+    std::vector<std::string> complete(const std::string &prefix, size_t k, int path_idx = 0) const;
+    std::string get(uint64_t id);
+    std::map<std::string, std::vector<std::string>> get(uint64_t id, const std::vector<std::string> &paths);
+
+private:
+    // whether a record other than the ones of the calling thread holds reader, set when one of those does
+    bool is_held(Reader *reader, bool &held_by_caller) const;
+
+    ReaderOptions                       m_options;
+    std::atomic<Reader*>                m_current;
+    mutable std::atomic<HazardRecord*>  m_records{nullptr}; // pushed at the head, freed by the destructor
+    std::vector<Reader*>                m_retired; // previous Readers still held by the thread which reloaded
+    std::atomic<uint64_t>               m_generation{0};
+    std::mutex                          m_reload_mutex; // serializes reloads, never taken by queries
+};
+
+/**
+ * @brief Queries a set of ctq files as a single dictionary.
+ * 
+ * Ids are tagged with the index of their shard in the 8 upper bits, shards holding larger ids are rejected.
+ */
+class MultiReader {
+public:
+    MultiReader(const std::vector<std::string> &filenames, bool enable_filters = false);
+    ~MultiReader();
+
+    /**
+     * Shards are searched in parallel on threads kept by the MultiReader. Keys found in several shards are merged,
+     * their ids being ordered by shard. Merged keys are ordered by bytes, offset and count apply to their ids
+     * in that order, so every shard is searched in full.
+     */
+    std::map<std::string, std::vector<uint64_t>> find(const std::string &keyword, size_t offset = 0, size_t count = 0, int path_idx = 0, const std::string &filter = "", int filter_path_idx = 0) const;
+    std::string get(uint64_t id);
+    std::map<std::string, std::vector<std::string>> get(uint64_t id, const std::vector<std::string> &paths);
+
+    inline size_t size() const { return m_readers.size(); }
+
+    static inline uint64_t make_id(uint32_t shard, uint64_t id) { return ((uint64_t)shard << 56) | id; }
+    static inline uint32_t shard_of(uint64_t id) { return id >> 56; }
+    static inline uint64_t local_id(uint64_t id) { return id & ((1ULL << 56) - 1); }
+
+private:
+    std::vector<std::unique_ptr<Reader>> m_readers;
+    std::unique_ptr<WorkerPool>          m_pool; // searches the shards after the first, null for a single shard
 };
 
 class reader_exception : public std::exception {
@@ -0,0 +1,75 @@
+#ifndef CTQ_TRIE_HH
+#define CTQ_TRIE_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <optional>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+
+#include "ctq_util.hh"
+#include "xcdat.hpp"
+
+/**
+ * @brief One of the xcdat trie variants, the one a file was written with.
+ *
+ * 7 and 15 bits variants are smaller, 8 and 16 bits ones are faster.
+ * Calls are dispatched on the variant, hot loops get the trie itself through visit().
+ */
+class AnyTrie {
+public:
+    using variant_type = std::variant<xcdat::trie_8_type, xcdat::trie_7_type, xcdat::trie_15_type, xcdat::trie_16_type>;
+
+    AnyTrie() = default;
+
+    /**
+     * @param keys Unique and sorted, throws xcdat::exception otherwise
+     * @param bits A variant accepted by is_trie_variant
+     */
+    AnyTrie(const std::vector<std::string> &keys, unsigned bits) {
+        switch (bits) {
+            case 7:  m_trie.emplace<xcdat::trie_7_type>(keys);  break;
+            case 15: m_trie.emplace<xcdat::trie_15_type>(keys); break;
+            case 16: m_trie.emplace<xcdat::trie_16_type>(keys); break;
+            default: m_trie.emplace<xcdat::trie_8_type>(keys);  break;
+        }
+    }
+
+    template<typename F>
+    decltype(auto) visit(F &&f) const { return std::visit(std::forward<F>(f), m_trie); }
+
+    void load(std::istream &is, unsigned bits) {
+        switch (bits) {
+            case 7:  m_trie = xcdat::load<xcdat::trie_7_type>(is);  break;
+            case 15: m_trie = xcdat::load<xcdat::trie_15_type>(is); break;
+            case 16: m_trie = xcdat::load<xcdat::trie_16_type>(is); break;
+            default: m_trie = xcdat::load<xcdat::trie_8_type>(is);  break;
+        }
+    }
+
+    void save(std::ostream &os) const {
+        visit([&os](const auto &trie) { xcdat::save(trie, os); });
+    }
+
+    unsigned bits() const {
+        static const unsigned variant_bits[] = { 8, 7, 15, 16 };
+        return variant_bits[m_trie.index()];
+    }
+
+    uint64_t num_keys() const { return visit([](const auto &trie) { return trie.num_keys(); }); }
+
+    std::optional<uint64_t> lookup(std::string_view key) const {
+        return visit([key](const auto &trie) { return trie.lookup(key); });
+    }
+
+    std::string decode(uint64_t id) const { return visit([id](const auto &trie) { return trie.decode(id); }); }
+    void decode(uint64_t id, std::string &buf) const { visit([id, &buf](const auto &trie) { trie.decode(id, buf); }); }
+
+private:
+    variant_type m_trie;
+};
+
+#endif
@@ -8,6 +8,11 @@
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "ctq_fold.hh"
 
 inline std::string ltrim(std::string s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char c) { return !std::isspace(c); }));
@@ -33,6 +38,84 @@ inline bool is_bp_balenced(const std::vector<bool> &bp) {
     return open_cnt == 0;
 }
 
+// Size of the packed bp at p, leading padding zeros included
+inline size_t packed_bp_size(const char *p, const char *end) {
+    const char *b = p;
+    long open_cnt = -1;
+
+    for (; b < end && open_cnt != 0; ++b) {
+        for (int j = 7; j >= 0 && open_cnt != 0; --j) {
+            bool bit = 1 & (*b >> j);
+
+            if (open_cnt < 0 && !bit) continue;
+            if (open_cnt < 0) open_cnt = 0;
+
+            open_cnt += bit ? 1 : -1;
+        }
+    }
+
+    return b - p;
+}
+
+template<typename T>
+struct ArrayView {
+    const T *first;
+    const T *last;
+
+    inline const T *begin() const { return first; }
+    inline const T *end() const { return last; }
+    inline size_t size() const { return last - first; }
+};
+
+// Writes the width low bytes of each value
+template<typename T>
+void write_uints(std::ostream &os, const T *values, size_t cnt, unsigned width) {
+    if (width == sizeof(T)) {
+        os.write((const char*)values, cnt * sizeof(T));
+        return;
+    }
+
+    std::vector<char> buf(cnt * width);
+
+    for (size_t i = 0; i < cnt; ++i) {
+        memcpy(buf.data() + i * width, &values[i], width);
+    }
+
+    os.write(buf.data(), buf.size());
+}
+
+template<typename T>
+void read_uints(std::istream &is, T *values, size_t cnt, unsigned width) {
+    if (width == sizeof(T)) {
+        is.read((char*)values, cnt * sizeof(T));
+        return;
+    }
+
+    std::vector<char> buf(cnt * width);
+    is.read(buf.data(), buf.size());
+
+    for (size_t i = 0; i < cnt; ++i) {
+        values[i] = 0;
+        memcpy(&values[i], buf.data() + i * width, width);
+    }
+}
+
+template<typename T>
+inline void write_uint(std::ostream &os, T value, unsigned width) { write_uints(os, &value, 1, width); }
+
+template<typename T>
+inline T read_uint(std::istream &is, unsigned width) {
+    T value = 0;
+    read_uints(is, &value, 1, width);
+    return value;
+}
+
+/**
+ * @brief Rows of values stored back to back.
+ * 
+ * Saved as the row count, the value count, the row starts then the values.
+ * Counts and row starts take count_bytes each: 8 in files from 0.1.0, 4 in legacy ones.
+ */
 template<typename T>
 class Contiguous2dArray {
 public:
@@ -40,7 +123,7 @@ public:
 
     Contiguous2dArray(const std::vector<std::vector<T>> &vec, bool makeUnique = false) {
         for (const auto e : vec) {
-            unsigned start = m_arr.size();
+            uint64_t start = m_arr.size();
 
             std::vector<T> v(e);
 
@@ -50,54 +133,244 @@ public:
                 v.erase(last, v.end());
             }
 
-            for (unsigned i = 0; i < v.size(); ++i) {
+            for (size_t i = 0; i < v.size(); ++i) {
                 m_arr.push_back(v[i]);
             }
 
-            assert(m_arr.size());
-
             m_range_mapper.push_back(start);
         }
     }
 
-    Contiguous2dArray(std::istream &is) {
-        uint32_t cnt;
-        uint32_t arr_size;
+    // rows from (row, value) pairs sorted by row
+    template<typename U>
+    Contiguous2dArray(const std::vector<std::pair<uint32_t, U>> &pairs, unsigned row_cnt) {
+        auto it = pairs.begin();
+
+        for (unsigned i = 0; i < row_cnt; ++i) {
+            m_range_mapper.push_back(m_arr.size());
+
+            for (; it != pairs.end() && it->first == i; ++it) {
+                m_arr.push_back(static_cast<T>(it->second));
+            }
+        }
+    }
+
+    Contiguous2dArray(std::istream &is, unsigned count_bytes = 4) {
+        uint64_t cnt      = read_uint<uint64_t>(is, count_bytes);
+        uint64_t arr_size = read_uint<uint64_t>(is, count_bytes);
 
-        is.read((char*)&cnt, sizeof cnt);
-        is.read((char*)&arr_size, sizeof arr_size);
+        if (!is.good()) return;
 
         m_range_mapper.resize(cnt);
         m_arr.resize(arr_size);
 
-        is.read((char*)m_range_mapper.data(), cnt * sizeof m_range_mapper[0]);
+        read_uints(is, m_range_mapper.data(), cnt, count_bytes);
         is.read((char*)m_arr.data(), arr_size * sizeof m_arr[0]);
     }
 
-    inline unsigned size() const { return m_range_mapper.size(); }
+    inline size_t size() const { return m_range_mapper.size(); }
+    inline size_t value_cnt() const { return m_arr.size(); }
+
+    inline void push_row(const T *first, size_t cnt) {
+        m_range_mapper.push_back(m_arr.size());
+        m_arr.insert(m_arr.end(), first, first + cnt);
+    }
+
+    // fits the counts and row starts of count_bytes
+    inline bool fits(unsigned count_bytes) const {
+        return count_bytes == 8 || (m_range_mapper.size() <= UINT32_MAX && m_arr.size() <= UINT32_MAX);
+    }
 
-    inline void save(std::ostream &os) const {
-        uint32_t cnt = size();
-        uint32_t arr_size = m_arr.size();
+    inline void save(std::ostream &os, unsigned count_bytes = 4) const {
+        assert(fits(count_bytes));
 
-        os.write((char*)&cnt, sizeof cnt);
-        os.write((char*)&arr_size, sizeof arr_size);
-        os.write((char*)m_range_mapper.data(), cnt * sizeof m_range_mapper[0]);
-        os.write((char*)m_arr.data(), arr_size * sizeof m_arr[0]);
+        write_uint<uint64_t>(os, size(), count_bytes);
+        write_uint<uint64_t>(os, m_arr.size(), count_bytes);
+        write_uints(os, m_range_mapper.data(), size(), count_bytes);
+        os.write((char*)m_arr.data(), m_arr.size() * sizeof m_arr[0]);
     }
 
 
-    inline const std::vector<T> operator[](unsigned index) const {
-        unsigned start = m_range_mapper[index];
-        unsigned end   = index+1 < m_range_mapper.size() ? m_range_mapper[index+1] : m_arr.size();
+    inline const std::vector<T> operator[](size_t index) const {
+        uint64_t start = m_range_mapper[index];
+        uint64_t end   = index+1 < m_range_mapper.size() ? m_range_mapper[index+1] : m_arr.size();
         auto beg = m_arr.begin();
 
         return std::vector<T>(beg + start, beg + end);
     }
 
+    // same as operator[] without copying the row
+    inline ArrayView<T> row(size_t index) const {
+        uint64_t start = m_range_mapper[index];
+        uint64_t end   = index+1 < m_range_mapper.size() ? m_range_mapper[index+1] : m_arr.size();
+
+        return ArrayView<T>{ m_arr.data() + start, m_arr.data() + end };
+    }
+
 private:
-    std::vector<T> m_arr;
-    std::vector<unsigned> m_range_mapper;
+    std::vector<T>        m_arr;
+    std::vector<uint64_t> m_range_mapper;
+};
+
+// LEB128, at most 5 bytes
+inline void put_varint(std::vector<char> &buf, uint32_t value) {
+    while (value >= 0x80) {
+        buf.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+
+    buf.push_back((char)value);
+}
+
+inline unsigned varint_size(uint64_t value) {
+    unsigned size = 1;
+
+    for (; value >= 0x80; value >>= 7) ++size;
+
+    return size;
+}
+
+/**
+ * @brief Decodes the varint at p and moves p past it.
+ * 
+ * With 8 readable bytes the varint is decoded from a single word: the first clear high bit gives its length.
+ * 
+ * @return false if the varint is truncated or longer than 5 bytes
+ */
+inline bool get_varint(const char *&p, const char *end, uint32_t &value) {
+    if (end - p >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof w);
+
+        uint64_t stops = ~w & 0x8080808080808080ULL;
+        if ((stops & 0xFFFFFFFFFFULL) == 0) return false;
+
+        unsigned len = 0;
+        while (!(stops & (0x80ULL << (8 * len)))) ++len;
+        ++len;
+
+        w &= (1ULL << (8 * len)) - 1;
+        value = (uint32_t)((w & 0x7F) | ((w >> 1) & 0x3F80) | ((w >> 2) & 0x1FC000) | ((w >> 3) & 0xFE00000) | ((w >> 4) & 0xF0000000));
+        p += len;
+
+        return true;
+    }
+
+    value = 0;
+
+    for (unsigned shift = 0; p < end && shift < 35; shift += 7) {
+        uint8_t b = *p++;
+        value |= (uint32_t)(b & 0x7F) << shift;
+
+        if (!(b & 0x80)) return true;
+    }
+
+    return false;
+}
+
+// Reads an element word, a varint or 4 bytes
+inline bool get_word(const char *&p, const char *end, bool varint, uint32_t &word) {
+    if (varint) return get_varint(p, end, word);
+    if (end - p < (long)sizeof word) return false;
+
+    memcpy(&word, p, sizeof word);
+    p += sizeof word;
+
+    return true;
+}
+
+// xcdat trie variants, by the bits of their BC encoding
+inline bool is_trie_variant(unsigned bits) {
+    return bits == 7 || bits == 8 || bits == 15 || bits == 16;
+}
+
+/**
+ * @brief Widths of the variable size fields of a file.
+ * 
+ * Files older than 0.1.0 have no layout section, their fields have the widths of legacy().
+ * From 0.1.0, the layout follows the version and counts and footer start are 64 bits.
+ */
+struct FileLayout {
+    uint32_t flags              = 0; // optional sections
+    uint8_t  id_bytes           = 8;
+    uint8_t  pos_bytes          = 4; // entry position in its cluster
+    uint8_t  cluster_idx_bytes  = 4;
+    uint8_t  offset_bytes       = 8; // cluster offsets
+    uint8_t  posting_bytes      = 8; // id mapping values, entry idx << path_bits | path idx
+    uint8_t  path_bits          = 8;
+    uint8_t  cluster_size_bytes = 4; // raw size in cluster headers
+    bool     v2                 = true;
+
+    static constexpr size_t bytes = sizeof(uint32_t) + 7;
+
+    static constexpr uint32_t varint_elements = 1 << 0; // cluster element words are varints
+    static constexpr uint32_t column_clusters = 1 << 1; // clusters are split into structure, tag and text columns
+    static constexpr uint32_t cluster_flags   = varint_elements | column_clusters;
+    static constexpr uint32_t string_pool     = 1 << 2; // the footer ends with the texts, by ch_trie id
+    static constexpr uint32_t known_flags     = cluster_flags | string_pool;
+    static constexpr unsigned trie_shift      = 8;
+    static constexpr uint32_t trie_mask       = 0xFF << trie_shift; // trie variant, 0 for the 8 bits one
+    static constexpr unsigned fold_shift      = 16;
+    static constexpr uint32_t fold_mask       = 0xFF << fold_shift; // FoldRules of the normalized trie ending the footer, 0 for none
+
+    static FileLayout legacy() {
+        FileLayout ret;
+
+        ret.pos_bytes          = 2;
+        ret.offset_bytes       = 4;
+        ret.posting_bytes      = 4;
+        ret.cluster_size_bytes = 2;
+        ret.v2                 = false;
+
+        return ret;
+    }
+
+    inline unsigned count_bytes() const { return v2 ? 8 : 4; }
+    inline uint64_t path_mask() const { return (1ULL << path_bits) - 1; }
+    inline bool has(uint32_t flag) const { return flags & flag; }
+
+    inline unsigned trie_variant() const {
+        unsigned bits = (flags & trie_mask) >> trie_shift;
+        return bits ? bits : 8;
+    }
+
+    inline void set_trie_variant(unsigned bits) {
+        flags = (flags & ~trie_mask) | (bits == 8 ? 0 : bits << trie_shift);
+    }
+
+    inline uint32_t fold_rules() const { return (flags & fold_mask) >> fold_shift; }
+    inline void set_fold_rules(uint32_t rules) { flags = (flags & ~fold_mask) | (rules << fold_shift); }
+
+    void save(std::ostream &os) const {
+        uint8_t widths[] = { id_bytes, pos_bytes, cluster_idx_bytes, offset_bytes, posting_bytes, path_bits, cluster_size_bytes };
+
+        os.write((char*)&flags, sizeof flags);
+        os.write((char*)widths, sizeof widths);
+    }
+
+    void load(std::istream &is) {
+        uint8_t widths[7];
+
+        is.read((char*)&flags, sizeof flags);
+        is.read((char*)widths, sizeof widths);
+
+        id_bytes           = widths[0];
+        pos_bytes          = widths[1];
+        cluster_idx_bytes  = widths[2];
+        offset_bytes       = widths[3];
+        posting_bytes      = widths[4];
+        path_bits          = widths[5];
+        cluster_size_bytes = widths[6];
+        v2                 = true;
+    }
+
+    // widths this reader can handle
+    bool valid() const {
+        auto is_width = [](uint8_t w, uint8_t max) { return w == 1 || w == 2 || w == 4 || (w == 8 && max == 8); };
+
+        return (flags & ~(known_flags | trie_mask | fold_mask)) == 0 && is_trie_variant(trie_variant()) && (fold_rules() & ~FoldRules::all) == 0 && is_width(id_bytes, 8) && is_width(pos_bytes, 4) && is_width(cluster_idx_bytes, 4) && is_width(offset_bytes, 8) 
+            && (posting_bytes == 4 || posting_bytes == 8) && path_bits > 0 && path_bits < 8 * posting_bytes && is_width(cluster_size_bytes, 4);
+    }
 };
 
 #endif
\ No newline at end of file
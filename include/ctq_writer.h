@@ -3,19 +3,153 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <istream>
+#include <functional>
 
 namespace CTQ {
 
+/**
+ * @brief Reports the progress of a pass over the input.
+ * 
+ * @param phase "parse" for the first pass, "transform" for the second one
+ * @param entry_cnt Entries processed so far by the pass
+ * @param done True on the last call of the pass
+ */
+using ProgressCallback = std::function<void(const char *phase, size_t entry_cnt, bool done)>;
+
+struct SizeDistribution {
+    size_t   count = 0;
+    uint64_t total = 0;
+    uint32_t min   = 0;
+    uint32_t p50   = 0;
+    uint32_t p90   = 0;
+    uint32_t p99   = 0;
+    uint32_t max   = 0;
+};
+
+/**
+ * @brief Report of a write, times are wall clock seconds.
+ * 
+ * Compression runs within the transform pass, its time is summed over threads.
+ * Memory figures are the peak size of the structures, in bytes.
+ */
+struct WriteStats {
+    double           parse_time          = 0; // first pass
+    double           alphabet_time       = 0; // alphabets and trie build and save
+    double           transform_time      = 0; // second pass
+    double           compression_time    = 0;
+    double           footer_time         = 0; // header, postings and cluster offsets
+    double           total_time          = 0;
+    size_t           entry_cnt           = 0;
+    size_t           ch_alpha_bytes      = 0;
+    size_t           id_mapping_bytes    = 0;
+    size_t           paths_mapping_bytes = 0;
+    size_t           string_pool_bytes   = 0; // in the file
+    size_t           fold_trie_bytes     = 0; // in the file, with the mapping to the keys
+    size_t           posting_runs        = 0; // sorted runs spilled to temporary files
+    SizeDistribution cluster_raw_size;
+    SizeDistribution cluster_compressed_size;
+};
+
+struct WriteOptions {
+    std::vector<std::string> paths;                     // UNIQUE AND SORTED !!!!
+    uint32_t                 cluster_size    = 64000;   // Raw bytes per cluster, at most 65535 for legacy files
+    unsigned                 thread_cnt      = 1;       // Splits the body in as many entry aligned shards, 0 for all cores
+    ProgressCallback         progress;                  // Sharded passes only report their end
+    size_t                   progress_step   = 1000;    // Entries between two progress calls
+    WriteStats              *stats           = nullptr; // Filled when set
+    bool                     legacy_format   = false;   // Writes 0.0.2 files, readable by older readers, when the input fits
+    bool                     wide_fields     = false;   // Uses the widest layout whatever the input size
+    bool                     column_clusters = false;   // Stores structure, tags and texts of a cluster in separate columns
+    bool                     string_pool     = false;   // Stores every text a second time for constant time lookup by id
+    unsigned                 trie_variant    = 8;       // xcdat trie of the keys, 7 or 15 for smaller files, 8 or 16 for faster finds
+    uint32_t                 fold_rules      = 0;       // FoldRules of a second trie of folded keys for normalized finds, 0 for none
+    std::string              order_path;                // Clusters entries by their first text at this path instead of document order, not applied by update
+    std::vector<uint64_t>    entry_order;               // Clusters entries in this id order, e.g. read together in an access log, others follow in document order
+    size_t                   memory_budget   = 0;       // Bytes of postings held in memory, past it sorted runs are spilled to temporary files and merged in the footer, 0 for no limit
+    std::string              temp_dir;                  // Directory of the spilled runs and spooled input, the system temporary directory when empty
+    unsigned                 merge_fan_in    = 64;      // Spilled runs merged at once, each one holding an open file, more runs take several passes
+    size_t                   spool_budget    = 1 << 26; // Compressed bytes of a non seekable input held in memory, past it the input is spooled to a temporary file, 0 for no limit
+};
+
 /**
  * @brief 
  * 
  * @param src 
  * @param dst 
  * @param paths Array of unique sorted path. UNIQUE AND SORTED !!!!
- * @param cluster_size Value in the range [0, 65535]
+ * @param cluster_size Raw bytes per cluster
  * @return int 
  */
-int write(const std::string &src, const std::string &dst, const std::vector<std::string> &paths = {}, uint16_t cluster_size = 64000);
+int write(const std::string &src, const std::string &dst, const std::vector<std::string> &paths = {}, uint32_t cluster_size = 64000);
+int write(const std::string &src, const std::string &dst, const WriteOptions &options);
+
+/**
+ * @brief Fills buf with at most size bytes of input.
+ * 
+ * @return long Number of bytes read, 0 at the end of the input, -1 on error
+ */
+using ReadCallback = std::function<long(char *buf, size_t size)>;
+
+/**
+ * @brief Encodes a non seekable input.
+ * 
+ * The input is read once. It is kept LZ4 compressed for the second pass, in memory up to options.spool_budget
+ * bytes and past it in a temporary file of options.temp_dir.
+ * options.thread_cnt is ignored.
+ */
+int write(std::istream &src, const std::string &dst, const WriteOptions &options);
+int write(const ReadCallback &src, const std::string &dst, const WriteOptions &options);
+
+/**
+ * @brief Encodes an input held in memory, options.thread_cnt is ignored.
+ */
+int write(const char *data, size_t size, const std::string &dst, const WriteOptions &options);
+
+/**
+ * @brief Applies a TEI delta to an existing file and saves the result to dst.
+ * 
+ * Entries of delta are added, or replace the entries with the same xml:id.
+ * An entry marked <entry xml:id="..." type="delete"/> is removed.
+ * Clusters without removed entries are copied as is, others are rebuilt and new entries are appended.
+ * Keys left without entries stay in the trie until the next full write.
+ * 
+ * @param src Existing ctq file
+ * @param delta TEI delta
+ * @param dst Must differ from src
+ * @param paths Same paths as the ones src was written with. UNIQUE AND SORTED !!!!
+ * @param cluster_size Raw bytes per cluster
+ * @return int 
+ */
+int update(const std::string &src, const std::string &delta, const std::string &dst, const std::vector<std::string> &paths = {}, uint32_t cluster_size = 64000);
+int update(const std::string &src, const std::string &delta, const std::string &dst, const WriteOptions &options);
+
+/**
+ * @brief Sampled entries clustered at one candidate cluster size.
+ */
+struct ClusterSizeTrial {
+    uint32_t cluster_size     = 0;
+    size_t   cluster_cnt      = 0;
+    size_t   raw_bytes        = 0;
+    size_t   compressed_bytes = 0; // cluster headers and offsets included
+    double   get_p50_us       = 0; // decompression done by get for an entry
+    double   get_p99_us       = 0;
+    bool     chosen           = false;
+};
+
+/**
+ * @brief Picks the cluster size with the lowest p99 get decompression time among the sizes whose output
+ * is at most size_budget times the smallest one.
+ * 
+ * Windows of sample_cnt entries in total, spread over the input, are encoded like a write would, then clustered
+ * and compressed at each candidate size. The ordering options are applied.
+ * 
+ * @param trials One row per candidate size, in increasing size
+ * @return The chosen size, 0 on error
+ */
+uint32_t tune_cluster_size(const std::string &src, const WriteOptions &options, std::vector<ClusterSizeTrial> &trials, double size_budget = 2.0, size_t sample_cnt = 20000);
+uint32_t tune_cluster_size(const char *data, size_t size, const WriteOptions &options, std::vector<ClusterSizeTrial> &trials, double size_budget = 2.0, size_t sample_cnt = 20000);
 
 class writer_exception : public std::exception {
 public:
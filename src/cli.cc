@@ -18,12 +18,74 @@ void print_paths(const std::vector<std::string> &paths, int max_path_len) {
     }
 }
 
+// a dot every 100 entries, the count every 5000
+void print_progress(const char *phase, size_t entry_cnt, bool done) {
+    const size_t step = 5000;
+
+    if (done) {
+        std::cout << ' ' << entry_cnt << " (" << phase << ")" << std::endl;
+    } else if (entry_cnt % step == 0) {
+        std::cout << ' ' << entry_cnt << std::endl;
+    } else {
+        std::cout << '.' << std::flush;
+    }
+}
+
+void print_distribution(const char *name, const CTQ::SizeDistribution &d) {
+    std::cout << name << d.count << " clusters, " << d.total << " bytes, min " << d.min << ", p50 " << d.p50 << ", p90 " << d.p90 << ", p99 " << d.p99 << ", max " << d.max << std::endl;
+}
+
+void print_trials(const std::vector<CTQ::ClusterSizeTrial> &trials) {
+    std::cout << "cluster size | clusters | raw bytes | compressed | get p50 us | get p99 us" << std::endl;
+
+    for (const auto &e : trials) {
+        char line[128];
+
+        snprintf(line, sizeof line, "%12u | %8zu | %9zu | %10zu | %10.2f | %10.2f%s", e.cluster_size, e.cluster_cnt, e.raw_bytes, e.compressed_bytes, e.get_p50_us, e.get_p99_us, e.chosen ? " *" : "");
+        std::cout << line << std::endl;
+    }
+}
+
+void print_stats(const CTQ::WriteStats &stats) {
+    auto kib = [](size_t bytes) { return std::to_string(bytes / 1024) + " KiB"; };
+
+    std::cout << "entries:            " << stats.entry_cnt << std::endl;
+    std::cout << "parse pass:         " << stats.parse_time << " s" << std::endl;
+    std::cout << "alphabets and trie: " << stats.alphabet_time << " s" << std::endl;
+    std::cout << "transform pass:     " << stats.transform_time << " s" << std::endl;
+    std::cout << "  compression:      " << stats.compression_time << " s" << std::endl;
+    std::cout << "footer:             " << stats.footer_time << " s" << std::endl;
+    std::cout << "total:              " << stats.total_time << " s" << std::endl;
+    std::cout << "ch_alpha peak:      " << kib(stats.ch_alpha_bytes) << std::endl;
+    std::cout << "id_mapping peak:    " << kib(stats.id_mapping_bytes) << std::endl;
+    std::cout << "paths_mapping peak: " << kib(stats.paths_mapping_bytes) << std::endl;
+    std::cout << "string pool:        " << kib(stats.string_pool_bytes) << std::endl;
+    std::cout << "fold trie:          " << kib(stats.fold_trie_bytes) << std::endl;
+    std::cout << "posting runs:       " << stats.posting_runs << std::endl;
+    print_distribution("raw clusters:       ", stats.cluster_raw_size);
+    print_distribution("compressed:         ", stats.cluster_compressed_size);
+}
+
 int main(int argc, char **argv) {
     argparse::ArgumentParser program("ctq_cli");
-    program.add_argument("-s", "--source").required();
+    program.add_argument("-s", "--source").required().help("TEI file, - for stdin");
     program.add_argument("-d", "--destination").default_value("");
     program.add_argument("-p", "--paths").default_value("");
-    program.add_argument("-c", "--cluster_size").default_value(64000).scan<'i', int>();
+    program.add_argument("-c", "--cluster_size").default_value("64000").help("Raw bytes per cluster, auto to pick one from sampled entries");
+    program.add_argument("--size_budget").default_value(2.0).scan<'g', double>().help("With auto, the file may grow up to this factor for faster gets");
+    program.add_argument("-t", "--threads").default_value(1).scan<'i', int>().help("Number of shards encoded in parallel, 0 for all cores");
+    program.add_argument("-u", "--update").default_value("").help("TEI delta applied to the ctq file given as source");
+    program.add_argument("--legacy").default_value(false).implicit_value(true).help("Write the 0.0.2 format read by older readers");
+    program.add_argument("--columns").default_value(false).implicit_value(true).help("Split clusters into structure, tag and text columns");
+    program.add_argument("--string_pool").default_value(false).implicit_value(true).help("Store texts a second time for constant time lookup by id");
+    program.add_argument("--trie").default_value(8).scan<'i', int>().help("xcdat trie variant of the keys: 7, 8, 15 or 16");
+    program.add_argument("--fold").default_value("").help("Comma separated rules of a trie of folded keys for normalized finds: kana, width, lower");
+    program.add_argument("--order_path").default_value("").help("Cluster entries by their first text at this path");
+    program.add_argument("--entry_order").default_value("").help("File of entry ids, one per line, clustered in this order");
+    program.add_argument("--memory_budget").default_value(0).scan<'i', int>().help("MiB of postings held in memory, sorted runs are spilled past it, 0 for no limit");
+    program.add_argument("--temp_dir").default_value("").help("Directory of the spilled runs and spooled stdin, the system temporary directory by default");
+    program.add_argument("--spool_budget").default_value(64).scan<'i', int>().help("MiB of compressed stdin held in memory, the rest is spooled to a file, 0 for no limit");
+    program.add_argument("--stats").default_value(false).implicit_value(true).help("Print phase timings, memory peaks and cluster sizes");
 
     try {
         program.parse_args(argc, argv);
@@ -37,20 +99,51 @@ int main(int argc, char **argv) {
     std::string arg_src   = program.get<std::string>("--source");
     std::string arg_dst   = program.get<std::string>("--destination");
     std::string arg_paths = program.get<std::string>("--paths");
-    uint16_t cluster_size = program.get<int>("--cluster_size");
+    std::string arg_delta = program.get<std::string>("--update");
+    std::string arg_cluster_size = program.get<std::string>("--cluster_size");
+    uint32_t cluster_size = 0;
+    int      thread_cnt   = program.get<int>("--threads");
+    bool     show_stats   = program.get<bool>("--stats");
+    bool     legacy       = program.get<bool>("--legacy");
+    bool     columns      = program.get<bool>("--columns");
+    bool     string_pool  = program.get<bool>("--string_pool");
+    unsigned trie_variant = program.get<int>("--trie");
+    std::string arg_fold  = program.get<std::string>("--fold");
+    std::string arg_order = program.get<std::string>("--entry_order");
+    uint32_t fold_rules   = 0;
 
     std::vector<std::string> paths;
     int max_path_len = 0;
 
+    if (arg_cluster_size != "auto") {
+        if (arg_cluster_size.empty() || arg_cluster_size.find_first_not_of("0123456789") != std::string::npos) {
+            std::cerr << "--cluster_size is a number of bytes or auto" << std::endl;
+            return 1;
+        }
+
+        cluster_size = std::stoul(arg_cluster_size);
+    }
+
+    if (arg_dst.size() == 0 && arg_src == "-") {
+        std::cerr << "--destination is required when reading from stdin" << std::endl;
+        return 1;
+    }
+
     if (arg_dst.size() == 0) {
         size_t pos = arg_src.find_last_of(".");
-        arg_dst = arg_src.substr(0, pos) + ".ctq";
+        arg_dst = arg_src.substr(0, pos) + (arg_delta.size() ? ".updated.ctq" : ".ctq");
     }
 
     std::cout << "source:       " << arg_src << std::endl;
+
+    if (arg_delta.size()) {
+        std::cout << "delta:        " << arg_delta << std::endl;
+    }
+
     std::cout << "destination:  " << arg_dst << std::endl;
     std::cout << "paths:        " << arg_paths << std::endl;
-    std::cout << "cluster size: " << cluster_size << std::endl;
+    std::cout << "cluster size: " << arg_cluster_size << std::endl;
+    std::cout << "threads:      " << thread_cnt << std::endl;
 
     auto set_max_path_len = [&max_path_len](const std::string &s) {
         if (s.size() > max_path_len) {
@@ -85,7 +178,91 @@ int main(int argc, char **argv) {
 
     print_paths(paths, max_path_len);
 
-    CTQ::write(arg_src, arg_dst, paths, cluster_size);
+    for (size_t start = 0; start < arg_fold.size();) {
+        size_t end = std::min(arg_fold.find(",", start), arg_fold.size());
+        std::string rule = trim(arg_fold.substr(start, end - start));
+
+        if (rule == "kana") {
+            fold_rules |= FoldRules::kana;
+        } else if (rule == "width") {
+            fold_rules |= FoldRules::width;
+        } else if (rule == "lower") {
+            fold_rules |= FoldRules::lower;
+        } else if (rule.size()) {
+            std::cerr << "Unknown fold rule " << rule << std::endl;
+            return 1;
+        }
+
+        start = end + 1;
+    }
+
+    CTQ::WriteOptions options;
+    CTQ::WriteStats stats;
+    int rv;
+
+    options.paths           = paths;
+    options.cluster_size    = cluster_size;
+    options.thread_cnt      = thread_cnt;
+    options.progress        = print_progress;
+    options.progress_step   = 100;
+    options.stats           = show_stats ? &stats : nullptr;
+    options.legacy_format   = legacy;
+    options.column_clusters = columns;
+    options.string_pool     = string_pool;
+    options.trie_variant    = trie_variant;
+    options.fold_rules      = fold_rules;
+    options.order_path      = program.get<std::string>("--order_path");
+    options.memory_budget   = (size_t)program.get<int>("--memory_budget") << 20;
+    options.temp_dir        = program.get<std::string>("--temp_dir");
+    options.spool_budget    = (size_t)program.get<int>("--spool_budget") << 20;
+
+    // ids as in xml:id, digits after an optional prefix
+    if (arg_order.size()) {
+        std::ifstream order(arg_order);
+        std::string line;
+
+        if (!order) {
+            std::cerr << "Cannot open " << arg_order << std::endl;
+            return 1;
+        }
+
+        while (std::getline(order, line)) {
+            size_t start = line.find_first_of("0123456789");
+
+            if (start != std::string::npos) {
+                options.entry_order.push_back(std::stoull(line.substr(start)));
+            }
+        }
+    }
+
+    if (arg_cluster_size == "auto") {
+        std::vector<CTQ::ClusterSizeTrial> trials;
+
+        if (arg_delta.size() || arg_src == "-") {
+            std::cerr << "--cluster_size auto needs a TEI file as source" << std::endl;
+            return 1;
+        }
+
+        options.cluster_size = CTQ::tune_cluster_size(arg_src, options, trials, program.get<double>("--size_budget"));
+
+        if (options.cluster_size == 0) {
+            return 1;
+        }
+
+        print_trials(trials);
+    }
+
+    if (arg_delta.size()) {
+        rv = CTQ::update(arg_src, arg_delta, arg_dst, options);
+    } else if (arg_src == "-") {
+        rv = CTQ::write(std::cin, arg_dst, options);
+    } else {
+        rv = CTQ::write(arg_src, arg_dst, options);
+    }
+
+    if (rv == 0 && show_stats) {
+        print_stats(stats);
+    }
 
-    return 0;
+    return rv == 0 ? 0 : 1;
 }
\ No newline at end of file
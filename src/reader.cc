@@ -8,18 +8,82 @@
 #include <ctime>
 #include <set>
 #include <cstring>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 
 #include "xcdat.hpp"
 #include <lz4.h>
 
+static ctq_find_ret *to_find_ret(const std::map<std::string, std::vector<uint64_t>> &ret);
+static ctq_find_ret *to_find_ret(const CTQ::QueryContext &ctx);
+
+// context of the calls which do not take one, reused by the next call of the thread
+static CTQ::QueryContext &thread_context() {
+    thread_local CTQ::QueryContext ctx;
+    return ctx;
+}
+
+using stats_clock = std::chrono::steady_clock;
+
+#ifdef CTQ_READER_STATS
+#define CTQ_STAT_ADD(counter, n) (counter).fetch_add((n), std::memory_order_relaxed)
+#define CTQ_STAT_TIMER(name, histogram) latencyTimer name(histogram)
+
+// records its lifetime into a log2 microseconds histogram
+class latencyTimer {
+public:
+    latencyTimer(std::atomic<uint64_t> *histogram) : m_histogram(histogram), m_start(stats_clock::now()) {}
+
+    ~latencyTimer() {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(stats_clock::now() - m_start).count();
+        unsigned bucket = 0;
+
+        while (us && bucket < CTQ_STATS_LATENCY_BUCKETS - 1) {
+            us >>= 1;
+            ++bucket;
+        }
+
+        m_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t>   *m_histogram;
+    stats_clock::time_point  m_start;
+};
+#else
+#define CTQ_STAT_ADD(counter, n) ((void)0)
+#define CTQ_STAT_TIMER(name, histogram) ((void)0)
+#endif
+
 extern "C" {
 
 #include <string.h>
 
 struct ctq_ctx_internal {
     ctq_ctx_internal(const std::string &filename) : reader(filename) {}
+    ctq_ctx_internal(const std::string &filename, const CTQ::ReaderOptions &options) : reader(filename, options) {}
+
+    CTQ::ReloadableReader reader;
+};
 
-    CTQ::Reader reader;
+struct ctq_multi_ctx_internal {
+    ctq_multi_ctx_internal(const std::vector<std::string> &filenames) : reader(filenames) {}
+
+    CTQ::MultiReader reader;
+};
+
+struct ctq_query_ctx_internal {
+    CTQ::QueryContext         ctx;
+    std::string               keys; // keys of ret, each followed by a NUL
+    std::vector<ctq_find_ret> ret;
 };
 
 
@@ -38,31 +102,136 @@ ctq_ctx *ctq_create_reader(const char *filename) {
     return ctx;
 }
 
+ctq_ctx *ctq_create_preloaded_reader(const char *filename, unsigned thread_cnt) {
+    CTQ::ReaderOptions options;
+
+    options.preload    = true;
+    options.thread_cnt = thread_cnt;
+
+    try {
+        return new ctq_ctx_internal(std::string(filename), options);
+    } catch (const CTQ::reader_exception& ex) {
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
 void ctq_destroy_reader(ctq_ctx *ctx) {
     delete ctx;
 }
 
+int ctq_reload(ctq_ctx *ctx, const char *filename) {
+    try {
+        ctx->reader.reload(std::string(filename));
+    } catch (const CTQ::reader_exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+ctq_find_ret *ctq_find_normalized(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx) {
+    try {
+        CTQ::QueryContext &query = thread_context();
+
+        ctx->reader.find(query, std::string(keyword), offset, count, path_idx, std::string(filter), filter_path_idx, true);
+
+        return to_find_ret(query);
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
+ctq_find_ret *ctq_find_paths(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, const int *path_idxs, size_t path_cnt, const char *filter, int filter_path_idx) {
+    try {
+        CTQ::QueryContext &query = thread_context();
+
+        ctx->reader.find(query, std::string(keyword), offset, count, CTQ::PathSet(path_idxs, path_idxs + path_cnt), std::string(filter), filter_path_idx);
+
+        return to_find_ret(query);
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
 ctq_find_ret *ctq_find(const ctq_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx) {
     try {
-        auto ret = ctx->reader.find(std::string(keyword), offset, count, path_idx, std::string(filter), filter_path_idx);
+        CTQ::QueryContext &query = thread_context();
 
-        if (ret.size() == 0) 
-            return NULL;
+        ctx->reader.find(query, std::string(keyword), offset, count, path_idx, std::string(filter), filter_path_idx);
 
-        ctq_find_ret *arr = new ctq_find_ret[ret.size() + 1];
-        arr[ret.size()].ids = NULL;
+        return to_find_ret(query);
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
 
-        int i = 0;
-        for (const auto e : ret) {
-            arr[i].key    = strdup(e.first.c_str());
-            arr[i].id_cnt = e.second.size();
-            arr[i].ids    = new uint64_t[e.second.size()];
+ctq_query_ctx *ctq_create_query_ctx(void) {
+    return new ctq_query_ctx_internal();
+}
 
-            memcpy((char*)arr[i].ids, (char*)e.second.data(), e.second.size() * sizeof (uint64_t));
+void ctq_destroy_query_ctx(ctq_query_ctx *query) {
+    delete query;
+}
 
-            ++i;
+long ctq_find_into(const ctq_ctx *ctx, ctq_query_ctx *query, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx, const ctq_find_ret **ret) {
+    try {
+        size_t cnt = ctx->reader.find(query->ctx, std::string(keyword), offset, count, path_idx, std::string(filter), filter_path_idx);
+
+        query->keys.clear();
+        query->ret.resize(cnt + 1);
+
+        for (size_t i = 0; i < cnt; ++i) {
+            query->keys.append(query->ctx[i].key);
+            query->keys.push_back('\0');
+        }
+
+        // keys point into query->keys once it no longer grows
+        const char *key = query->keys.data();
+
+        for (size_t i = 0; i < cnt; ++i) {
+            const auto e = query->ctx[i];
+
+            query->ret[i] = ctq_find_ret{ key, const_cast<uint64_t*>(e.ids), e.id_cnt };
+            key += e.key.size() + 1;
+        }
+
+        query->ret[cnt] = ctq_find_ret{ NULL, NULL, 0 };
+        std::sort(query->ret.begin(), query->ret.begin() + cnt, [](const ctq_find_ret &a, const ctq_find_ret &b) { return strcmp(a.key, b.key) < 0; });
+
+        *ret = query->ret.data();
+
+        return cnt;
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return -1;
+    }
+}
+
+long ctq_count(const ctq_ctx *ctx, const char *keyword, int path_idx, const char *filter, int filter_path_idx, size_t limit) {
+    try {
+        return ctx->reader.count(std::string(keyword), path_idx, std::string(filter), filter_path_idx, limit);
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return -1;
+    }
+}
+
+char **ctq_complete(const ctq_ctx *ctx, const char *prefix, size_t k, int path_idx) {
+    try {
+        auto ret = ctx->reader.complete(std::string(prefix), k, path_idx);
+        char **arr = new char*[ret.size() + 1];
+
+        for (size_t i = 0; i < ret.size(); ++i) {
+            arr[i] = strdup(ret[i].c_str());
         }
 
+        arr[ret.size()] = NULL;
+
         return arr;
     }  catch (const CTQ::reader_exception& ex) {    
         std::cerr << ex.what() << std::endl;    
@@ -70,6 +239,14 @@ ctq_find_ret *ctq_find(const ctq_ctx *ctx, const char *keyword, size_t offset, s
     }
 }
 
+void ctq_complete_free(char **arr) {
+    for (int i = 0; arr[i] != NULL; ++i) {
+        free(arr[i]);
+    }
+
+    delete[] arr;
+}
+
 char *ctq_get(ctq_ctx *ctx, uint64_t id) {
     try {
         std::string ret = ctx->reader.get(id);
@@ -84,6 +261,49 @@ char *ctq_get(ctq_ctx *ctx, uint64_t id) {
     }
 }
 
+ctq_get_paths_ret *ctq_get_paths(ctq_ctx *ctx, uint64_t id, const char **paths, size_t path_cnt) {
+    try {
+        auto ret = ctx->reader.get(id, std::vector<std::string>(paths, paths + path_cnt));
+
+        if (ret.size() == 0)
+            return NULL;
+
+        ctq_get_paths_ret *arr = new ctq_get_paths_ret[ret.size() + 1];
+        arr[ret.size()].path = NULL;
+
+        int i = 0;
+        for (const auto &e : ret) {
+            arr[i].path     = strdup(e.first.c_str());
+            arr[i].text_cnt = e.second.size();
+            arr[i].texts    = new const char*[e.second.size()];
+
+            for (size_t j = 0; j < e.second.size(); ++j) {
+                arr[i].texts[j] = strdup(e.second[j].c_str());
+            }
+
+            ++i;
+        }
+
+        return arr;
+    }  catch (const CTQ::reader_exception& ex) {   
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
+void ctq_get_paths_ret_free(ctq_get_paths_ret *arr) {
+    for (int i = 0; arr[i].path != NULL; ++i) {
+        for (size_t j = 0; j < arr[i].text_cnt; ++j) {
+            free((void*)arr[i].texts[j]);
+        }
+
+        free((void*)arr[i].path);
+        delete[] arr[i].texts;
+    }
+
+    delete[] arr;
+}
+
 void ctq_find_ret_free(ctq_find_ret *arr) {
     for (int i = 0; arr[i].ids != NULL; ++i) {
         free((void*)arr[i].key);
@@ -94,40 +314,234 @@ void ctq_find_ret_free(ctq_find_ret *arr) {
 }
 
 const char *ctq_writer_version(const ctq_ctx *ctx) {
-    return strdup(ctx->reader.get_writer_version().c_str());
+    return strdup(ctx->reader.acquire()->get_writer_version().c_str());
 }
 
 const char *ctq_reader_version(const ctq_ctx *ctx) {
-    return strdup(ctx->reader.get_reader_version().c_str());
+    return strdup(ctx->reader.acquire()->get_reader_version().c_str());
 }
 
+int ctq_stats(const ctq_ctx *ctx, ctq_reader_stats *stats) {
+    if (!ctx || !stats) return -1;
+
+    *stats = ctx->reader.acquire()->stats();
+
+#ifdef CTQ_READER_STATS
+    return 0;
+#else
+    return -1;
+#endif
 }
 
-long read_cluster(std::istream &is, std::ostream &os) {
+ctq_multi_ctx *ctq_create_multi_reader(const char **filenames, size_t cnt) {
+    ctq_multi_ctx *ctx = NULL;
+
+    try {
+        ctx = new ctq_multi_ctx_internal(std::vector<std::string>(filenames, filenames + cnt));
+    } catch (const CTQ::reader_exception& ex) {
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void ctq_destroy_multi_reader(ctq_multi_ctx *ctx) {
+    delete ctx;
+}
+
+ctq_find_ret *ctq_multi_find(const ctq_multi_ctx *ctx, const char *keyword, size_t offset, size_t count, int path_idx, const char *filter, int filter_path_idx) {
+    try {
+        auto ret = ctx->reader.find(std::string(keyword), offset, count, path_idx, std::string(filter), filter_path_idx);
+
+        return to_find_ret(ret);
+    }  catch (const CTQ::reader_exception& ex) {    
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
+char *ctq_multi_get(ctq_multi_ctx *ctx, uint64_t id) {
+    try {
+        std::string ret = ctx->reader.get(id);
+
+        if (ret.size() == 0)
+            return NULL;
+
+        return strdup(ret.c_str());
+    }  catch (const CTQ::reader_exception& ex) {   
+        std::cerr << ex.what() << std::endl;    
+        return NULL;
+    }
+}
+
+}
+
+// keys ordered by bytes like the map results
+static ctq_find_ret *to_find_ret(const CTQ::QueryContext &ctx) {
+    if (ctx.size() == 0) 
+        return NULL;
+
+    ctq_find_ret *arr = new ctq_find_ret[ctx.size() + 1];
+    arr[ctx.size()].ids = NULL;
+
+    for (size_t i = 0; i < ctx.size(); ++i) {
+        const auto e = ctx[i];
+        char *key = (char*)malloc(e.key.size() + 1);
+
+        memcpy(key, e.key.data(), e.key.size());
+        key[e.key.size()] = '\0';
+
+        arr[i].key    = key;
+        arr[i].id_cnt = e.id_cnt;
+        arr[i].ids    = new uint64_t[e.id_cnt];
+
+        memcpy((char*)arr[i].ids, (const char*)e.ids, e.id_cnt * sizeof (uint64_t));
+    }
+
+    std::sort(arr, arr + ctx.size(), [](const ctq_find_ret &a, const ctq_find_ret &b) { return strcmp(a.key, b.key) < 0; });
+
+    return arr;
+}
+
+static ctq_find_ret *to_find_ret(const std::map<std::string, std::vector<uint64_t>> &ret) {
+    if (ret.size() == 0) 
+        return NULL;
+
+    ctq_find_ret *arr = new ctq_find_ret[ret.size() + 1];
+    arr[ret.size()].ids = NULL;
+
+    int i = 0;
+    for (const auto &e : ret) {
+        arr[i].key    = strdup(e.first.c_str());
+        arr[i].id_cnt = e.second.size();
+        arr[i].ids    = new uint64_t[e.second.size()];
+
+        memcpy((char*)arr[i].ids, (char*)e.second.data(), e.second.size() * sizeof (uint64_t));
+
+        ++i;
+    }
+
+    return arr;
+}
+
+/**
+ * @brief Decompresses the cluster at the position of is into out, which only grows.
+ * 
+ * @param needed Bytes to decode from the start of the cluster, 0 for all
+ * @param whole Set when the size given by the cluster header was decoded
+ * @return long Bytes decoded, -1 on error
+ */
+long read_cluster(std::istream &is, std::vector<char> &compressed, std::vector<char> &out, const FileLayout &layout, [[maybe_unused]] CTQ::StatsCounters *stats = nullptr, uint32_t needed = 0, bool *whole = nullptr) {
     int compressed_size;
-    uint16_t cluster_size;
-    char *inbuf;
-    char *outbuf;
+    uint32_t cluster_size;
 
-    is.read((char*)&cluster_size, sizeof cluster_size);
+    cluster_size = read_uint<uint32_t>(is, layout.cluster_size_bytes);
     is.read((char*)&compressed_size, sizeof compressed_size);
 
+    if (!is.good() || compressed_size < 0) {
+        return -1;
+    }
+
+    if (compressed.size() < (size_t)compressed_size) compressed.resize(compressed_size);
+    if (out.size() < cluster_size) out.resize(cluster_size);
 
-    inbuf  = new char[compressed_size];
-    outbuf = new char[cluster_size];
+    is.read(compressed.data(), compressed_size);
 
-    is.read(inbuf, compressed_size);
+#ifdef CTQ_READER_STATS
+    auto start = stats_clock::now();
+#endif
 
-    int rv = LZ4_decompress_safe(inbuf, outbuf, compressed_size, cluster_size);
+    int rv = needed && needed < cluster_size 
+        ? LZ4_decompress_safe_partial(compressed.data(), out.data(), compressed_size, needed, cluster_size)
+        : LZ4_decompress_safe(compressed.data(), out.data(), compressed_size, cluster_size);
 
-    if (rv > 0) {
-        os.write(outbuf, rv);
+#ifdef CTQ_READER_STATS
+    if (stats) {
+        CTQ_STAT_ADD(stats->decompression_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(stats_clock::now() - start).count());
+        CTQ_STAT_ADD(stats->clusters_read, 1);
+        CTQ_STAT_ADD(stats->compressed_bytes, compressed_size);
+        CTQ_STAT_ADD(stats->decompressed_bytes, rv > 0 ? rv : 0);
     }
+#endif
 
-    delete[] inbuf;
-    delete[] outbuf;
+    if (whole) {
+        *whole = rv >= 0 && (uint32_t)rv == cluster_size;
+    }
 
-    return rv;
+    return rv > 0 ? rv : -1;
+}
+
+// Cursors over the bp and elements of an entry
+struct entryStreams {
+    const char *bp;
+    const char *bp_end;
+    const char *elt;      // element words, text markers on column clusters
+    const char *elt_end;
+    const char *text;     // text ids, column clusters only
+    const char *text_end;
+    uint8_t     last_node_pop;
+};
+
+entryStreams open_entry(const char *data, size_t size, uint32_t data_pos, const FileLayout &layout) {
+    const char *end  = data + size;
+    entryStreams ret {};
+
+    if (!layout.has(FileLayout::column_clusters)) {
+        ret.last_node_pop = data[data_pos];
+        ret.bp      = data + data_pos + 1;
+        ret.bp_end  = ret.bp + packed_bp_size(ret.bp, end);
+        ret.elt     = ret.bp_end;
+        ret.elt_end = end;
+
+        return ret;
+    }
+
+    uint32_t structure_size, tag_size;
+
+    if (size < 2 * sizeof(uint32_t)) {
+        CTQ_READER_THROW("Corrupted file");
+    }
+
+    memcpy(&structure_size, data, sizeof structure_size);
+    memcpy(&tag_size, data + sizeof structure_size, sizeof tag_size);
+
+    const char *s     = data + 2 * sizeof(uint32_t);
+    const char *s_end = s + structure_size;
+    const char *entry = data + data_pos;
+    const char *tag   = s_end;
+    const char *text  = s_end + tag_size;
+
+    if (2 * sizeof(uint32_t) + (uint64_t)structure_size + tag_size > size || entry < s || entry >= s_end) {
+        CTQ_READER_THROW("Corrupted file");
+    }
+
+    // the column offsets of the entry are the sizes of the entries before it
+    while (true) {
+        uint32_t tag_len, text_len, bp_size;
+        uint8_t last_node_pop = *s++;
+
+        if (!get_varint(s, s_end, tag_len) || !get_varint(s, s_end, text_len) || !get_varint(s, s_end, bp_size)
+            || tag_len > s_end + tag_size - tag || text_len > end - text || bp_size > s_end - s) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        if (s > entry) {
+            ret.last_node_pop = last_node_pop;
+            ret.bp       = s;
+            ret.bp_end   = s + bp_size;
+            ret.elt      = tag;
+            ret.elt_end  = tag + tag_len;
+            ret.text     = text;
+            ret.text_end = text + text_len;
+
+            return ret;
+        }
+
+        s    += bp_size;
+        tag  += tag_len;
+        text += text_len;
+    }
 }
 
 struct element {
@@ -137,13 +551,202 @@ struct element {
     uint32_t data;
 };
 
+// Reads the elements of an entry, text markers of column clusters are resolved to text elements
+struct elementReader {
+    elementReader(entryStreams &streams, const FileLayout &layout) 
+        : streams(streams), varint(layout.has(FileLayout::varint_elements)), columns(layout.has(FileLayout::column_clusters)) {}
+
+    element next(bool data_only = false) {
+        uint32_t tmp = 0;
+
+        eof = eof || !get_word(streams.elt, streams.elt_end, varint, tmp);
+
+        if (!eof && columns && !data_only && tmp == 1) {
+            eof = !get_word(streams.text, streams.text_end, varint, tmp);
+            return eof ? element(0, 0) : element(1, tmp);
+        }
+
+        if (eof) return element(0, 0);
+
+        return data_only ? element(0, tmp) : element(3 & tmp, tmp >> 2);
+    }
+
+    entryStreams &streams;
+    const bool    varint;
+    const bool    columns;
+    bool          eof = false;
+};
+
+// Excess of each byte of a packed bp, bits read from the most significant one
+struct bpExcessTable {
+    bpExcessTable() {
+        for (int b = 0; b < 256; ++b) {
+            int excess = 0;
+            int min = 8;
+
+            for (int j = 7; j >= 0; --j) {
+                excess += (b >> j) & 1 ? 1 : -1;
+                min = std::min(min, excess);
+            }
+
+            total[b]      = excess;
+            min_prefix[b] = min;
+        }
+    }
+
+    int8_t total[256];
+    int8_t min_prefix[256];
+};
+
+inline bool bp_bit(const char *bp, size_t i) { return (bp[i >> 3] >> (7 - (i & 7))) & 1; }
+
+/**
+ * @brief Position of the bit closing the node opened at bit i, bit_cnt if the bp is unbalanced.
+ * 
+ * Bytes which cannot hold the close are skipped using their excess.
+ */
+size_t bp_find_close(const char *bp, size_t bit_cnt, size_t i) {
+    static const bpExcessTable table;
+    long excess = 0;
+    size_t j = i;
+
+    for (; j < bit_cnt && (j == i || (j & 7)); ++j) {
+        excess += bp_bit(bp, j) ? 1 : -1;
+        if (excess == 0) return j;
+    }
+
+    for (; j + 8 <= bit_cnt; j += 8) {
+        uint8_t b = bp[j >> 3];
+
+        if (excess + table.min_prefix[b] <= 0) break;
+
+        excess += table.total[b];
+    }
+
+    for (; j < bit_cnt; ++j) {
+        excess += bp_bit(bp, j) ? 1 : -1;
+        if (excess == 0) return j;
+    }
+
+    return bit_cnt;
+}
+
 namespace CTQ {
 
-Reader::Reader(const std::string &filename, bool enable_filters) : input(filename), filter_support(false) {
-    uint16_t xalpha_sz  = 0;
-    uint32_t id_cnt     = 0;
-    uint32_t id_map_cnt = 0;
-    uint32_t footer_start = 0;
+/**
+ * @brief Least recently used find results within a byte budget.
+ * 
+ * Queries are spread over shards locked separately, each one holding an equal part of the budget.
+ */
+class FindCache {
+public:
+    explicit FindCache(size_t budget) : m_shard_budget(budget / shard_cnt) {}
+
+    static std::string make_key(const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) {
+        std::string key;
+        const size_t path_words = paths.any() ? 0 : paths.bits().size();
+        const uint64_t params[] = { offset, count, path_words, (uint64_t)filter_path_idx, keyword.size(), normalized };
+
+        key.reserve(sizeof params + path_words * sizeof(uint64_t) + keyword.size() + filter.size());
+        key.append((const char*)params, sizeof params);
+        key.append((const char*)paths.bits().data(), path_words * sizeof(uint64_t));
+        key.append(keyword);
+        key.append(filter);
+
+        return key;
+    }
+
+    // copies the results of key into ctx
+    bool lookup(const std::string &key, QueryContext &ctx) {
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+
+        if (it == shard.index.end()) {
+            return false;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+
+        const Entry &e = *it->second;
+
+        ctx.reset();
+        ctx.m_keys.assign(e.keys);
+        ctx.m_ids.assign(e.ids.begin(), e.ids.end());
+        ctx.m_ranges.assign(e.ranges.begin(), e.ranges.end());
+
+        return true;
+    }
+
+    // evictions made room for the results, results larger than a shard are not kept
+    size_t insert(const std::string &key, const QueryContext &ctx) {
+        size_t bytes = entry_overhead + 2 * key.size() + ctx.m_keys.size() + ctx.m_ids.size() * sizeof(uint64_t) + ctx.m_ranges.size() * sizeof(QueryContext::Range);
+        size_t evictions = 0;
+        Shard &shard = shard_of(key);
+
+        if (bytes > m_shard_budget) {
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.index.count(key)) {
+            return 0;
+        }
+
+        while (shard.bytes + bytes > m_shard_budget) {
+            const Entry &last = shard.lru.back();
+
+            shard.bytes -= last.bytes;
+            m_bytes.fetch_sub(last.bytes, std::memory_order_relaxed);
+            shard.index.erase(last.key);
+            shard.lru.pop_back();
+            ++evictions;
+        }
+
+        shard.lru.push_front(Entry{ key, ctx.m_keys, ctx.m_ids, ctx.m_ranges, bytes });
+        shard.index.emplace(key, shard.lru.begin());
+        shard.bytes += bytes;
+        m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        return evictions;
+    }
+
+    inline size_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        std::string                     key;
+        std::string                     keys;
+        std::vector<uint64_t>           ids;
+        std::vector<QueryContext::Range> ranges;
+        size_t                          bytes;
+    };
+
+    struct Shard {
+        std::mutex                                                  mutex;
+        std::list<Entry>                                            lru; // most recent first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t                                                      bytes = 0;
+    };
+
+    static constexpr size_t shard_cnt      = 16;
+    static constexpr size_t entry_overhead = sizeof(Entry) + 64; // list and index nodes
+
+    inline Shard &shard_of(const std::string &key) { return m_shards[std::hash<std::string>{}(key) % shard_cnt]; }
+
+    Shard               m_shards[shard_cnt];
+    size_t              m_shard_budget;
+    std::atomic<size_t> m_bytes{0};
+};
+
+Reader::Reader(const std::string &filename, bool enable_filters) : Reader(filename, ReaderOptions{ enable_filters }) {}
+
+Reader::Reader(const std::string &filename, const ReaderOptions &options) : input(filename), filter_support(false) {
+    auto start = stats_clock::now();
+    uint32_t xalpha_sz  = 0;
+    uint64_t id_cnt     = 0;
+    uint64_t footer_start = 0;
 
     if (!input.good()) {
         CTQ_READER_THROW("Cannot open file");
@@ -163,12 +766,23 @@ Reader::Reader(const std::string &filename, bool enable_filters) : input(filenam
         }
     }
 
+    // layout
+    if (m_writer_version_minor >= 1) {
+        m_layout.load(input);
+
+        if (!m_layout.valid()) {
+            CTQ_READER_THROW("Unsupported layout");
+        }
+    } else {
+        m_layout = FileLayout::legacy();
+    }
+
     // read xml_alphabet
     {
-        input.read((char*)&xalpha_sz, sizeof xalpha_sz);
+        xalpha_sz = read_uint<uint32_t>(input, m_layout.v2 ? 4 : 2);
 
         std::string s = "";
-        for (int i = 0; i < xalpha_sz; ++i) {
+        for (uint32_t i = 0; i < xalpha_sz; ++i) {
             char c = input.get();
 
             if (c == 0) {
@@ -182,43 +796,166 @@ Reader::Reader(const std::string &filename, bool enable_filters) : input(filenam
     }
 
     // read ch_trie
-    ch_trie = xcdat::load<trie_type>(input);
+    ch_trie.load(input, m_layout.trie_variant());
 
     // read ids and pos
     {
-        input.read((char*)&id_cnt, sizeof id_cnt);
+        id_cnt = read_uint<uint64_t>(input, m_layout.count_bytes());
+
+        if (!input.good()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
 
         ids.resize(id_cnt);
         pos.resize(id_cnt);
         cluster_offset_idx.resize(id_cnt);
 
-        input.read((char*)ids.data(), id_cnt * sizeof ids[0]);
-        input.read((char*)pos.data(), id_cnt * sizeof pos[0]);
-        input.read((char*)cluster_offset_idx.data(), id_cnt * sizeof cluster_offset_idx[0]);
+        read_uints(input, ids.data(), id_cnt, m_layout.id_bytes);
+        read_uints(input, pos.data(), id_cnt, m_layout.pos_bytes);
+        read_uints(input, cluster_offset_idx.data(), id_cnt, m_layout.cluster_idx_bytes);
     }
 
-    input.read((char*)&footer_start, sizeof footer_start);
+    footer_start = read_uint<uint64_t>(input, m_layout.count_bytes());
     m_header_end = input.tellg();
 
     input.seekg(footer_start, input.beg);
 
     // load id mapping
-    id_mapping = Contiguous2dArray<uint32_t>(input);
+    if (m_layout.posting_bytes == 8) {
+        id_mapping_wide = Contiguous2dArray<uint64_t>(input, m_layout.count_bytes());
+    } else {
+        id_mapping = Contiguous2dArray<uint32_t>(input, m_layout.count_bytes());
+    }
 
     // load paths mapping
-    paths_mapping = Contiguous2dArray<uint32_t>(input);
+    paths_mapping = Contiguous2dArray<uint32_t>(input, m_layout.count_bytes());
 
     // read cluster offsets
     {
+        uint64_t cnt = read_uint<uint64_t>(input, m_layout.count_bytes());
+
+        if (!input.good()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        cluster_offsets.resize(cnt);
+        read_uints(input, cluster_offsets.data(), cnt, m_layout.offset_bytes);
+    }
+
+    // read cluster text ids
+    if (m_writer_version_minor >= 1 || m_writer_version_patch >= 2) {
         uint32_t cnt;
 
         input.read((char*)&cnt, sizeof cnt);
-        cluster_offsets.resize(cnt);
+        ch_trie_ids.resize(cnt);
+
+        input.read((char*)ch_trie_ids.data(), cnt * sizeof ch_trie_ids[0]);
+    }
+
+    if (m_layout.has(FileLayout::string_pool)) {
+        m_string_pool = Contiguous2dArray<char>(input, m_layout.count_bytes());
+
+        if (!input.good() || m_string_pool.size() != ch_trie.num_keys()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+    }
+
+    if (m_layout.fold_rules()) {
+        m_fold_trie.load(input, m_layout.trie_variant());
+        m_fold_mapping = Contiguous2dArray<uint32_t>(input, m_layout.count_bytes());
+
+        if (!input.good() || m_fold_mapping.size() != m_fold_trie.num_keys()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+    }
+
+    if (options.preload) {
+        preload(footer_start, options.thread_cnt);
+    }
 
-        input.read((char*)cluster_offsets.data(), cnt * sizeof cluster_offsets[0]);
+    if (options.find_cache) {
+        m_find_cache.reset(new FindCache(options.find_cache));
     }
 
     input.seekg(m_header_end, input.beg);
+    m_load_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(stats_clock::now() - start).count();
+}
+
+/**
+ * @brief Decompresses every cluster into m_arena.
+ * 
+ * The clusters are read at once then split in as many ranges as threads.
+ * 
+ * @param clusters_end Footer start, the clusters are right before it
+ */
+void Reader::preload(uint64_t clusters_end, unsigned thread_cnt) {
+    const size_t   cnt        = cluster_offsets.size();
+    const unsigned size_bytes = m_layout.cluster_size_bytes;
+    const uint64_t first      = cnt ? cluster_offsets.front() : clusters_end;
+    std::vector<char> compressed(clusters_end > first ? clusters_end - first : 0);
+
+    input.seekg(first, input.beg);
+    input.read(compressed.data(), compressed.size());
+
+    if (!input.good() || clusters_end < first) {
+        CTQ_READER_THROW("Corrupted file");
+    }
+
+    // raw sizes give the place of each cluster in the arena
+    m_arena_offsets.assign(cnt + 1, 0);
+
+    for (size_t i = 0; i < cnt; ++i) {
+        uint32_t raw_size = 0;
+
+        if (cluster_offsets[i] < first || cluster_offsets[i] - first + size_bytes + sizeof(int) > compressed.size()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        memcpy(&raw_size, compressed.data() + (cluster_offsets[i] - first), size_bytes);
+        m_arena_offsets[i + 1] = m_arena_offsets[i] + raw_size;
+    }
+
+    m_arena.resize(m_arena_offsets.back());
+
+    auto decompress = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const char *p = compressed.data() + (cluster_offsets[i] - first) + size_bytes;
+            int raw_size = m_arena_offsets[i + 1] - m_arena_offsets[i];
+            int compressed_size;
+
+            memcpy(&compressed_size, p, sizeof compressed_size);
+            p += sizeof compressed_size;
+
+            if (compressed_size < 0 || (size_t)compressed_size > compressed.size() - (p - compressed.data())) {
+                return false;
+            }
+
+            if (LZ4_decompress_safe(p, m_arena.data() + m_arena_offsets[i], compressed_size, raw_size) != raw_size) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    thread_cnt = thread_cnt ? thread_cnt : std::max(1U, std::thread::hardware_concurrency());
+    thread_cnt = std::max<size_t>(1, std::min<size_t>(thread_cnt, cnt));
+
+    std::vector<std::future<bool>> rvs;
+    size_t step = (cnt + thread_cnt - 1) / thread_cnt;
+    bool ok = true;
+
+    for (size_t begin = 0; begin < cnt; begin += step) {
+        rvs.push_back(std::async(std::launch::async, decompress, begin, std::min(cnt, begin + step)));
+    }
+
+    for (auto &rv : rvs) {
+        ok = rv.get() && ok;
+    }
+
+    if (!ok) {
+        CTQ_READER_THROW("Corrupted file");
+    }
 }
 
 Reader::~Reader() {
@@ -227,141 +964,481 @@ Reader::~Reader() {
     }
 }
 
-std::map<std::string, std::vector<uint64_t>> Reader::find(const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx) const {
-    auto is_exact_match = [](const std::string &s) {
-        auto rbeg = s.rbegin();
+void QueryContext::reset() {
+    for (const auto e : m_seen_idx) {
+        m_seen[e] = false;
+    }
 
-        return (*rbeg != '%') || (*(++rbeg) == '\\');
-    };
+    m_keys.clear();
+    m_ids.clear();
+    m_ranges.clear();
+    m_seen_idx.clear();
+}
 
-    auto clean_keyword = [] (const std::string &s, bool exact_match) {
-        if (exact_match) {
-            return s;
-        }
+// a keyword is a prefix when it ends with an unescaped %
+// an empty keyword matches the empty key only, "%" matches every key
+static bool is_exact_match(const std::string &s) {
+    if (s.size() < 2) {
+        return s != "%";
+    }
 
-        return std::string(s.begin(), s.end() - 1);
-    };
+    auto rbeg = s.rbegin();
 
-    auto check_pidx = [&](int idx, uint64_t ch_id) {
-        if (idx == 0) return true;
-        auto indexes = paths_mapping[ch_id];
+    return (*rbeg != '%') || (*(++rbeg) == '\\');
+}
 
-        return std::binary_search(indexes.begin(), indexes.end(), idx);
-    };
+static std::string clean_keyword(const std::string &s, bool exact_match) {
+    if (exact_match) {
+        return s;
+    }
+
+    return std::string(s.begin(), s.end() - 1);
+}
 
+std::map<std::string, std::vector<uint64_t>> Reader::find(const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx, bool normalized) const {
+    return find(keyword, offset, count, PathSet{ path_idx }, filter, filter_path_idx, normalized);
+}
+
+std::map<std::string, std::vector<uint64_t>> Reader::find(const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) const {
     std::map<std::string, std::vector<uint64_t>> ret;
+    QueryContext &ctx = thread_context();
+
+    find(ctx, keyword, offset, count, paths, filter, filter_path_idx, normalized);
+
+    for (size_t i = 0; i < ctx.size(); ++i) {
+        auto e = ctx[i];
+        ret[std::string(e.key)] = std::vector<uint64_t>(e.ids, e.ids + e.id_cnt);
+    }
+
+    return ret;
+}
+
+size_t Reader::find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx, bool normalized) const {
+    return find(ctx, keyword, offset, count, PathSet{ path_idx }, filter, filter_path_idx, normalized);
+}
+
+size_t Reader::find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) const {
+    CTQ_STAT_ADD(m_stats.find_calls, 1);
+    CTQ_STAT_TIMER(timer, m_stats.find_latency_us);
+
+    std::string cache_key;
+
+    if (m_find_cache) {
+        cache_key = FindCache::make_key(keyword, offset, count, paths, filter, filter_path_idx, normalized);
+
+        if (m_find_cache->lookup(cache_key, ctx)) {
+            CTQ_STAT_ADD(m_stats.find_cache_hits, 1);
+            return ctx.size();
+        }
+
+        CTQ_STAT_ADD(m_stats.find_cache_misses, 1);
+    }
+
+    if (m_layout.posting_bytes == 8) {
+        find_postings(id_mapping_wide, ctx, keyword, offset, count, paths, filter, filter_path_idx, normalized);
+    } else {
+        find_postings(id_mapping, ctx, keyword, offset, count, paths, filter, filter_path_idx, normalized);
+    }
+
+    if (m_find_cache) {
+        [[maybe_unused]] size_t evictions = m_find_cache->insert(cache_key, ctx);
+        CTQ_STAT_ADD(m_stats.find_cache_evictions, evictions);
+    }
+
+    return ctx.size();
+}
+
+template<typename P>
+size_t Reader::find_postings(const Contiguous2dArray<P> &id_mapping, QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) const {
+    const unsigned path_bits = m_layout.path_bits;
+    const P        path_mask = m_layout.path_mask();
+
+    ctx.reset();
+
+    if (ctx.m_seen.size() < ids.size()) {
+        ctx.m_seen.resize(ids.size());
+    }
+
     bool exact_match = is_exact_match(keyword);
     std::string clean_key = clean_keyword(keyword, exact_match);
+
+    bool is_filter_exact_match = filter.size() && is_exact_match(filter);
+    std::string clean_filter = filter.size() ? clean_keyword(filter, is_filter_exact_match) : "";
     
-    auto it = ch_trie.make_predictive_iterator(clean_key);
     size_t i = 0;
     size_t id_cnt = 0;
+    uint64_t trie_iterations = 0;
+    uint64_t postings_scanned = 0;
+    uint64_t filter_evaluations = 0;
+
+    if (normalized && !m_layout.fold_rules()) {
+        CTQ_READER_THROW("No normalized keys in file");
+    }
+
+    // adds the postings of a key, listing the key if it brings new ids
+    auto add_key = [&](std::string_view key, uint64_t ch_id) {
+        size_t id_start = ctx.m_ids.size();
+
+        if (ch_id >= id_mapping.size()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        for (const auto e : id_mapping.row(ch_id)) {
+            ++postings_scanned;
+
+            uint32_t entry_idx = e >> path_bits;
+            uint32_t pidx = path_mask & e;
+        
+            if (!ctx.m_seen[entry_idx] && paths.contains(pidx)) {
+                bool add_id = filter.empty() || match_filter(id_mapping, entry_idx, clean_filter, is_filter_exact_match, filter_path_idx, ctx.m_decoded, filter_evaluations);
+
+                if (add_id) {
+                    ctx.m_seen[entry_idx] = true;
+                    ctx.m_seen_idx.push_back(entry_idx);
+
+                    if (i++ >= offset) {
+                        ++id_cnt;
+                        ctx.m_ids.push_back(ids[entry_idx]);
+                    }
+                }
+            }            
+        }
+
+        if (ctx.m_ids.size() != id_start) {
+            ctx.m_ranges.push_back({ ctx.m_keys.size(), key.size(), id_start, ctx.m_ids.size() - id_start });
+            ctx.m_keys.append(key);
+        }
+    };
+
+    // normalized finds walk the folded keys, each leading to the keys folding to it
+    const AnyTrie &walked = normalized ? m_fold_trie : ch_trie;
+    const std::string walked_key = normalized ? fold_key(clean_key, m_layout.fold_rules()) : clean_key;
+    std::string decoded;
+
+    // dispatched once, the loop runs on the trie variant of the file
+    walked.visit([&](const auto &trie) {
+        auto it = trie.make_predictive_iterator(walked_key);
+
+        while (it.next() && (!count || id_cnt < count)) {
+            ++trie_iterations;
+
+            std::string_view key = it.decoded_view();
+
+            if (exact_match && key != walked_key) 
+                break;
+
+            if (!normalized) {
+                add_key(key, it.id());
+                continue;
+            }
+
+            if (it.id() >= m_fold_mapping.size()) {
+                CTQ_READER_THROW("Corrupted file");
+            }
+
+            for (const auto ch_id : m_fold_mapping.row(it.id())) {
+                if (count && id_cnt >= count) break;
+
+                ch_trie.decode(ch_id, decoded);
+                add_key(decoded, ch_id);
+            }
+        }
+    });
+
+    CTQ_STAT_ADD(m_stats.trie_iterations, trie_iterations);
+    CTQ_STAT_ADD(m_stats.postings_scanned, postings_scanned);
+    CTQ_STAT_ADD(m_stats.filter_evaluations, filter_evaluations);
+
+    return ctx.size();
+}
 
-    std::set<uint32_t> id_register{};
+template<typename P>
+bool Reader::match_filter(const Contiguous2dArray<P> &id_mapping, uint32_t entry_idx, const std::string &clean_filter, bool exact_match, int filter_path_idx, std::string &buf, uint64_t &evaluations) const {
+    for (const auto filter_id : paths_mapping.row(entry_idx)) {
+        ++evaluations;
+        std::string_view dec = trie_text(filter_id, buf);
+        bool match;
+
+        if (dec.size() < clean_filter.size()) continue;
+
+        if (exact_match) {
+            match = (clean_filter == dec);
+        } else {
+            match = (strncmp(clean_filter.c_str(), dec.data(), clean_filter.size()) == 0);
+        }
+
+        if (match) {
+            if (!filter_path_idx) {
+                return true;
+            }
+
+            auto mapping = id_mapping.row(filter_id);
+
+            if (std::binary_search(mapping.begin(), mapping.end(), (((P)entry_idx << m_layout.path_bits) | filter_path_idx))) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+size_t Reader::count(const std::string &keyword, int path_idx, const std::string &filter, int filter_path_idx, size_t limit) const {
+    return count(thread_context(), keyword, PathSet{ path_idx }, filter, filter_path_idx, limit);
+}
+
+size_t Reader::count(const std::string &keyword, const PathSet &paths, const std::string &filter, int filter_path_idx, size_t limit) const {
+    return count(thread_context(), keyword, paths, filter, filter_path_idx, limit);
+}
+
+size_t Reader::count(QueryContext &ctx, const std::string &keyword, int path_idx, const std::string &filter, int filter_path_idx, size_t limit) const {
+    return count(ctx, keyword, PathSet{ path_idx }, filter, filter_path_idx, limit);
+}
+
+size_t Reader::count(QueryContext &ctx, const std::string &keyword, const PathSet &paths, const std::string &filter, int filter_path_idx, size_t limit) const {
+    if (m_layout.posting_bytes == 8) {
+        return count_postings(id_mapping_wide, ctx, keyword, paths, filter, filter_path_idx, limit);
+    }
+
+    return count_postings(id_mapping, ctx, keyword, paths, filter, filter_path_idx, limit);
+}
+
+template<typename P>
+size_t Reader::count_postings(const Contiguous2dArray<P> &id_mapping, QueryContext &ctx, const std::string &keyword, const PathSet &paths, const std::string &filter, int filter_path_idx, size_t limit) const {
+    const unsigned path_bits = m_layout.path_bits;
+    const P        path_mask = m_layout.path_mask();
+
+    bool exact_match = is_exact_match(keyword);
+    std::string clean_key = clean_keyword(keyword, exact_match);
+
+    bool is_filter_exact_match = filter.size() && is_exact_match(filter);
+    std::string clean_filter = filter.size() ? clean_keyword(filter, is_filter_exact_match) : "";
+
+    size_t ret = 0;
+    uint64_t trie_iterations = 0;
+    uint64_t postings_scanned = 0;
+    uint64_t filter_evaluations = 0;
+
+    auto row_of = [&id_mapping](uint64_t ch_id) {
+        if (ch_id >= id_mapping.size()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        return id_mapping.row(ch_id);
+    };
+
+    // postings of a key are unique and sorted by entry, the entries of a single key are counted without marks
+    if (exact_match && filter.empty()) {
+        auto ch_id = ch_trie.lookup(clean_key);
+        P last = 0;
+
+        if (ch_id) {
+            for (const auto e : row_of(*ch_id)) {
+                ++postings_scanned;
+
+                if (paths.contains(e & path_mask) && (ret == 0 || (e >> path_bits) != last)) {
+                    last = e >> path_bits;
+
+                    if (++ret == limit) break;
+                }
+            }
+        }
+
+        CTQ_STAT_ADD(m_stats.postings_scanned, postings_scanned);
+
+        return ret;
+    }
+
+    ctx.reset();
+
+    if (ctx.m_seen.size() < ids.size()) {
+        ctx.m_seen.resize(ids.size());
+    }
+
+    ch_trie.visit([&](const auto &trie) {
+        auto it = trie.make_predictive_iterator(clean_key);
+
+        while ((!limit || ret < limit) && it.next()) {
+            ++trie_iterations;
+
+            if (exact_match && it.decoded_view() != clean_key)
+                break;
+
+            for (const auto e : row_of(it.id())) {
+                ++postings_scanned;
+
+                uint32_t entry_idx = e >> path_bits;
+
+                if (ctx.m_seen[entry_idx] || !paths.contains(e & path_mask)) continue;
+
+                if (filter.empty() || match_filter(id_mapping, entry_idx, clean_filter, is_filter_exact_match, filter_path_idx, ctx.m_decoded, filter_evaluations)) {
+                    ctx.m_seen[entry_idx] = true;
+                    ctx.m_seen_idx.push_back(entry_idx);
+
+                    if (++ret == limit) break;
+                }
+            }
+        }
+    });
+
+    CTQ_STAT_ADD(m_stats.trie_iterations, trie_iterations);
+    CTQ_STAT_ADD(m_stats.postings_scanned, postings_scanned);
+    CTQ_STAT_ADD(m_stats.filter_evaluations, filter_evaluations);
+
+    return ret;
+}
+
+std::vector<std::string> Reader::complete(const std::string &prefix, size_t k, int path_idx) const {
+    return complete(prefix, k, PathSet{ path_idx });
+}
+
+std::vector<std::string> Reader::complete(const std::string &prefix, size_t k, const PathSet &paths) const {
+    if (m_layout.posting_bytes == 8) {
+        return complete_keys(id_mapping_wide, prefix, k, paths);
+    }
+
+    return complete_keys(id_mapping, prefix, k, paths);
+}
+
+template<typename P>
+std::vector<std::string> Reader::complete_keys(const Contiguous2dArray<P> &id_mapping, const std::string &prefix, size_t k, const PathSet &paths) const {
+    const P path_mask = m_layout.path_mask();
+    std::vector<std::string> ret;
+    uint64_t trie_iterations = 0;
+
+    // keys left without postings by an update, or only found outside of the paths, are skipped
+    auto has_entries = [&](uint64_t ch_id) {
+        if (ch_id >= id_mapping.size()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        auto row = id_mapping.row(ch_id);
+
+        if (paths.any()) {
+            return row.size() > 0;
+        }
+
+        return std::any_of(row.begin(), row.end(), [&](P e) { return paths.contains(e & path_mask); });
+    };
+
+    ch_trie.visit([&](const auto &trie) {
+        auto it = trie.make_predictive_iterator(prefix);
+
+        while (ret.size() < k && it.next()) {
+            ++trie_iterations;
+
+            if (has_entries(it.id())) {
+                ret.emplace_back(it.decoded_view());
+            }
+        }
+    });
+
+    CTQ_STAT_ADD(m_stats.trie_iterations, trie_iterations);
+
+    return ret;
+}
+
+long Reader::read_entry_cluster(uint64_t id, uint32_t &data_pos, const char *&cluster) {
+    auto it = std::lower_bound(ids.begin(), ids.end(), id);
+
+    if (it == ids.end()) {
+        return -1;
+    }
 
-    while (it.next() && (!count || id_cnt < count)) {
-        std::vector<uint64_t> key_ids; 
-        std::string key = it.decoded();
-        uint64_t ch_id = it.id();
+    uint32_t index = std::distance(ids.begin(), it);
+    uint32_t cluster_idx = cluster_offset_idx[index];
+    uint32_t needed = 0;
 
-        if (exact_match && key != clean_key) 
-            break;
+    data_pos = pos[index];
 
-        if (ch_id >= id_mapping.size()) {
+    if (m_arena_offsets.size()) {
+        if (cluster_idx + 1 >= m_arena_offsets.size() || data_pos >= m_arena_offsets[cluster_idx + 1] - m_arena_offsets[cluster_idx]) {
             CTQ_READER_THROW("Corrupted file");
         }
 
-        assert(ch_id < id_mapping.size());
+        cluster = m_arena.data() + m_arena_offsets[cluster_idx];
 
-        for (const auto e : id_mapping[ch_id]) {
-            uint64_t id = ids[e >> 8];
-            uint8_t  pidx = 7 & e;
-            
-            if ((id_register.find(id) == id_register.end()) && (!path_idx || pidx == path_idx)) {
-                bool add_id = true;
+        return m_arena_offsets[cluster_idx + 1] - m_arena_offsets[cluster_idx];
+    }
 
-                if (filter.size()) {
-                    add_id = false;
+    // entries are back to back, a later entry of the cluster bounds the bytes to decode
+    if (!m_layout.has(FileLayout::column_clusters)) {
+        for (size_t n : { (size_t)index + 1, (size_t)index - 1 }) {
+            if (n < ids.size() && cluster_offset_idx[n] == cluster_idx && pos[n] > data_pos && (needed == 0 || pos[n] < needed)) {
+                needed = pos[n];
+            }
+        }
+    }
 
-                    bool is_filter_exact_match = is_exact_match(filter);
-                    std::string clean_filter = clean_keyword(filter, is_filter_exact_match);
+    // entries clustered together are often read together
+    if (m_cluster_idx == (long)cluster_idx && (m_cluster_whole || (needed && needed <= m_cluster_len))) {
+        if (data_pos >= m_cluster_len) {
+            CTQ_READER_THROW("Corrupted file");
+        }
 
-                    for (const auto filter_id : paths_mapping[e >> 8]) {
-                        std::string dec = ch_trie.decode(filter_id);
+        cluster = m_cluster.data();
 
-                        if (dec.size() < clean_filter.size()) continue;
+        return m_cluster_len;
+    }
 
-                        if (is_filter_exact_match) {
-                            add_id = (clean_filter == dec);
-                        } else {
-                            add_id = (strncmp(clean_filter.c_str(), dec.c_str(), clean_filter.size()) == 0);
-                        }
+    m_cluster_idx = -1;
+    input.seekg(cluster_offsets[cluster_idx], input.beg);
 
+    bool whole = false;
+    long cluster_size = read_cluster(input, m_compressed, m_cluster, m_layout, &m_stats, needed, &whole);
 
-                        if (add_id) {
-                            if (filter_path_idx) {
-                                auto mapping = id_mapping[filter_id];
-                                bool foundIdForPath = std::binary_search(mapping.begin(), mapping.end(), (((e >> 8) << 8) | filter_path_idx));
-                                
-                                if (foundIdForPath) {
-                                    break;
-                                }
-                                
-                                add_id = false;
-                            } else {
-                                break;
-                            }
-                        }
-                    }
-                }
+    if (cluster_size < 0 || data_pos >= cluster_size) {
+        CTQ_READER_THROW("Corrupted file");
+    }
 
-                if (add_id) {
-                    id_register.insert(id);
+    m_cluster_idx   = cluster_idx;
+    m_cluster_len   = cluster_size;
+    m_cluster_whole = whole;
+    cluster = m_cluster.data();
 
-                    if (i++ >= offset) {
-                        ++id_cnt;
-                        key_ids.push_back(id);
-                    }
-                }
-            }            
-        }
+    return cluster_size;
+}
 
-        if (key_ids.size())
-            ret[key] = key_ids;
+std::string_view Reader::trie_text(uint32_t trie_id, std::string &buf) const {
+    if (m_string_pool.size()) {
+        auto row = m_string_pool.row(trie_id);
+        return std::string_view(row.begin(), row.size());
     }
 
-    return ret;
+    ch_trie.decode(trie_id, buf);
+
+    return buf;
+}
+
+std::string_view Reader::decode_text(uint32_t text_id, std::string &buf) const {
+    if (text_id >= (ch_trie_ids.size() ? ch_trie_ids.size() : ch_trie.num_keys())) {
+        CTQ_READER_THROW("Corrupted file");
+    }
+
+    return trie_text(ch_trie_ids.size() ? ch_trie_ids[text_id] : text_id, buf);
 }
 
 std::string Reader::get(uint64_t id) {
-    auto it = std::lower_bound(ids.begin(), ids.end(), id);
+    CTQ_STAT_ADD(m_stats.get_calls, 1);
+    CTQ_STAT_TIMER(timer, m_stats.get_latency_us);
 
-    if (it == ids.end()) {
+    uint32_t data_pos;
+    const char *cluster = nullptr;
+    long cluster_size = read_entry_cluster(id, data_pos, cluster);
+
+    if (cluster_size < 0) {
         return "";
     }
 
-    uint32_t index = std::distance(ids.begin(), it);
-    uint32_t cluster_offset = cluster_offsets[cluster_offset_idx[index]];
-    uint16_t data_pos = pos[index];
-
-    input.seekg(cluster_offset, input.beg);
-
     std::stack<std::string> open_tags;
     std::string output;
+    std::string text_buf;
     std::vector<bool> entry_bp;
-    uint8_t last_node_pop;
     long last_bp_open = 0;
 
-    std::stringstream ss;
-    uint32_t cluster_size = read_cluster(input, ss);
-
-    if (data_pos >= cluster_size) {
-        CTQ_READER_THROW("Corrupted file");
-    }
-
-    ss.clear();
-    ss.seekg(data_pos, ss.beg);
-    ss.read((char*)&last_node_pop, sizeof last_node_pop);
+    entryStreams streams = open_entry(cluster, cluster_size, data_pos, m_layout);
+    elementReader elements(streams, m_layout);
+    const uint8_t last_node_pop = streams.last_node_pop;
 
     /// increment i
     auto close_tags = [&entry_bp, &output, &open_tags] (int &i) {
@@ -375,13 +1452,8 @@ std::string Reader::get(uint64_t id) {
         }
     };
 
-    auto read_element = [&ss](bool data_only = false) -> element {
-        if (ss.eof()) return element(0, 0);
-
-        uint32_t tmp;
-        ss.read((char*)&tmp, sizeof tmp);
-
-        return data_only ? element(0, tmp) : element(3 & tmp, tmp >> 2);
+    auto read_element = [&elements](bool data_only = false) -> element {
+        return elements.next(data_only);
     };
 
     // read bp
@@ -389,9 +1461,8 @@ std::string Reader::get(uint64_t id) {
         int open_cnt = -1;
 
         // bp is known to be well-formed    
-        for (int i = 0; open_cnt && !ss.eof(); ) {
-            char b;
-            ss.read(&b, sizeof b);
+        for (int i = 0; open_cnt && streams.bp < streams.bp_end; ) {
+            char b = *streams.bp++;
 
             for (int j = 7; j >= 0; --j) {
                 bool bit = 1 & (b >> j);
@@ -420,7 +1491,7 @@ std::string Reader::get(uint64_t id) {
     int last_node_pop_cnt = -1;
     element elt = read_element();
 
-    if (ss.eof()) {
+    if (elements.eof) {
         CTQ_READER_THROW("Corrupted file");
     }
 
@@ -454,12 +1525,8 @@ std::string Reader::get(uint64_t id) {
                 open_tags.push(key);
                 last_node_pop_cnt = -1;
             } else if (elt.type == 1) {
-                if (elt.data >= ch_trie.num_keys()) {
-                    CTQ_READER_THROW("Corrupted file");
-                }
-
-                std::string key = ch_trie.decode(elt.data);
-                output += '>' + key;
+                output += '>';
+                output += decode_text(elt.data, text_buf);
             } else {
                 uint32_t dataName = elt.data;
                 elt = read_element(true);
@@ -479,12 +1546,173 @@ std::string Reader::get(uint64_t id) {
             prev_type = elt.type;
 
             elt = read_element();
-        } while ( !ss.eof() && elt.type != 0 && (i != last_bp_open || last_node_pop_cnt < last_node_pop));
+        } while ( !elements.eof && elt.type != 0 && (i != last_bp_open || last_node_pop_cnt < last_node_pop));
     }
 
     return output;
 }
 
+std::map<std::string, std::vector<std::string>> Reader::get(uint64_t id, const std::vector<std::string> &paths) {
+    CTQ_STAT_ADD(m_stats.get_calls, 1);
+    CTQ_STAT_TIMER(timer, m_stats.get_latency_us);
+
+    std::map<std::string, std::vector<std::string>> ret;
+    std::set<std::string> prefixes;
+    std::string text_buf;
+    uint32_t data_pos;
+    const char *cluster = nullptr;
+
+    for (const auto &path : paths) {
+        for (size_t i = path.find('/', 1); i != std::string::npos; i = path.find('/', i + 1)) {
+            prefixes.insert(path.substr(0, i));
+        }
+
+        prefixes.insert(path);
+    }
+
+    long cluster_size = paths.empty() ? -1 : read_entry_cluster(id, data_pos, cluster);
+
+    if (cluster_size < 0) {
+        return ret;
+    }
+
+    entryStreams streams = open_entry(cluster, cluster_size, data_pos, m_layout);
+    elementReader elements(streams, m_layout);
+    const std::set<std::string> requested(paths.begin(), paths.end());
+    const char *bp = streams.bp;
+    const size_t bit_cnt = 8 * (streams.bp_end - streams.bp);
+    size_t first = 0;
+    size_t last_open = 0;
+    std::string path;
+    std::vector<size_t> path_lens;
+
+    // skip padding zeros
+    while (first < bit_cnt && !bp_bit(bp, first)) ++first;
+
+    for (size_t i = first; i < bit_cnt; ++i) {
+        if (bp_bit(bp, i)) last_open = i;
+    }
+
+    element elt = elements.next();
+
+    for (size_t i = first; i < bit_cnt && !elements.eof; ++i) {
+        if (!bp_bit(bp, i)) {
+            if (path_lens.empty()) break;
+
+            path.resize(path_lens.back());
+            path_lens.pop_back();
+            continue;
+        }
+
+        if (elt.type != 0 || elt.data >= xml_alphabet.size()) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        path_lens.push_back(path.size());
+        path += '/';
+        path += xml_alphabet[elt.data];
+
+        // skip the subtree, its elements are read up to the next tag without decoding texts
+        if (prefixes.count(path) == 0) {
+            size_t close = bp_find_close(bp, bit_cnt, i);
+            size_t tag_cnt = (close - i + 1) / 2;
+
+            if (close >= bit_cnt) {
+                CTQ_READER_THROW("Corrupted file");
+            }
+
+            if (last_open < close) break;
+
+            for (size_t seen = 0; ; ) {
+                elt = elements.next();
+
+                if (elements.eof || (elt.type == 0 && ++seen == tag_cnt)) break;
+                if (elt.type == 2) elements.next(true);
+            }
+
+            path.resize(path_lens.back());
+            path_lens.pop_back();
+            i = close;
+            continue;
+        }
+
+        bool keep = requested.count(path);
+        int pop_cnt = 0;
+
+        // the elements of the last tag are the last_node_pop ones following it
+        for (elt = elements.next(); !elements.eof && elt.type != 0 && (i != last_open || pop_cnt < streams.last_node_pop); elt = elements.next()) {
+            if (elt.type == 1 && keep) {
+                ret[path].emplace_back(decode_text(elt.data, text_buf));
+            } else if (elt.type == 2) {
+                elements.next(true);
+            }
+
+            ++pop_cnt;
+        }
+    }
+
+    return ret;
+}
+
+std::vector<std::string> Reader::get_texts(uint64_t id) {
+    CTQ_STAT_ADD(m_stats.get_calls, 1);
+    CTQ_STAT_TIMER(timer, m_stats.get_latency_us);
+
+    std::vector<std::string> ret;
+    std::string text_buf;
+    uint32_t data_pos;
+    const char *cluster = nullptr;
+    uint32_t word;
+    long cluster_size = read_entry_cluster(id, data_pos, cluster);
+
+    if (cluster_size < 0) {
+        return ret;
+    }
+
+    entryStreams streams = open_entry(cluster, cluster_size, data_pos, m_layout);
+    const bool varint = m_layout.has(FileLayout::varint_elements);
+
+    if (m_layout.has(FileLayout::column_clusters)) {
+        while (streams.text < streams.text_end) {
+            if (!get_word(streams.text, streams.text_end, varint, word)) {
+                CTQ_READER_THROW("Corrupted file");
+            }
+
+            ret.emplace_back(decode_text(word, text_buf));
+        }
+
+        return ret;
+    }
+
+    // rows: the entry ends last_node_pop elements after its last tag
+    size_t open_cnt = 0;
+    size_t tag_cnt  = 0;
+    long remaining  = -1;
+
+    for (const char *b = streams.bp; b < streams.bp_end; ++b) {
+        open_cnt += std::bitset<8>(*b).count();
+    }
+
+    while (remaining != 0 && get_word(streams.elt, streams.elt_end, varint, word)) {
+        if ((word & 3) == 0) {
+            if (++tag_cnt > open_cnt) break;
+            if (tag_cnt == open_cnt) remaining = streams.last_node_pop;
+
+            continue;
+        }
+
+        if ((word & 3) == 1) {
+            ret.emplace_back(decode_text(word >> 2, text_buf));
+        } else if (!get_word(streams.elt, streams.elt_end, varint, word)) {
+            CTQ_READER_THROW("Corrupted file");
+        }
+
+        if (remaining > 0) --remaining;
+    }
+
+    return ret;
+}
+
 std::string Reader::get_writer_version() const {
     size_t size = std::snprintf(nullptr, 0, "%d.%d.%d", m_writer_version_major, m_writer_version_minor, m_writer_version_patch);
     std::string version(size, 0);
@@ -501,4 +1729,373 @@ std::string Reader::get_reader_version() const {
     return version;
 }
 
+ctq_reader_stats Reader::stats() const {
+    ctq_reader_stats ret = {};
+
+#ifdef CTQ_READER_STATS
+    auto load = [](const std::atomic<uint64_t> &counter) { return counter.load(std::memory_order_relaxed); };
+
+    ret.find_calls           = load(m_stats.find_calls);
+    ret.get_calls            = load(m_stats.get_calls);
+    ret.clusters_read        = load(m_stats.clusters_read);
+    ret.compressed_bytes     = load(m_stats.compressed_bytes);
+    ret.decompressed_bytes   = load(m_stats.decompressed_bytes);
+    ret.decompression_ns     = load(m_stats.decompression_ns);
+    ret.trie_iterations      = load(m_stats.trie_iterations);
+    ret.postings_scanned     = load(m_stats.postings_scanned);
+    ret.filter_evaluations   = load(m_stats.filter_evaluations);
+    ret.find_cache_hits      = load(m_stats.find_cache_hits);
+    ret.find_cache_misses    = load(m_stats.find_cache_misses);
+    ret.find_cache_evictions = load(m_stats.find_cache_evictions);
+
+    for (int i = 0; i < CTQ_STATS_LATENCY_BUCKETS; ++i) {
+        ret.find_latency_us[i] = load(m_stats.find_latency_us[i]);
+        ret.get_latency_us[i]  = load(m_stats.get_latency_us[i]);
+    }
+#endif
+
+    ret.load_ns          = m_load_ns;
+    ret.preload_bytes    = m_arena.size();
+    ret.find_cache_bytes = m_find_cache ? m_find_cache->bytes() : 0;
+
+    return ret;
+}
+
+void Reader::reset_stats() {
+    auto clear = [](std::atomic<uint64_t> &counter) { counter.store(0, std::memory_order_relaxed); };
+
+    clear(m_stats.find_calls);
+    clear(m_stats.get_calls);
+    clear(m_stats.clusters_read);
+    clear(m_stats.compressed_bytes);
+    clear(m_stats.decompressed_bytes);
+    clear(m_stats.decompression_ns);
+    clear(m_stats.trie_iterations);
+    clear(m_stats.postings_scanned);
+    clear(m_stats.filter_evaluations);
+    clear(m_stats.find_cache_hits);
+    clear(m_stats.find_cache_misses);
+    clear(m_stats.find_cache_evictions);
+
+    for (int i = 0; i < CTQ_STATS_LATENCY_BUCKETS; ++i) {
+        clear(m_stats.find_latency_us[i]);
+        clear(m_stats.get_latency_us[i]);
+    }
+}
+
+// address identifying the calling thread in hazard records
+static const void *thread_tag() {
+    static thread_local char tag;
+    return &tag;
+}
+
+ReloadableReader::ReloadableReader(const std::string &filename, const ReaderOptions &options) : m_options(options), m_current(new Reader(filename, options)) {}
+
+ReloadableReader::~ReloadableReader() {
+    for (auto e : m_retired) {
+        delete e;
+    }
+
+    delete m_current.load();
+
+    for (HazardRecord *record = m_records.load(), *next; record; record = next) {
+        next = record->next;
+        delete record;
+    }
+}
+
+ReloadableReader::Snapshot::~Snapshot() {
+    if (m_record) {
+        m_record->reader.store(nullptr);
+        m_record->thread.store(nullptr, std::memory_order_relaxed);
+        m_record->used.store(false, std::memory_order_release);
+    }
+}
+
+ReloadableReader::Snapshot ReloadableReader::acquire() const {
+    HazardRecord *record = m_records.load(std::memory_order_acquire);
+
+    // a free record, or a new one when all are held
+    while (record && (record->used.load(std::memory_order_relaxed) || record->used.exchange(true, std::memory_order_acquire))) {
+        record = record->next;
+    }
+
+    if (!record) {
+        record = new HazardRecord();
+        record->used.store(true, std::memory_order_relaxed);
+        record->next = m_records.load(std::memory_order_relaxed);
+
+        while (!m_records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    record->thread.store(thread_tag(), std::memory_order_relaxed);
+
+    // the Reader is pinned once the record holds it and it is still the current one
+    Reader *reader;
+
+    do {
+        reader = m_current.load();
+        record->reader.store(reader);
+    } while (reader != m_current.load());
+
+    return Snapshot(record, reader);
+}
+
+bool ReloadableReader::is_held(Reader *reader, bool &held_by_caller) const {
+    bool held = false;
+
+    for (HazardRecord *record = m_records.load(std::memory_order_acquire); record; record = record->next) {
+        if (record->reader.load() != reader) continue;
+
+        if (record->thread.load(std::memory_order_relaxed) == thread_tag()) {
+            held_by_caller = true;
+        } else {
+            held = true;
+        }
+    }
+
+    return held;
+}
+
+void ReloadableReader::reload(const std::string &filename) {
+    std::unique_ptr<Reader> next(new Reader(filename, m_options));
+    std::lock_guard<std::mutex> lock(m_reload_mutex);
+
+    Reader *prev = m_current.exchange(next.release());
+    m_generation.fetch_add(1, std::memory_order_relaxed);
+
+    bool held_by_caller = false;
+
+    while (is_held(prev, held_by_caller)) {
+        std::this_thread::yield();
+    }
+
+    m_retired.push_back(prev);
+
+    // readers retired by earlier reloads of a thread holding a snapshot go once released
+    for (size_t i = 0; i < m_retired.size();) {
+        bool by_caller = false;
+
+        if (is_held(m_retired[i], by_caller) || by_caller) {
+            ++i;
+        } else {
+            delete m_retired[i];
+            m_retired[i] = m_retired.back();
+            m_retired.pop_back();
+        }
+    }
+}
+
+std::map<std::string, std::vector<uint64_t>> ReloadableReader::find(const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx, bool normalized) const {
+    return acquire()->find(keyword, offset, count, path_idx, filter, filter_path_idx, normalized);
+}
+
+size_t ReloadableReader::find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx, bool normalized) const {
+    return acquire()->find(ctx, keyword, offset, count, path_idx, filter, filter_path_idx, normalized);
+}
+
+size_t ReloadableReader::find(QueryContext &ctx, const std::string &keyword, size_t offset, size_t count, const PathSet &paths, const std::string &filter, int filter_path_idx, bool normalized) const {
+    return acquire()->find(ctx, keyword, offset, count, paths, filter, filter_path_idx, normalized);
+}
+
+size_t ReloadableReader::count(const std::string &keyword, int path_idx, const std::string &filter, int filter_path_idx, size_t limit) const {
+    return acquire()->count(keyword, path_idx, filter, filter_path_idx, limit);
+}
+
+std::vector<std::string> ReloadableReader::complete(const std::string &prefix, size_t k, int path_idx) const {
+    return acquire()->complete(prefix, k, path_idx);
+}
+
+std::string ReloadableReader::get(uint64_t id) {
+    return acquire()->get(id);
+}
+
+std::map<std::string, std::vector<std::string>> ReloadableReader::get(uint64_t id, const std::vector<std::string> &paths) {
+    return acquire()->get(id, paths);
+}
+
+// threads running submitted tasks, kept until the pool is destroyed
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned thread_cnt) {
+        for (unsigned i = 0; i < thread_cnt; ++i) {
+            m_threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_cv.notify_all();
+
+        for (auto &e : m_threads) {
+            e.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+
+        m_cv.notify_one();
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+
+                if (m_tasks.empty()) return;
+
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+
+            task();
+        }
+    }
+
+    std::vector<std::thread>          m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_cv;
+    bool                              m_stop = false;
+};
+
+MultiReader::MultiReader(const std::vector<std::string> &filenames, bool enable_filters) {
+    if (filenames.size() > 256) {
+        CTQ_READER_THROW("Too many shards");
+    }
+
+    for (const auto &e : filenames) {
+        m_readers.emplace_back(new Reader(e, enable_filters));
+
+        // ids are sorted, the last one has to leave the 8 upper bits to the shard index
+        const auto &ids = m_readers.back()->ids;
+
+        if (!ids.empty() && ids.back() != local_id(ids.back())) {
+            CTQ_READER_THROW("Entry id too large for a shard");
+        }
+    }
+
+    if (m_readers.size() > 1) {
+        size_t thread_cnt = std::max(1U, std::thread::hardware_concurrency());
+        m_pool.reset(new WorkerPool(std::min(thread_cnt, m_readers.size() - 1)));
+    }
+}
+
+MultiReader::~MultiReader() = default;
+
+std::map<std::string, std::vector<uint64_t>> MultiReader::find(const std::string &keyword, size_t offset, size_t count, int path_idx, const std::string &filter, int filter_path_idx) const {
+    // contexts of the calling thread, which waits for every shard before reusing them.
+    // Tasks reach them through ctxs, a thread_local named in a task would be the worker's own
+    thread_local std::vector<QueryContext> thread_ctxs;
+    std::vector<QueryContext> &ctxs = thread_ctxs;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t pending = m_readers.size() > 1 ? m_readers.size() - 1 : 0;
+
+    if (ctxs.size() < m_readers.size()) {
+        ctxs.resize(m_readers.size());
+    }
+
+    auto search = [&](size_t i) {
+        try {
+            m_readers[i]->find(ctxs[i], keyword, 0, 0, path_idx, filter, filter_path_idx);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+        }
+    };
+
+    // the calling thread searches the first shard while the pool searches the others
+    for (size_t i = 1; i < m_readers.size(); ++i) {
+        m_pool->submit([&, i] {
+            search(i);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) done.notify_one();
+        });
+    }
+
+    if (!m_readers.empty()) {
+        search(0);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return pending == 0; });
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // shards list keys in the order of their own trie, pages are cut once keys are merged in byte order
+    std::map<std::string_view, std::vector<uint64_t>> merged;
+    std::map<std::string, std::vector<uint64_t>> ret;
+
+    for (uint32_t i = 0; i < m_readers.size(); ++i) {
+        for (size_t k = 0; k < ctxs[i].size(); ++k) {
+            const auto e = ctxs[i][k];
+            auto &ids = merged[e.key];
+
+            for (size_t n = 0; n < e.id_cnt; ++n) {
+                ids.push_back(make_id(i, e.ids[n]));
+            }
+        }
+    }
+
+    size_t i = 0;
+    size_t id_cnt = 0;
+
+    for (auto &e : merged) {
+        if (count && id_cnt >= count) break;
+
+        std::vector<uint64_t> key_ids;
+
+        for (const auto id : e.second) {
+            if (i++ >= offset && (!count || id_cnt < count)) {
+                ++id_cnt;
+                key_ids.push_back(id);
+            }
+        }
+
+        if (key_ids.size()) 
+            ret[std::string(e.first)] = std::move(key_ids);
+    }
+
+    return ret;
+}
+
+std::string MultiReader::get(uint64_t id) {
+    uint32_t shard = shard_of(id);
+
+    if (shard >= m_readers.size()) {
+        return "";
+    }
+
+    return m_readers[shard]->get(local_id(id));
+}
+
+std::map<std::string, std::vector<std::string>> MultiReader::get(uint64_t id, const std::vector<std::string> &paths) {
+    uint32_t shard = shard_of(id);
+
+    if (shard >= m_readers.size()) {
+        return {};
+    }
+
+    return m_readers[shard]->get(local_id(id), paths);
+}
+
 }
@@ -1,7 +1,10 @@
 #include "ctq_writer.h"
 #include "ctq_util.hh"
+#include "ctq_trie.hh"
+#include "ctq_intern.hh"
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <set>
 #include <map>
@@ -9,101 +12,716 @@
 #include <functional>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cctype>
 #include <memory>
+#include <unordered_map>
+#include <iterator>
+#include <numeric>
+#include <future>
+#include <thread>
 #include <cmath>
 #include <cstring>
+#include <chrono>
+#include <queue>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
 
 #include <libxml/parser.h>
-#include "xcdat.hpp"
 
 #include <lz4hc.h>
 
 using xmlAtt = std::map<std::string, std::string>;
-using trie_type = xcdat::trie_8_type;
+using write_clock = std::chrono::steady_clock;
 
 static std::vector<std::string> xml_alphabet;
-static trie_type ch_trie;
+static std::unordered_map<std::string_view, uint32_t> xml_alphabet_idx; // views of xml_alphabet
+static AnyTrie ch_trie;
+static InternTable ch_symbols;              // texts of the input, looked up by the transform pass
+static std::vector<uint32_t> ch_symbol_ids; // ch_symbols id -> ch_trie id
+static std::vector<uint32_t> ch_trie_ids;    // cluster text id -> ch_trie id, empty when identical
+static std::vector<uint32_t> ch_cluster_ids; // ch_trie id -> cluster text id, empty when identical
+static FileLayout file_layout;
+static const size_t column_header_bytes = 2 * sizeof(uint32_t); // structure and tag column sizes
+static const long layout_pos = 3 * sizeof(uint32_t); // right after the version
 
 struct parserState {
-    bool        in_body;
-    bool        in_entry;
-    std::string ch;
-    size_t      entry_cnt = 0;
+    bool                  in_body = false;
+    bool                  in_entry = false;
+    bool                  delta = false;
+    bool                  skip_entry = false; // removed entry of a delta
+    std::string           ch;
+    size_t                entry_cnt = 0;
+    const char           *phase = "";
+    CTQ::ProgressCallback progress;
+    size_t                progress_step = 0;
 };
 
 struct parseState : public parserState {
     std::vector<uint64_t> ids;
-    std::set<std::string> xml_alpha{};
-    std::set<std::string> ch_alpha{};
+    std::vector<uint64_t> removed_ids;
+    InternTable           xml_alpha;
+    InternTable           ch_alpha;
     uint32_t              id_mapping_bytes;
 };
 
+using postings = std::vector<std::pair<uint32_t, uint64_t>>; // (row, value)
+
+// Unique path of a temporary file in temp_dir, or in the system one
+std::string temp_path(const std::string &temp_dir, const char *ext) {
+    static std::atomic<uint64_t> file_id { (uint64_t)write_clock::now().time_since_epoch().count() };
+
+    std::filesystem::path dir = temp_dir.size() ? std::filesystem::path(temp_dir) : std::filesystem::temp_directory_path();
+
+    return (dir / ("ctq_" + std::to_string(file_id++) + ext)).string();
+}
+
+/**
+ * (row, value) pairs saved as a Contiguous2dArray, sorted by row and value without duplicates.
+ * 
+ * Past limit pairs, they are sorted and spilled as a run to a temporary file. Runs are merged when saved,
+ * at most fan_in at once, in several passes when there are more.
+ */
+class postingRuns {
+public:
+    ~postingRuns() {
+        for (const auto &e : m_runs) {
+            std::remove(e.path.c_str());
+        }
+    }
+
+    // 0 keeps every pair in memory
+    void set_budget(size_t bytes, const std::string &temp_dir, unsigned fan_in) {
+        m_limit    = bytes ? std::max<size_t>(1, bytes / sizeof(postings::value_type)) : 0;
+        m_temp_dir = temp_dir;
+        m_fan_in   = std::max(2U, fan_in);
+    }
+
+    inline void add(uint32_t row, uint64_t value) {
+        if (m_limit && m_pairs.capacity() == 0) {
+            m_pairs.reserve(m_limit);
+        }
+
+        m_pairs.emplace_back(row, value);
+
+        if (m_pairs.size() == m_limit) {
+            spill();
+        }
+    }
+
+    // moves the pairs and runs of other, spilled first when other is budgeted
+    void append(postingRuns &other) {
+        if (other.m_limit) {
+            other.spill();
+        }
+
+        for (const auto &e : other.m_pairs) {
+            add(e.first, e.second);
+        }
+
+        m_runs.insert(m_runs.end(), other.m_runs.begin(), other.m_runs.end());
+        m_failed |= other.m_failed;
+        m_peak    = std::max(m_peak, other.peak_bytes());
+
+        other.m_runs.clear();
+        other.m_pairs.clear();
+    }
+
+    size_t peak_bytes() const { return std::max(m_peak, m_pairs.capacity() * sizeof m_pairs[0]); }
+    size_t run_cnt() const { return m_runs.size(); }
+
+    // counts and row starts take count_bytes each, -1 when they do not fit
+    template<typename T>
+    int save(std::ostream &os, unsigned row_cnt, unsigned count_bytes) {
+        if (m_runs.empty()) {
+            sort_pairs();
+
+            Contiguous2dArray<T> arr(m_pairs, row_cnt);
+
+            if (!arr.fits(count_bytes)) {
+                std::cerr << "Too many postings for the legacy format" << std::endl;
+                return -1;
+            }
+
+            arr.save(os, count_bytes);
+
+            return 0;
+        }
+
+        spill();
+
+        return !m_failed && reduce_runs() ? merge<T>(os, row_cnt, count_bytes) : -1;
+    }
+
+private:
+    struct run {
+        std::string path;
+        size_t      pair_cnt;
+    };
+
+    void sort_pairs() {
+        std::sort(m_pairs.begin(), m_pairs.end());
+        m_pairs.erase(std::unique(m_pairs.begin(), m_pairs.end()), m_pairs.end());
+    }
+
+    void spill() {
+        if (m_pairs.empty()) return;
+
+        std::string path = temp_path(m_temp_dir, ".run");
+        std::ofstream file(path, std::ios::binary);
+
+        m_peak = peak_bytes();
+        sort_pairs();
+
+        file.write((const char*)m_pairs.data(), m_pairs.size() * sizeof m_pairs[0]);
+        m_runs.push_back({ path, m_pairs.size() });
+        m_pairs.clear();
+
+        if (!file.good()) {
+            std::cerr << "Cannot write " << path << std::endl;
+            m_failed = true;
+        }
+    }
+
+    // pairs read at once from each of run_cnt runs, the budget being shared with an output buffer
+    size_t block_size(size_t run_cnt) const { return std::max<size_t>(1, m_limit / (run_cnt + 1)); }
+
+    // k-way merge, emit is called on each distinct pair in order. false when a run cannot be read whole
+    template<typename F>
+    bool merge_runs(const std::vector<run> &runs, F &&emit) {
+        const size_t block = block_size(runs.size());
+        std::vector<std::ifstream> files;
+        std::vector<postings> blocks(runs.size());
+        std::vector<size_t> heads(runs.size(), 0);
+        std::vector<size_t> left(runs.size()); // pairs not read yet
+        bool ok = true;
+
+        using head = std::pair<postings::value_type, size_t>; // (pair, run)
+        std::priority_queue<head, std::vector<head>, std::greater<head>> queue;
+
+        auto next = [&](size_t i) {
+            if (++heads[i] >= blocks[i].size()) {
+                size_t cnt = std::min(block, left[i]);
+
+                blocks[i].resize(cnt);
+                files[i].read((char*)blocks[i].data(), cnt * sizeof blocks[i][0]);
+
+                if ((size_t)files[i].gcount() != cnt * sizeof blocks[i][0]) {
+                    std::cerr << "Cannot read " << runs[i].path << std::endl;
+                    blocks[i].clear();
+                    ok = false;
+                }
+
+                left[i] -= cnt;
+                heads[i] = 0;
+            }
+
+            if (heads[i] < blocks[i].size()) {
+                queue.emplace(blocks[i][heads[i]], i);
+            }
+        };
+
+        for (size_t i = 0; i < runs.size(); ++i) {
+            files.emplace_back(runs[i].path, std::ios::binary);
+
+            if (!files.back()) {
+                std::cerr << "Cannot open " << runs[i].path << std::endl;
+                return false;
+            }
+
+            left[i] = runs[i].pair_cnt;
+            next(i);
+        }
+
+        postings::value_type last { UINT32_MAX, UINT64_MAX };
+
+        while (ok && queue.size()) {
+            auto [pair, i] = queue.top();
+            queue.pop();
+            next(i);
+
+            if (pair != last) {
+                emit(pair);
+                last = pair;
+            }
+        }
+
+        return ok;
+    }
+
+    // merges groups of fan_in runs into one until at most fan_in are left
+    bool reduce_runs() {
+        while (m_runs.size() > m_fan_in) {
+            std::vector<run> runs;
+            runs.swap(m_runs);
+
+            for (size_t i = 0; i < runs.size(); i += m_fan_in) {
+                std::vector<run> group(runs.begin() + i, runs.begin() + std::min(runs.size(), i + m_fan_in));
+                run merged { temp_path(m_temp_dir, ".run"), 0 };
+                std::ofstream file(merged.path, std::ios::binary);
+                postings buf;
+
+                buf.reserve(block_size(group.size()));
+
+                auto flush = [&]() {
+                    file.write((const char*)buf.data(), buf.size() * sizeof buf[0]);
+                    buf.clear();
+                };
+
+                bool ok = file && merge_runs(group, [&](const postings::value_type &pair) {
+                    buf.push_back(pair);
+                    ++merged.pair_cnt;
+
+                    if (buf.size() == buf.capacity()) flush();
+                });
+
+                flush();
+                m_runs.push_back(merged);
+
+                for (const auto &e : group) {
+                    std::remove(e.path.c_str());
+                }
+
+                if (!ok || !file.good()) {
+                    std::cerr << "Cannot merge runs into " << merged.path << std::endl;
+                    m_runs.insert(m_runs.end(), runs.begin() + std::min(runs.size(), i + m_fan_in), runs.end());
+
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // last merge pass, the row starts are written once the values are
+    template<typename T>
+    int merge(std::ostream &os, unsigned row_cnt, unsigned count_bytes) {
+        const long start = os.tellp();
+        std::vector<uint64_t> row_starts(row_cnt, 0);
+        std::vector<T> values;
+        uint64_t value_cnt = 0;
+        uint32_t row = 0;
+
+        values.reserve(block_size(m_runs.size()));
+
+        // counts and row starts are known after the values
+        write_uint<uint64_t>(os, row_cnt, count_bytes);
+        write_uint(os, value_cnt, count_bytes);
+        os.seekp((long)row_cnt * count_bytes, os.cur);
+
+        bool ok = merge_runs(m_runs, [&](const postings::value_type &pair) {
+            for (; row <= pair.first && row < row_cnt; ++row) {
+                row_starts[row] = value_cnt;
+            }
+
+            values.push_back(static_cast<T>(pair.second));
+            ++value_cnt;
+
+            if (values.size() == values.capacity()) {
+                os.write((const char*)values.data(), values.size() * sizeof values[0]);
+                values.clear();
+            }
+        });
+
+        if (!ok) {
+            return -1;
+        }
+
+        for (; row < row_cnt; ++row) {
+            row_starts[row] = value_cnt;
+        }
+
+        os.write((const char*)values.data(), values.size() * sizeof values[0]);
+
+        if (count_bytes < 8 && value_cnt > UINT32_MAX) {
+            std::cerr << "Too many postings for the legacy format" << std::endl;
+            return -1;
+        }
+
+        const long end = os.tellp();
+
+        os.seekp(start + count_bytes, os.beg);
+        write_uint(os, value_cnt, count_bytes);
+        write_uints(os, row_starts.data(), row_starts.size(), count_bytes);
+        os.seekp(end, os.beg);
+
+        return os.good() ? 0 : -1;
+    }
+
+    postings                 m_pairs;
+    size_t                   m_limit   = 0;
+    size_t                   m_peak    = 0;
+    unsigned                 m_fan_in  = 64;
+    bool                     m_failed  = false;
+    std::string              m_temp_dir;
+    std::vector<run>         m_runs;
+};
+
+// Entry kept to be clustered out of document order
+struct keptEntry {
+    uint32_t    idx;      // in ids
+    size_t      start;    // in kept_rows
+    size_t      size;
+    size_t      overhead; // column bytes it adds to its cluster
+    std::string key;      // first text at the order path
+};
+
 struct transformState : public parserState {
-    transformState(const std::vector<uint64_t> &ids, const std::vector<std::string> &paths, std::ostream &os, size_t cluster_size) 
+    transformState(const std::vector<uint64_t> &ids, const std::vector<std::string> &paths, std::vector<uint32_t> &pos, std::vector<uint32_t> &cluster_offset_idx, std::ostream &os, size_t cluster_size) 
         :   ids(ids), 
             paths(paths),
-            pos(std::vector<uint16_t>(ids.size())), 
-            cluster_offset_idx(std::vector<uint32_t>(ids.size())), 
+            pos(pos), 
+            cluster_offset_idx(cluster_offset_idx), 
             os(os), 
-            cluster_size(cluster_size), 
-            id_mapping(std::vector<std::vector<uint32_t>>(ch_trie.num_keys())),
-            paths_mapping(std::vector<std::vector<uint32_t>>(ids.size())) {}
+            cluster_size(cluster_size),
+            budget(file_layout.has(FileLayout::column_clusters) ? cluster_size - column_header_bytes : cluster_size) {
+        data.reserve(cluster_size);
+        compressed.reserve(LZ4_compressBound(cluster_size));
+        path.reserve(256);
+        ch.reserve(256);
+    }
 
     const std::vector<uint64_t>        &ids; // sorted
-    std::vector<uint16_t>              pos;
-    std::vector<uint32_t>              cluster_offset_idx;
-    std::ostringstream                 data;
-    std::ostringstream                 tmp_data;
+    std::vector<uint32_t>              &pos; // shared by shards, each entry is written by one shard only
+    std::vector<uint32_t>              &cluster_offset_idx;
+    std::vector<char>                  data;       // current cluster
+    std::vector<char>                  tmp_data;   // current entry
+    std::vector<char>                  bp;         // packed bp of current entry
+    std::vector<char>                  compressed;
+    std::vector<char>                  columns;    // current cluster split into columns
+    size_t                             data_overhead = 0; // bound of the column bytes added to data
+    uint32_t                           entry_texts   = 0; // texts of current entry
+    double                             compression_time = 0;
+    std::vector<uint32_t>              raw_sizes;        // of each cluster
+    std::vector<uint32_t>              compressed_sizes;
     std::ostream                       &os;
     size_t                             cluster_size;
+    size_t                             budget; // raw bytes available to entries
     std::vector<uint32_t>              entry_id_idx_stack;
-    std::vector<std::vector<uint32_t>> id_mapping;
-    std::vector<uint32_t>              cluster_offsets;
+    postingRuns                        id_mapping; // (ch_trie id, entry idx << path_bits | path idx)
+    std::vector<uint64_t>              cluster_offsets;
     std::vector<bool>                  entry_bp;
     const std::vector<std::string>     &paths; // sorted
     std::string                        path;
+    std::vector<size_t>                path_lens;
     int                                last_node_pop; // number of element in the last depest node
-    std::vector<std::vector<uint32_t>> paths_mapping;
+    postingRuns                        paths_mapping; // (entry idx, ch_trie id)
+    bool                               reorder = false; // entries are kept, then clustered by pack_entries
+    size_t                             sample_window = 0; // only the first sample_window entries of every sample_stride are kept, 0 keeps all
+    size_t                             sample_stride = 0;
+    std::string                        order_path;
+    std::string                        order_key;    // of current entry
+    std::vector<char>                  kept_rows;    // kept entries, back to back
+    std::vector<keptEntry>             kept_entries;
+    bool                               unknown_text = false; // a text missing from ch_symbols
+    bool                               cluster_overflow = false; // a cluster larger than cluster_size_bytes allows
 };
 
-void print_progress(parserState *state, bool end = false) {
-#ifndef CTQ_WRITE_PROGRESS
-    return;
-#endif
+// ch_trie id of a text of the input, UINT32_MAX when missing
+inline uint32_t ch_symbol_id(const std::string &s) {
+    uint32_t symbol = ch_symbols.find(s);
+    return symbol != InternTable::npos ? ch_symbol_ids[symbol] : UINT32_MAX;
+}
 
-    int step = 5000;
-    int half_step = 100;
+void set_xml_alphabet(const std::vector<std::string> &alphabet) {
+    xml_alphabet = alphabet;
+    xml_alphabet_idx.clear();
 
-    ++state->entry_cnt;
-    if(state->entry_cnt % step == 0) {
-        std::cout << ' ' << state->entry_cnt << std::endl;
-    } else if (state->entry_cnt % half_step == 0){
-        std::cout << '.' << std::flush;
+    for (uint32_t i = 0; i < xml_alphabet.size(); ++i) {
+        xml_alphabet_idx[xml_alphabet[i]] = i;
     }
+}
+
+// number following the prefix of id
+uint64_t parse_xml_id(const char *id) {
+    while (*id && !std::isdigit(*id)) ++id;
+    return std::atol(id);
+}
 
-    if (end) {
-        int cnt = std::floor((step - state->entry_cnt % step) / (half_step + 0.0));
-        std::string blank(cnt, '_');
-        std::cout << blank << ' ' << state->entry_cnt << std::endl;
+template<typename T>
+inline void put(std::vector<char> &buf, const T &value) {
+    const char *p = (const char*)&value;
+    buf.insert(buf.end(), p, p + sizeof value);
+}
+
+inline void put_element(std::vector<char> &buf, uint32_t word) {
+    if (file_layout.has(FileLayout::varint_elements)) {
+        put_varint(buf, word);
+    } else {
+        put(buf, word);
     }
 }
 
-void parse_characters(void *user_data, const xmlChar *ch, int len) {
-    parseState *state = reinterpret_cast<parseState*>(user_data);
+// appends s without leading and trailing spaces
+inline void append_trimmed(std::string &out, const char *s, int len) {
+    int beg = 0;
+
+    while (beg < len && std::isspace((unsigned char)s[beg])) ++beg;
+    while (len > beg && std::isspace((unsigned char)s[len - 1])) --len;
+
+    out.append(s + beg, len - beg);
+}
+
+// <entry xml:id="..." type="delete"/> removes an entry in a delta
+bool is_removed_entry(const xmlChar **attrs, uint64_t &id) {
+    bool removed = false;
+
+    for (size_t i = 0; attrs != NULL && attrs[i] != NULL; i+=2) { 
+        if (strcmp((char*)attrs[i], "xml:id") == 0) {
+            id = parse_xml_id((char*)attrs[i+1]);
+        } else if (strcmp((char*)attrs[i], "type") == 0 && strcmp((char*)attrs[i+1], "delete") == 0) {
+            removed = true;
+        }
+    }
+
+    return removed;
+}
+
+double seconds_since(write_clock::time_point start) {
+    return std::chrono::duration<double>(write_clock::now() - start).count();
+}
+
+// Compresses a cluster to state->os, unless its size does not fit the layout
+void write_cluster_data(transformState &state, const char *data, uint32_t cluster_size) {
+    // an entry larger than the budget is clustered alone, past the size the widths were picked for
+    if (file_layout.cluster_size_bytes < sizeof cluster_size && cluster_size >> (8 * file_layout.cluster_size_bytes)) {
+        state.cluster_overflow = true;
+        return;
+    }
+
+    auto start = write_clock::now();
+    int bound = LZ4_compressBound(cluster_size);
+    state.compressed.resize(bound);
+
+    write_uint(state.os, cluster_size, file_layout.cluster_size_bytes);
+
+    int rv = LZ4_compress_HC(data, state.compressed.data(), cluster_size, bound, LZ4HC_CLEVEL_MAX);
+
+    if (rv > 0) {
+        state.os.write((char*)&rv, sizeof rv);
+        state.os.write(state.compressed.data(), rv);
+    } else {
+        std::cerr << "Cannot compress cluster" << std::endl;
+    }
 
-    if (!state->in_body) return;
+    state.compression_time += seconds_since(start);
+    state.raw_sizes.push_back(cluster_size);
+    state.compressed_sizes.push_back(rv > 0 ? rv : 0);
+}
+
+/**
+ * @brief Splits a cluster of back to back entries into columns.
+ * 
+ * The output holds the structure and tag column sizes as uint32_t, then the columns:
+ * - structure: per entry, last_node_pop, the varint sizes of the entry tags, texts and bp, then its bp
+ * - tag: tag and attribute words, a text is replaced by the word 1
+ * - text: text ids
+ * 
+ * Entries similar in shape get identical sizes, which compresses better than offsets.
+ * 
+ * @param starts Position of each entry in rows, replaced by its position in out
+ */
+void rows_to_columns(const std::vector<char> &rows, std::vector<uint32_t> &starts, std::vector<char> &out) {
+    const bool varint = file_layout.has(FileLayout::varint_elements);
+    std::vector<char> structure, tags, texts;
+
+    for (size_t i = 0; i < starts.size(); ++i) {
+        const char *p    = rows.data() + starts[i];
+        const char *end  = rows.data() + (i + 1 < starts.size() ? starts[i + 1] : rows.size());
+        size_t bp_size   = packed_bp_size(p + 1, end);
+        size_t tag_start = tags.size();
+        size_t text_start = texts.size();
+        uint32_t word;
+
+        for (const char *elt = p + 1 + bp_size; elt < end; ) {
+            if (!get_word(elt, end, varint, word)) {
+                CTQ_WRITER_THROW("Corrupted cluster");
+            }
+
+            if ((word & 3) == 1) {
+                put_element(tags, 1U);
+                put_element(texts, word >> 2);
+                continue;
+            }
+
+            put_element(tags, word);
+
+            // attribute value
+            if ((word & 3) == 2) {
+                if (!get_word(elt, end, varint, word)) {
+                    CTQ_WRITER_THROW("Corrupted cluster");
+                }
+
+                put_element(tags, word);
+            }
+        }
+
+        starts[i] = column_header_bytes + structure.size();
+
+        structure.push_back(*p);
+        put_varint(structure, tags.size() - tag_start);
+        put_varint(structure, texts.size() - text_start);
+        put_varint(structure, bp_size);
+        structure.insert(structure.end(), p + 1, p + 1 + bp_size);
+    }
+
+    out.clear();
+    put(out, (uint32_t)structure.size());
+    put(out, (uint32_t)tags.size());
+    out.insert(out.end(), structure.begin(), structure.end());
+    out.insert(out.end(), tags.begin(), tags.end());
+    out.insert(out.end(), texts.begin(), texts.end());
+}
+
+/**
+ * @brief Joins the columns of a cluster back into back to back entries.
+ * 
+ * @param starts Filled with the position of each entry in rows, in cluster order
+ */
+void columns_to_rows(const std::vector<char> &cluster, std::vector<char> &rows, std::vector<uint32_t> &starts) {
+    const bool varint = file_layout.has(FileLayout::varint_elements);
+    uint32_t structure_size, tag_size;
+
+    if (cluster.size() < column_header_bytes) {
+        CTQ_WRITER_THROW("Corrupted cluster");
+    }
+
+    memcpy(&structure_size, cluster.data(), sizeof structure_size);
+    memcpy(&tag_size, cluster.data() + sizeof structure_size, sizeof tag_size);
+
+    if (column_header_bytes + (uint64_t)structure_size + tag_size > cluster.size()) {
+        CTQ_WRITER_THROW("Corrupted cluster");
+    }
+
+    const char *s        = cluster.data() + column_header_bytes;
+    const char *s_end    = s + structure_size;
+    const char *tag      = s_end;
+    const char *tag_end  = tag + tag_size;
+    const char *text     = tag_end;
+    const char *text_end = cluster.data() + cluster.size();
+
+    rows.clear();
+    starts.clear();
+
+    while (s < s_end) {
+        uint32_t tag_len, text_len, bp_size, word;
+        char last_node_pop = *s++;
+
+        if (!get_varint(s, s_end, tag_len) || !get_varint(s, s_end, text_len) || !get_varint(s, s_end, bp_size)
+            || tag_len > tag_end - tag || text_len > text_end - text || bp_size > s_end - s) {
+            CTQ_WRITER_THROW("Corrupted cluster");
+        }
+
+        starts.push_back(rows.size());
+        rows.push_back(last_node_pop);
+        rows.insert(rows.end(), s, s + bp_size);
+        s += bp_size;
+
+        const char *tag_lim  = tag + tag_len;
+        const char *text_lim = text + text_len;
+
+        while (tag < tag_lim) {
+            if (!get_word(tag, tag_lim, varint, word)) {
+                CTQ_WRITER_THROW("Corrupted cluster");
+            }
+
+            if (word == 1) {
+                if (!get_word(text, text_lim, varint, word)) {
+                    CTQ_WRITER_THROW("Corrupted cluster");
+                }
+
+                put_element(rows, (word << 2) | 1U);
+                continue;
+            }
+
+            put_element(rows, word);
+
+            if ((word & 3) == 2) {
+                if (!get_word(tag, tag_lim, varint, word)) {
+                    CTQ_WRITER_THROW("Corrupted cluster");
+                }
+
+                put_element(rows, word);
+            }
+        }
+
+        text = text_lim;
+    }
+}
+
+// Writes a cluster of back to back entries, split into columns when the layout asks for it
+void write_entries(transformState &state, const std::vector<char> &rows, const std::vector<uint32_t> &entry_idxs) {
+    if (!file_layout.has(FileLayout::column_clusters)) {
+        write_cluster_data(state, rows.data(), rows.size());
+        return;
+    }
+
+    std::vector<uint32_t> starts;
+
+    for (const auto e : entry_idxs) {
+        starts.push_back(state.pos[e]);
+    }
+
+    rows_to_columns(rows, starts, state.columns);
+
+    for (size_t i = 0; i < entry_idxs.size(); ++i) {
+        state.pos[entry_idxs[i]] = starts[i];
+    }
+
+    write_cluster_data(state, state.columns.data(), state.columns.size());
+}
+
+// Called at the end of each entry and of the body
+void report_progress(parserState *state, bool end = false) {
+    if (!end) ++state->entry_cnt;
+
+    if (!state->progress || !state->progress_step) return;
+
+    if (end || state->entry_cnt % state->progress_step == 0) {
+        state->progress(state->phase, state->entry_cnt, end);
+    }
+}
+
+void set_progress(parserState &state, const char *phase, const CTQ::WriteOptions &options) {
+    state.phase = phase;
+    state.progress = options.progress;
+    state.progress_step = options.progress_step;
+}
+
+CTQ::SizeDistribution size_distribution(std::vector<uint32_t> sizes) {
+    CTQ::SizeDistribution ret;
+
+    if (sizes.empty()) return ret;
+
+    std::sort(sizes.begin(), sizes.end());
 
-    std::string str = trim(std::string((char*)ch, len));
+    auto percentile = [&sizes](size_t p) { return sizes[std::min(sizes.size() - 1, sizes.size() * p / 100)]; };
 
-    if (str.size() == 0) return;
+    ret.count = sizes.size();
+    ret.min   = sizes.front();
+    ret.p50   = percentile(50);
+    ret.p90   = percentile(90);
+    ret.p99   = percentile(99);
+    ret.max   = sizes.back();
 
-    state->ch += str;
+    for (const auto e : sizes) ret.total += e;
+
+    return ret;
+}
+
+void parse_characters(void *user_data, const xmlChar *ch, int len) {
+    parseState *state = reinterpret_cast<parseState*>(user_data);
+
+    if (!state->in_body || state->skip_entry) return;
+
+    append_trimmed(state->ch, (const char*)ch, len);
 }
 
 void parse_startElement(void *user_data, const xmlChar *name, const xmlChar **attrs) {
     parseState *state = reinterpret_cast<parseState*>(user_data);
-    std::string str_name((char*)name);
+    std::string_view str_name((char*)name);
     bool xml_id_set = false;
 
     if (str_name == "body") {
@@ -111,28 +729,35 @@ void parse_startElement(void *user_data, const xmlChar *name, const xmlChar **at
         return;
     }
 
-    if (!(state->in_body)) return;
+    if (!(state->in_body) || state->skip_entry) return;
 
     if (str_name == "entry") {
+        uint64_t id;
+
+        if (state->delta && is_removed_entry(attrs, id)) {
+            state->removed_ids.push_back(id);
+            state->skip_entry = true;
+            return;
+        }
+
         state->in_entry = true;
     }
 
-    state->xml_alpha.insert(str_name);
+    state->xml_alpha.intern(str_name);
 
     for (size_t i = 0; attrs != NULL && attrs[i] != NULL; i+=2) { 
-        std::string att_name((char*)attrs[i]);
-        std::string att_value((char*)attrs[i+1]);
+        std::string_view att_name((char*)attrs[i]);
+        const char *att_value = (char*)attrs[i+1];
 
         if (att_name == "xml:id") {
             xml_id_set = true;
-            att_value.erase(att_value.begin(), std::find_if(att_value.begin(), att_value.end(), [](char c) { return std::isdigit(c); }));
-            state->ids.push_back(std::atol(att_value.c_str()));
+            state->ids.push_back(parse_xml_id(att_value));
 
             continue;
         }
 
-        state->xml_alpha.insert(att_name);
-        state->xml_alpha.insert(att_value);
+        state->xml_alpha.intern(att_name);
+        state->xml_alpha.intern(att_value);
     }
 
     if (str_name == "entry" && xml_id_set == false) {
@@ -142,14 +767,20 @@ void parse_startElement(void *user_data, const xmlChar *name, const xmlChar **at
 
 void parse_endElement(void *user_data, const xmlChar *name) {
     parseState *state = reinterpret_cast<parseState*>(user_data);
-    std::string str_name((char*)name); 
+    std::string_view str_name((char*)name); 
+
+    if (state->skip_entry) {
+        state->skip_entry = (str_name != "entry");
+        return;
+    }
 
     if (str_name == "body") {
         state->in_body = false;
         std::sort(state->ids.begin(), state->ids.end());
+        std::sort(state->removed_ids.begin(), state->removed_ids.end());
     } else if (str_name != "entry") {
         if (state->in_entry && state->ch.size()) {
-            state->ch_alpha.insert(state->ch);
+            state->ch_alpha.intern(state->ch);
             state->id_mapping_bytes += sizeof(uint32_t);
 
             state->ch.clear();
@@ -160,63 +791,64 @@ void parse_endElement(void *user_data, const xmlChar *name) {
 
     state->in_entry = false;
 
-    print_progress(state, str_name == "body");
+    report_progress(state, str_name == "body");
 }
 
 void transform_characters(void *user_data, const xmlChar *ch, int len) {
     transformState *state = reinterpret_cast<transformState*>(user_data);
 
-    if (!(state->in_body)) return;
-
-    std::string str = trim(std::string((char*)ch, len));
-
-    if (str.size() == 0) return;
+    if (!(state->in_body) || state->skip_entry) return;
 
-    state->ch += str;
+    append_trimmed(state->ch, (const char*)ch, len);
 }
 
 void transform_startElement(void *user_data, const xmlChar *name, const xmlChar **attrs) {
     transformState *state = reinterpret_cast<transformState*>(user_data);
-    std::string str_name((char*)name); 
+    const char *str_name = (const char*)name;
 
-    auto xalpha_idx = [](const std::string& s) -> long {
-        auto it = std::lower_bound(xml_alphabet.begin(), xml_alphabet.end(), s);
-        return it != xml_alphabet.end() ? std::distance(xml_alphabet.begin(), it) : -1;
+    auto xalpha_idx = [](const char *s) -> long {
+        auto it = xml_alphabet_idx.find(std::string_view(s));
+        return it != xml_alphabet_idx.end() ? it->second : -1;
     };
 
     state->last_node_pop = 0;
 
-    if (str_name == "body") {
+    if (strcmp(str_name, "body") == 0) {
         state->in_body = true;
         return;
     }
 
-    if (!(state->in_body)) return;
+    if (!(state->in_body) || state->skip_entry) return;
+
+    if (strcmp(str_name, "entry") == 0) {
+        uint64_t id;
+
+        if (state->delta && is_removed_entry(attrs, id)) {
+            state->skip_entry = true;
+            return;
+        }
 
-    if (str_name == "entry") {
         state->in_entry = true;
     } else if (!state->in_entry) {
         return;
     }
 
     state->entry_bp.push_back(1);
-    state->path += "/" + str_name;
+    state->path_lens.push_back(state->path.size());
+    state->path += '/';
+    state->path += str_name;
 
-    uint32_t name_idx = xalpha_idx(str_name);
+    long name_idx = xalpha_idx(str_name);
     assert(name_idx >= 0);
 
-    uint32_t tmp = (uint32_t)(name_idx << 2);
-    state->tmp_data.write((char*)&tmp, sizeof tmp);
+    put_element(state->tmp_data, (uint32_t)(name_idx << 2));
 
     for (size_t i = 0; attrs != NULL && attrs[i] != NULL; i+=2) {
-        std::string att_name((char*)attrs[i]);
-        std::string att_value((char*)attrs[i+1]);
-
-        if (att_name == "xml:id") {
-            std::string id = att_value;
-            id.erase(id.begin(), std::find_if(id.begin(), id.end(), [](char c) { return std::isdigit(c); }));
+        const char *att_name  = (const char*)attrs[i];
+        const char *att_value = (const char*)attrs[i+1];
 
-            auto it = std::lower_bound(state->ids.begin(), state->ids.end(), std::atol(id.c_str()));
+        if (strcmp(att_name, "xml:id") == 0) {
+            auto it = std::lower_bound(state->ids.begin(), state->ids.end(), parse_xml_id(att_value));
             assert(it != state->ids.end());
 
             size_t index = std::distance(state->ids.begin(), it);
@@ -225,28 +857,28 @@ void transform_startElement(void *user_data, const xmlChar *name, const xmlChar
             continue;
         }
 
-        uint32_t att_name_idx = xalpha_idx(att_name);
-        uint32_t att_val_idx = xalpha_idx(att_value);
+        long att_name_idx = xalpha_idx(att_name);
+        long att_val_idx  = xalpha_idx(att_value);
 
         assert(att_name_idx >= 0);
         assert(att_val_idx >= 0);
 
-        uint32_t tmp = (uint32_t)((att_name_idx << 2) | 2U);
-        state->tmp_data.write((char*)&tmp, sizeof tmp);
-        state->tmp_data.write((char*)&att_val_idx, sizeof att_val_idx);
+        put_element(state->tmp_data, (uint32_t)((att_name_idx << 2) | 2U));
+        put_element(state->tmp_data, (uint32_t)att_val_idx);
         ++state->last_node_pop;
     }
 }
 
 void transform_endElement(void *user_data, const xmlChar *name) {
     transformState *state = reinterpret_cast<transformState*>(user_data);
-    std::string str_name((char*)name); 
+    const char *str_name = (const char*)name;
+    bool is_body = strcmp(str_name, "body") == 0;
     
-    std::vector<char> bp;
+    std::vector<char> &bp = state->bp;
     long data_size;
     long tmp_data_size;
 
-    auto get_path_idx = [&state](const std::string &path) -> uint8_t {
+    auto get_path_idx = [&state](const std::string &path) -> uint32_t {
         auto it = std::lower_bound(state->paths.begin(), state->paths.end(), path);
 
         if (it == state->paths.end() || *it != path) return 0; // hidden key
@@ -254,69 +886,94 @@ void transform_endElement(void *user_data, const xmlChar *name) {
         return std::distance(state->paths.begin(), it) + 1;
     };
 
-    auto append_stream = [] (std::ostringstream &oss, std::ostream &os) {
-        std::string str = oss.str();
-        os.write(str.data(), str.size());
-    };
+    auto set_bp_for_cur_entry = [&] () {
+        bp.clear();
 
-    auto get_bp_for_cur_entry = [&] () -> std::vector<char> {
-        if (state->tmp_data.tellp() == 0) return {};
+        if (state->tmp_data.size() == 0) return;
         assert(is_bp_balenced(state->entry_bp));
         
-        std::vector<char> bp;
+        // pad entry bp with leading zeros to fit in byte array
+        int pad = 8 - (state->entry_bp.size() % 8);
+        int bit = 7 - pad;
+        char b = 0;
+
+        if (pad == 8) {
+            bp.push_back(0);
+            bit = 7;
+        }
 
-        // bp
-        {
-            // pad entry bp to fit in byte array
-            int pad = 8 - (state->entry_bp.size() % 8);
+        for (const auto e : state->entry_bp) {
+            b |= (e << bit);
 
-            if (pad != 0) {
-                state->entry_bp.insert(state->entry_bp.begin(), pad, 0);
+            if (bit-- == 0) {
+                bp.push_back(b);
+                b = 0;
+                bit = 7;
             }
+        }
 
+        state->entry_bp.clear();
+    };
 
-            for (int i = 0; i < state->entry_bp.size();) {
-                char b = 0;
-
-                for (int j = 7; j >= 0 && i < state->entry_bp.size(); --j, ++i) {
-                    b |= (state->entry_bp[i] << j);
-                }
-
-                bp.push_back(b);
-            }
+    // bound of the column bytes the current entry adds: its sizes and text markers
+    auto entry_overhead = [&state] () -> size_t {
+        if (!file_layout.has(FileLayout::column_clusters)) return 0;
 
-            state->entry_bp.clear();
-        }
+        size_t marker_bytes = file_layout.has(FileLayout::varint_elements) ? 1 : sizeof(uint32_t);
 
-        return bp;
+        return 3 * varint_size(state->budget) + state->entry_texts * marker_bytes;
     };
 
-    auto append_tmp_to_data = [&state, &bp, &append_stream] () {
+    auto append_tmp_to_data = [&state, &bp, &entry_overhead] () {
         assert(state->last_node_pop <= 0xFF);
         
         if (bp.size() == 0) return;
 
+        state->data_overhead += entry_overhead();
+        state->entry_texts = 0;
+
         uint8_t last_node_pop = state->last_node_pop;
 
         // set entry position in cluster
-        state->pos[state->entry_id_idx_stack.back()] = (uint16_t)(state->data.tellp());
+        state->pos[state->entry_id_idx_stack.back()] = state->data.size();
+
+        put(state->data, last_node_pop);
+        state->data.insert(state->data.end(), bp.begin(), bp.end());
+        state->data.insert(state->data.end(), state->tmp_data.begin(), state->tmp_data.end());
+
+        state->tmp_data.clear();
+        bp.clear();
+    };
+
+    // entries are clustered at the end of the body, in the order given by the write options
+    auto keep_entry = [&state, &bp, &entry_overhead] () {
+        assert(state->last_node_pop <= 0xFF);
+
+        keptEntry e { state->entry_id_idx_stack.back(), state->kept_rows.size(), 0, entry_overhead(), "" };
+        uint8_t last_node_pop = state->last_node_pop;
+
+        put(state->kept_rows, last_node_pop);
+        state->kept_rows.insert(state->kept_rows.end(), bp.begin(), bp.end());
+        state->kept_rows.insert(state->kept_rows.end(), state->tmp_data.begin(), state->tmp_data.end());
 
-        state->data.write((char*)&last_node_pop, sizeof last_node_pop);
-        state->data.write((char*)bp.data(), bp.size());
-        append_stream(state->tmp_data, state->data);
+        e.size = state->kept_rows.size() - e.start;
+        e.key.swap(state->order_key);
+        state->kept_entries.push_back(std::move(e));
 
-        state->tmp_data = std::ostringstream();
+        state->entry_id_idx_stack.clear();
+        state->tmp_data.clear();
+        state->entry_texts = 0;
         bp.clear();
     };
 
     auto write_cluster = [&]() {
         long last_entry_id_idx = -1;
-        uint16_t cluster_size = 0;
 
-        if (data_size + tmp_data_size == 0) 
+        if (data_size + tmp_data_size == 0 || (data_size == 0 && bp.size() == 0)) 
             return;
 
-        if (data_size + tmp_data_size <= state->cluster_size) {
+        // an entry larger than the budget gets a cluster of its own, no entry is pending at the body end
+        if (data_size + tmp_data_size <= state->budget || state->data.empty() || bp.size() == 0) {
             append_tmp_to_data();
         } else {
             last_entry_id_idx = state->entry_id_idx_stack.back();
@@ -330,77 +987,64 @@ void transform_endElement(void *user_data, const xmlChar *name) {
             state->cluster_offset_idx[e] = state->cluster_offsets.size() - 1;
         }
 
-        state->entry_id_idx_stack.clear();
-
-        assert(state->data.tellp() <= state->cluster_size);
-        assert(state->data.tellp() > 0);
-
-        cluster_size = state->data.tellp();
-        state->os.write((char*)&cluster_size, sizeof cluster_size);
-
-        // compress
-        {
-            int bound = LZ4_compressBound(cluster_size);
-            char *inbuf  = new char[cluster_size];
-            char *outbuf = new char[bound];
-
-            std::stringstream is;
-            
-            append_stream(state->data, is);
-            is.read(inbuf, cluster_size);
-
-            state->data = std::ostringstream();
-
-            int rv = LZ4_compress_HC(inbuf, outbuf, cluster_size, bound, LZ4HC_CLEVEL_MAX);
-
-            if (rv > 0) {
-                state->os.write((char*)&rv, sizeof rv);
-                state->os.write(outbuf, rv);
-            }
-
+        std::vector<uint32_t> cluster_entries;
+        cluster_entries.swap(state->entry_id_idx_stack);
 
-            delete[] inbuf;
-            delete[] outbuf;
-
-            if (rv <= 0) {
-                std::cerr << "Cannot compress cluster" << std::endl;
-            }
-        }
+        assert(state->data.size() + state->data_overhead <= state->budget || cluster_entries.size() == 1);
+        assert(state->data.size() > 0);
 
-        assert(state->data.tellp() == 0);
+        write_entries(*state, state->data, cluster_entries);
+        state->data.clear();
+        state->data_overhead = 0;
         
         if (last_entry_id_idx >= 0) {
 
             state->entry_id_idx_stack.push_back(last_entry_id_idx);
             append_tmp_to_data();
             
-            assert(state->data.tellp() == tmp_data_size);
+            assert((long)(state->data.size() + state->data_overhead) == tmp_data_size);
         }
 
-        assert(state->tmp_data.tellp() == 0);
+        assert(state->tmp_data.size() == 0);
     };
 
+    if (state->skip_entry) {
+        state->skip_entry = (strcmp(str_name, "entry") != 0);
+        return;
+    }
+
     if (state->in_entry) {
         state->entry_bp.push_back(0);
     }
 
-    if (str_name == "body") {
+    if (is_body) {
         state->in_body = false;
-    } else if (str_name != "entry") {
+    } else if (strcmp(str_name, "entry") != 0) {
+        uint32_t ch_id = state->in_entry && state->ch.size() ? ch_symbol_id(state->ch) : UINT32_MAX;
+
+        // not seen by the first pass, the write fails once the pass ends
+        if (state->in_entry && state->ch.size() && ch_id == UINT32_MAX) {
+            state->unknown_text = true;
+            state->ch.clear();
+        }
+
         if (state->in_entry && state->ch.size()) {
-            auto it = ch_trie.make_predictive_iterator(state->ch);
-            it.next();
+            uint32_t text_id = ch_cluster_ids.size() ? ch_cluster_ids[ch_id] : ch_id;
 
-            uint32_t tmp = (uint32_t)((it.id() << 2) | 1U);
-            state->tmp_data.write((char*)&tmp, sizeof tmp);
+            put_element(state->tmp_data, (uint32_t)((text_id << 2) | 1U));
+            ++state->entry_texts;
 
-            uint8_t path_idx = get_path_idx(state->path);
+            uint32_t path_idx = get_path_idx(state->path);
             uint32_t entry_id_idx = state->entry_id_idx_stack.back();
-            uint32_t idx = (entry_id_idx << 8) | path_idx;
+            uint64_t idx = ((uint64_t)entry_id_idx << file_layout.path_bits) | path_idx;
 
             if (state->paths.size() == 0 || path_idx != 0) {
-                state->id_mapping[it.id()].push_back(idx);
-                state->paths_mapping[entry_id_idx].push_back(it.id());
+                state->id_mapping.add(ch_id, idx);
+                state->paths_mapping.add(entry_id_idx, ch_id);
+            }
+
+            if (state->reorder && state->order_key.empty() && state->path == state->order_path) {
+                state->order_key = state->ch;
             }
             
             state->ch.clear();
@@ -409,191 +1053,1797 @@ void transform_endElement(void *user_data, const xmlChar *name) {
         }
 
         // remove last node
-        size_t pos  = state->path.find_last_of("/");
-        state->path = state->path.substr(0, pos);
+        if (state->path_lens.size()) {
+            state->path.resize(state->path_lens.back());
+            state->path_lens.pop_back();
+        }
 
         return;
     }
 
     state->path.clear();
+    state->path_lens.clear();
     state->in_entry = false;
 
-    bp = get_bp_for_cur_entry();
-    data_size = state->data.tellp();
-    tmp_data_size = (size_t)state->tmp_data.tellp() + bp.size() + sizeof (uint8_t);
+    set_bp_for_cur_entry();
+
+    if (state->reorder) {
+        if (bp.size() && (!state->sample_stride || state->entry_cnt % state->sample_stride < state->sample_window)) {
+            keep_entry();
+        } else {
+            state->entry_id_idx_stack.clear();
+            state->tmp_data.clear();
+            state->order_key.clear();
+            state->entry_texts = 0;
+            bp.clear();
+        }
+
+        report_progress(state, is_body);
+        return;
+    }
+
+    data_size = state->data.size() + state->data_overhead;
+    tmp_data_size = state->tmp_data.size() + bp.size() + sizeof (uint8_t) + entry_overhead();
 
-    if (data_size + tmp_data_size >= state->cluster_size) {
+    if (data_size + tmp_data_size >= state->budget) {
         write_cluster();
     }
 
     // write last cluster if not full
-    if (str_name == "body") {
-        data_size = state->data.tellp();
-        tmp_data_size = (size_t)state->tmp_data.tellp() + bp.size() + sizeof (uint8_t);
+    if (is_body) {
+        data_size = state->data.size() + state->data_overhead;
+        tmp_data_size = state->tmp_data.size() + bp.size() + sizeof (uint8_t) + entry_overhead();
 
         write_cluster();
     } else if (bp.size()) {
         append_tmp_to_data();
     }
 
-    print_progress(state, str_name == "body");
+    report_progress(state, is_body);
 }
 
-std::unique_ptr<parseState> parse_input(const std::string &src) {
-    std::unique_ptr<parseState> state{ new parseState() };
-    xmlSAXHandler handler = { .startElement = parse_startElement, .endElement = parse_endElement, .characters = parse_characters };
+// Byte ranges of a TEI file splitting its body on entry boundaries
+struct teiShards {
+    std::string         head;   // up to the first entry
+    std::string         tail;   // from </body>
+    std::vector<size_t> bounds; // shard i is [bounds[i], bounds[i+1])
+};
 
-    if (xmlSAXUserParseFile(&handler, state.get(), src.c_str()) < 0) {
-        return nullptr;
+size_t rfind_in_file(std::istream &is, const std::string &needle, size_t size) {
+    const size_t chunk = 1 << 20;
+    std::string buf;
+
+    for (size_t end = size; end > 0; ) {
+        size_t start = end > chunk ? end - chunk : 0;
+        size_t len = std::min(end + needle.size() - 1, size) - start;
+
+        buf.resize(len);
+        is.clear();
+        is.seekg(start, is.beg);
+        is.read(buf.data(), len);
+
+        size_t pos = buf.rfind(needle);
+
+        if (pos != std::string::npos) return start + pos;
+
+        end = start;
+    }
+
+    return std::string::npos;
+}
+
+/**
+ * Forward scan of a TEI file for tags, through a window of the file.
+ * 
+ * Comments, CDATA sections and processing instructions are skipped, so the scan must start outside of them.
+ * Attribute values and texts cannot hold a raw '<'.
+ */
+class tagScanner {
+public:
+    tagScanner(std::istream &is, size_t size) : m_is(is), m_size(size) {}
+
+    // first tag named name starting in [min, to), scanning from pos, skips tags sharing the prefix such as <entryFree>
+    size_t find(const std::string &name, size_t pos, size_t to, size_t min = 0) {
+        while ((pos = find_text("<", pos, to)) != std::string::npos) {
+            size_t next = pos + 1;
+
+            if (starts_with(pos, "<!--")) {
+                next = skip_to("-->", pos + 4);
+            } else if (starts_with(pos, "<![CDATA[")) {
+                next = skip_to("]]>", pos + 9);
+            } else if (starts_with(pos, "<?")) {
+                next = skip_to("?>", pos + 2);
+            } else if (pos >= min && starts_with(pos + 1, name.c_str())) {
+                unsigned char c = at(pos + 1 + name.size());
+
+                if (std::isspace(c) || c == '>' || c == '/') return pos;
+            }
+
+            if (next == std::string::npos) return next;
+
+            pos = next;
+        }
+
+        return std::string::npos;
+    }
+
+private:
+    static constexpr size_t chunk   = 1 << 20;
+    static constexpr size_t overlap = 16;      // longer than the delimiters matched across the window end
+
+    std::istream &m_is;
+    size_t        m_size;
+    size_t        m_start = 0;
+    std::string   m_buf;
+
+    void load(size_t pos) {
+        m_start = pos;
+        m_buf.resize(std::min(chunk + overlap, m_size - pos));
+        m_is.clear();
+        m_is.seekg(pos, m_is.beg);
+        m_is.read(m_buf.data(), m_buf.size());
+    }
+
+    // 0 past the end of the file
+    char at(size_t pos) {
+        if (pos >= m_size) return 0;
+        if (pos < m_start || pos >= m_start + m_buf.size()) load(pos);
+
+        return m_buf[pos - m_start];
+    }
+
+    bool starts_with(size_t pos, const char *s) {
+        for (; *s; ++s, ++pos) {
+            if (at(pos) != *s) return false;
+        }
+
+        return true;
+    }
+
+    // first match starting in [pos, to)
+    size_t find_text(const char *text, size_t pos, size_t to) {
+        to = std::min(to, m_size);
+
+        while (pos < to) {
+            if (pos < m_start || (pos + overlap > m_start + m_buf.size() && m_start + m_buf.size() < m_size)) load(pos);
+
+            size_t found = std::string_view(m_buf).find(text, pos - m_start);
+
+            if (found != std::string::npos) {
+                return m_start + found < to ? m_start + found : std::string::npos;
+            }
+
+            pos = m_start + m_buf.size() - std::min(m_buf.size(), overlap);
+            if (m_start + m_buf.size() >= m_size) break;
+        }
+
+        return std::string::npos;
+    }
+
+    // past the end of text, npos when it is missing
+    size_t skip_to(const char *text, size_t pos) {
+        size_t found = find_text(text, pos, m_size);
+
+        return found != std::string::npos ? found + strlen(text) : found;
+    }
+};
+
+std::unique_ptr<teiShards> split_input(const std::string &src, unsigned shard_cnt) {
+    std::ifstream is(src, std::ios::binary | std::ios::ate);
+    std::unique_ptr<teiShards> shards{ new teiShards() };
+
+    if (!is) return nullptr;
+
+    size_t size  = is.tellg();
+    tagScanner scanner(is, size);
+    size_t body  = scanner.find("body", 0, size);
+    size_t first = body != std::string::npos ? scanner.find("entry", body, size) : body;
+    size_t last  = rfind_in_file(is, "</body>", size);
+
+    if (first == std::string::npos || last == std::string::npos || last < first) return nullptr;
+
+    shards->head.resize(first);
+    shards->tail.resize(size - last);
+
+    is.clear();
+    is.seekg(0, is.beg);
+    is.read(shards->head.data(), first);
+    is.seekg(last, is.beg);
+    is.read(shards->tail.data(), size - last);
+
+    shards->bounds.push_back(first);
+
+    // each scan resumes at the previous bound, a midpoint may fall inside a comment
+    for (unsigned i = 1; i < shard_cnt; ++i) {
+        size_t pos = scanner.find("entry", shards->bounds.back(), last, first + (last - first) / shard_cnt * i);
+
+        if (pos == std::string::npos) break;
+        if (pos == shards->bounds.back()) continue;
+
+        shards->bounds.push_back(pos);
+    }
+
+    shards->bounds.push_back(last);
+
+    return shards;
+}
+
+// Parses head + [bounds[idx], bounds[idx+1]) + tail
+int parse_shard(xmlSAXHandler *handler, void *user_data, const std::string &src, const teiShards &shards, size_t idx) {
+    std::ifstream is(src, std::ios::binary);
+    std::vector<char> buf(1 << 20);
+    size_t begin = shards.bounds[idx];
+    size_t end   = shards.bounds[idx + 1];
+
+    xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(handler, user_data, NULL, 0, src.c_str());
+
+    if (ctxt == NULL || !is) return -1;
+
+    int rv = xmlParseChunk(ctxt, shards.head.data(), shards.head.size(), 0);
+
+    is.seekg(begin, is.beg);
+
+    while (rv == 0 && begin < end) {
+        size_t len = std::min(buf.size(), end - begin);
+
+        is.read(buf.data(), len);
+        rv = xmlParseChunk(ctxt, buf.data(), len, 0);
+        begin += len;
+    }
+
+    if (rv == 0) {
+        rv = xmlParseChunk(ctxt, shards.tail.data(), shards.tail.size(), 1);
+    }
+
+    bool well_formed = ctxt->wellFormed;
+    xmlFreeParserCtxt(ctxt);
+
+    return (rv == 0 && well_formed) ? 0 : -1;
+}
+
+// Runs a SAX pass over the input
+using saxParser = std::function<int(xmlSAXHandler *handler, void *user_data)>;
+
+saxParser file_parser(const std::string &src) {
+    return [src](xmlSAXHandler *handler, void *user_data) {
+        return xmlSAXUserParseFile(handler, user_data, src.c_str());
+    };
+}
+
+// Feeds the chunks pulled from read to a push parser
+int parse_chunks(xmlSAXHandler *handler, void *user_data, const CTQ::ReadCallback &read) {
+    std::vector<char> buf(1 << 20);
+    long len = 0;
+
+    xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(handler, user_data, NULL, 0, NULL);
+
+    if (ctxt == NULL) return -1;
+
+    int rv = 0;
+
+    while (rv == 0 && (len = read(buf.data(), buf.size())) > 0) {
+        rv = xmlParseChunk(ctxt, buf.data(), len, 0);
+    }
+
+    if (rv == 0 && len == 0) {
+        rv = xmlParseChunk(ctxt, NULL, 0, 1);
+    }
+
+    bool well_formed = ctxt->wellFormed;
+    xmlFreeParserCtxt(ctxt);
+
+    return (rv == 0 && len == 0 && well_formed) ? 0 : -1;
+}
+
+/**
+ * Keeps a non seekable input LZ4 compressed between the two passes.
+ * 
+ * Past limit compressed bytes in memory, the following chunks are spooled to a temporary file.
+ */
+struct inputSpool {
+    std::vector<std::vector<char>> chunks;
+    std::vector<int>               sizes;
+    size_t                         bytes = 0;    // of chunks
+    size_t                         limit = 0;    // 0 keeps every chunk in memory
+    std::string                    temp_dir;
+    std::string                    path;         // of the spooled chunks, empty until spilled
+    std::fstream                   file;
+    std::vector<char>              compressed;
+
+    ~inputSpool() {
+        if (path.size()) {
+            file.close();
+            std::remove(path.c_str());
+        }
+    }
+
+    // compressed size then raw size of each spooled chunk, before its bytes
+    bool spill(const char *data, int compressed_size, int raw_size) {
+        if (path.empty()) {
+            path = temp_path(temp_dir, ".spool");
+            file.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
+            if (!file) {
+                std::cerr << "Cannot write " << path << std::endl;
+                return false;
+            }
+        }
+
+        file.write((const char *)&compressed_size, sizeof compressed_size);
+        file.write((const char *)&raw_size, sizeof raw_size);
+        file.write(data, compressed_size);
+
+        return (bool)file;
+    }
+
+    // reads from read and keeps what was read
+    CTQ::ReadCallback record(const CTQ::ReadCallback &read) {
+        return [this, &read](char *buf, size_t size) -> long {
+            long len = read(buf, size);
+
+            if (len > 0) {
+                compressed.resize(LZ4_compressBound(len));
+
+                int compressed_size = LZ4_compress_default(buf, compressed.data(), len, compressed.size());
+
+                if (path.size() || (limit && bytes + compressed_size > limit)) {
+                    return spill(compressed.data(), compressed_size, len) ? len : -1;
+                }
+
+                chunks.emplace_back(compressed.begin(), compressed.begin() + compressed_size);
+                sizes.push_back(len);
+                bytes += compressed_size;
+            }
+
+            return len;
+        };
+    }
+
+    // chunks in memory, then the spooled ones
+    CTQ::ReadCallback replay() {
+        if (path.size()) {
+            file.flush();
+            file.seekg(0);
+        }
+
+        return [this, i = (size_t)0](char *buf, size_t size) mutable -> long {
+            int compressed_size, raw_size;
+
+            if (i < chunks.size()) {
+                int rv = LZ4_decompress_safe(chunks[i].data(), buf, chunks[i].size(), size);
+
+                return rv == sizes[i++] ? rv : -1;
+            }
+
+            if (path.empty() || !file.read((char *)&compressed_size, sizeof compressed_size)) {
+                return path.size() && !file.eof() ? -1 : 0;
+            }
+
+            file.read((char *)&raw_size, sizeof raw_size);
+            compressed.resize(compressed_size);
+
+            if (!file.read(compressed.data(), compressed_size)) {
+                return -1;
+            }
+
+            int rv = LZ4_decompress_safe(compressed.data(), buf, compressed_size, size);
+
+            return rv == raw_size ? rv : -1;
+        };
+    }
+};
+
+// Frees the texts of the input once the transform pass no longer looks them up
+void clear_ch_symbols() {
+    ch_symbols    = InternTable();
+    ch_symbol_ids = std::vector<uint32_t>();
+}
+
+// Clears ch_symbols when a write returns, whatever its outcome
+struct chSymbolsGuard {
+    ~chSymbolsGuard() { clear_ch_symbols(); }
+};
+
+// Takes the texts of the input, their ch_trie ids are found by a single walk of the trie
+void set_ch_symbols(InternTable &&symbols) {
+    ch_symbols = std::move(symbols);
+    ch_symbol_ids.assign(ch_symbols.size(), UINT32_MAX);
+
+    ch_trie.visit([](const auto &trie) {
+        auto it = trie.make_predictive_iterator("");
+
+        while (it.next()) {
+            uint32_t symbol = ch_symbols.find(it.decoded_view());
+
+            if (symbol != InternTable::npos) {
+                ch_symbol_ids[symbol] = it.id();
+            }
+        }
+    });
+}
+
+bool build_alphabets(parseState &state, unsigned trie_variant) {
+    if (!is_trie_variant(trie_variant)) {
+        std::cerr << "Unsupported trie variant" << std::endl;
+        return false;
     }
 
     try {
-        xml_alphabet = std::vector<std::string>(state->xml_alpha.begin(), state->xml_alpha.end());
-        std::sort(xml_alphabet.begin(), xml_alphabet.end());
+        set_xml_alphabet(state.xml_alpha.sorted());
 
-        std::vector<std::string> tmp(state->ch_alpha.begin(), state->ch_alpha.end());
-        std::sort(tmp.begin(), tmp.end());
-        ch_trie = trie_type(tmp);
+        ch_trie = AnyTrie(state.ch_alpha.sorted(), trie_variant);
+        set_ch_symbols(std::move(state.ch_alpha));
+
+        ch_trie_ids.clear();
+        ch_cluster_ids.clear();
     } catch (const xcdat::exception& ex) {
         std::cerr << ex.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+std::unique_ptr<parseState> parse_input(const saxParser &parse, const CTQ::WriteOptions &options, bool delta = false) {
+    std::unique_ptr<parseState> state{ new parseState() };
+    xmlSAXHandler handler = { .startElement = parse_startElement, .endElement = parse_endElement, .characters = parse_characters };
+    auto start = write_clock::now();
+
+    state->delta = delta;
+    set_progress(*state, "parse", options);
+
+    if (parse(&handler, state.get()) < 0) {
+        return nullptr;
+    }
+
+    if (options.stats) {
+        options.stats->parse_time = seconds_since(start);
+        options.stats->ch_alpha_bytes = state->ch_alpha.bytes();
+    }
+
+    // a delta is merged into the alphabets of the file it updates
+    if (delta) {
+        return state;
+    }
+
+    start = write_clock::now();
+
+    if (!build_alphabets(*state, options.trie_variant)) {
         return nullptr;
     }
 
+    if (options.stats) {
+        options.stats->alphabet_time = seconds_since(start);
+    }
 
     return state;
 }
 
-int transform_input(const std::string &src, std::ostream &os, const parseState &parse_state, const std::vector<std::string> &paths, uint32_t cluster_size) {
-    const long start_pos = os.tellp();
-    size_t header_bytes = 0;
-    uint32_t cluster_offsets_pos = 0;
+/**
+ * @param shard_ids Sorted ids of each shard
+ */
+std::unique_ptr<parseState> parse_input(const std::string &src, const teiShards &shards, std::vector<std::vector<uint64_t>> &shard_ids, const CTQ::WriteOptions &options) {
+    std::vector<std::unique_ptr<parseState>> states;
+    std::vector<std::future<int>> rvs;
+    xmlSAXHandler handler = { .startElement = parse_startElement, .endElement = parse_endElement, .characters = parse_characters };
+    auto start = write_clock::now();
 
+    for (size_t i = 0; i + 1 < shards.bounds.size(); ++i) {
+        states.emplace_back(new parseState());
 
-    transformState state = transformState(parse_state.ids, paths, os, cluster_size);
-    xmlSAXHandler handler = { .startElement = transform_startElement, .endElement = transform_endElement, .characters = transform_characters };
+        rvs.push_back(std::async(std::launch::async, parse_shard, &handler, states.back().get(), std::cref(src), std::cref(shards), i));
+    }
 
-    // get room for header
-    {
-        uint32_t cnt = state.ids.size();
+    std::unique_ptr<parseState> state{ new parseState() };
 
-        header_bytes += sizeof cnt;
-        header_bytes += cnt * sizeof state.ids[0]; // ids
-        header_bytes += cnt * sizeof state.pos[0]; // pos
-        header_bytes += cnt * sizeof state.cluster_offset_idx[0]; // cluster offset idx
-        header_bytes += sizeof(uint32_t); // footer start
+    for (size_t i = 0; i < states.size(); ++i) {
+        if (rvs[i].get() < 0) {
+            return nullptr;
+        }
+
+        state->ids.insert(state->ids.end(), states[i]->ids.begin(), states[i]->ids.end());
+        state->xml_alpha.merge(states[i]->xml_alpha);
+        state->ch_alpha.merge(states[i]->ch_alpha);
 
-        std::vector<char> buf(header_bytes, 0);
-        os.write(buf.data(), buf.size());
+        shard_ids.push_back(std::move(states[i]->ids));
+        states[i].reset();
     }
 
-    if (xmlSAXUserParseFile(&handler, &state, src.c_str()) < 0) {
-        return -1;
+    std::sort(state->ids.begin(), state->ids.end());
+
+    if (options.progress) {
+        options.progress("parse", state->ids.size(), true);
     }
-        
+
+    if (options.stats) {
+        options.stats->parse_time = seconds_since(start);
+        options.stats->ch_alpha_bytes = state->ch_alpha.bytes();
+    }
+
+    start = write_clock::now();
+
+    if (!build_alphabets(*state, options.trie_variant)) {
+        return nullptr;
+    }
+
+    if (options.stats) {
+        options.stats->alphabet_time = seconds_since(start);
+    }
+
+    return state;
+}
+
+size_t reserve_header(std::ostream &os, size_t cnt) {
+    size_t header_bytes = 0;
+
+    header_bytes += file_layout.count_bytes();
+    header_bytes += cnt * file_layout.id_bytes;
+    header_bytes += cnt * file_layout.pos_bytes;
+    header_bytes += cnt * file_layout.cluster_idx_bytes;
+    header_bytes += file_layout.count_bytes(); // footer start
+
+    std::vector<char> buf(header_bytes, 0);
+    os.write(buf.data(), buf.size());
+
+    return header_bytes;
+}
+
+/**
+ * Writes the header at start_pos and the footer at the current position.
+ * The layout is rewritten once the width of the cluster offsets is known.
+ * 
+ * @return int -1 when the offsets do not fit the legacy layout
+ */
+int save_index(std::ostream &os, long start_pos, size_t header_bytes, const std::vector<uint64_t> &ids, const std::vector<uint32_t> &pos, const std::vector<uint32_t> &cluster_offset_idx, 
+                postingRuns &id_mapping, postingRuns &paths_mapping, const std::vector<uint64_t> &cluster_offsets, CTQ::WriteStats *stats) {
+    auto start = write_clock::now();
     long cur_pos = os.tellp();
+
+    if ((uint64_t)cur_pos > UINT32_MAX) {
+        if (!file_layout.v2) {
+            std::cerr << "File too large for the legacy format" << std::endl;
+            return -1;
+        }
+
+        file_layout.offset_bytes = 8;
+    }
+
+    if (file_layout.v2) {
+        os.seekp(layout_pos, os.beg);
+        file_layout.save(os);
+    }
+
+    if (stats) {
+        stats->id_mapping_bytes    = id_mapping.peak_bytes();
+        stats->paths_mapping_bytes = paths_mapping.peak_bytes();
+        stats->posting_runs        = id_mapping.run_cnt() + paths_mapping.run_cnt();
+    }
+
     assert(cur_pos != start_pos);
 
     os.seekp(start_pos, os.beg);
 
     // write header
     {
-        uint32_t cnt = state.ids.size();
-        uint32_t footer_start = cur_pos;
+        uint64_t cnt = ids.size();
+        uint64_t footer_start = cur_pos;
 
-        assert(cnt == state.pos.size());
+        assert(cnt == pos.size());
 
-        os.write((char*)&cnt, sizeof cnt);
-        os.write((char*)state.ids.data(), cnt * sizeof state.ids[0]); // TODO: compress (delta + elias fano)
-        os.write((char*)state.pos.data(), cnt * sizeof state.pos[0]); // TODO: compress
-        os.write((char*)state.cluster_offset_idx.data(), cnt * sizeof state.cluster_offset_idx[0]); // TODO: compress
-        os.write((char*)&footer_start, sizeof footer_start);
+        write_uint(os, cnt, file_layout.count_bytes());
+        write_uints(os, ids.data(), cnt, file_layout.id_bytes); // TODO: compress (delta + elias fano)
+        write_uints(os, pos.data(), cnt, file_layout.pos_bytes); // TODO: compress
+        write_uints(os, cluster_offset_idx.data(), cnt, file_layout.cluster_idx_bytes); // TODO: compress
+        write_uint(os, footer_start, file_layout.count_bytes());
     }
 
     assert(static_cast<long>(os.tellp()) - start_pos == header_bytes);
 
     os.seekp(cur_pos, os.beg);
 
-    Contiguous2dArray<uint32_t> cvec(state.id_mapping, true);
-    cvec.save(os);
+    const unsigned count_bytes = file_layout.count_bytes();
+    int rv = file_layout.posting_bytes == 8 ? id_mapping.save<uint64_t>(os, ch_trie.num_keys(), count_bytes) : id_mapping.save<uint32_t>(os, ch_trie.num_keys(), count_bytes);
 
-    Contiguous2dArray<uint32_t> paths_mapping(state.paths_mapping, true);
-    paths_mapping.save(os);
+    if (rv < 0 || paths_mapping.save<uint32_t>(os, ids.size(), count_bytes) < 0) {
+        std::cerr << "Cannot merge the postings" << std::endl;
+        return -1;
+    }
 
     // cluster offsets
     {
-        uint32_t cluster_cnt = state.cluster_offsets.size();
-        uint32_t bytes = cluster_cnt * sizeof state.cluster_offsets[0];
+        uint64_t cluster_cnt = cluster_offsets.size();
 
-        os.write((char*)&cluster_cnt, sizeof cluster_cnt);
-        os.write((char*)state.cluster_offsets.data(), bytes);
+        write_uint(os, cluster_cnt, file_layout.count_bytes());
+        write_uints(os, cluster_offsets.data(), cluster_cnt, file_layout.offset_bytes);
     }
 
-    return 0;
-}
+    // cluster text ids
+    {
+        uint32_t cnt = ch_trie_ids.size();
 
-int save_alphabets(std::ostream &os) {
-    long start_pos = os.tellp(); 
-    uint16_t xalpha_sz = 0;
-    uint64_t ch_trie_bytes = 0;
+        os.write((char*)&cnt, sizeof cnt);
+        os.write((char*)ch_trie_ids.data(), cnt * sizeof ch_trie_ids[0]);
+    }
 
-    os.write((char*)&xalpha_sz, sizeof xalpha_sz);
+    // texts by ch_trie id
+    if (file_layout.has(FileLayout::string_pool)) {
+        Contiguous2dArray<char> pool;
+        std::string key;
 
-    for (const auto e : xml_alphabet) {
-        os.write(e.c_str(), e.size() + 1);
-        xalpha_sz += e.size() + 1;
+        for (size_t i = 0; i < ch_trie.num_keys(); ++i) {
+            ch_trie.decode(i, key);
+            pool.push_row(key.data(), key.size());
+        }
+
+        long pool_start = os.tellp();
+        pool.save(os, count_bytes);
+
+        if (stats) {
+            stats->string_pool_bytes = static_cast<long>(os.tellp()) - pool_start;
+        }
     }
-    
-    os.seekp(start_pos, os.beg);
-    os.write((char*)&xalpha_sz, sizeof xalpha_sz);
 
-    os.seekp(xalpha_sz, os.cur);
+    // trie of the folded keys, each folded key -> ch_trie ids of the keys folding to it
+    if (file_layout.fold_rules()) {
+        std::vector<std::pair<std::string, uint32_t>> folded(ch_trie.num_keys());
+        std::vector<std::string> fold_keys;
+        std::vector<std::pair<uint32_t, uint32_t>> fold_ids;
+        std::string key;
+        AnyTrie fold_trie;
+
+        for (uint32_t i = 0; i < folded.size(); ++i) {
+            ch_trie.decode(i, key);
+            folded[i] = { fold_key(key, file_layout.fold_rules()), i };
+        }
 
+        std::sort(folded.begin(), folded.end());
 
-    try {
-        xcdat::save(ch_trie, os);
-    } catch (const xcdat::exception& ex) {
-        std::cerr << ex.what() << std::endl;
-        return 1;
+        for (const auto &e : folded) {
+            if (fold_keys.empty() || fold_keys.back() != e.first) {
+                fold_keys.push_back(e.first);
+            }
+        }
+
+        try {
+            fold_trie = AnyTrie(fold_keys, ch_trie.bits());
+        } catch (const xcdat::exception& ex) {
+            std::cerr << ex.what() << std::endl;
+            return -1;
+        }
+
+        // trie ids do not follow the key order
+        for (const auto &e : folded) {
+            fold_ids.emplace_back(fold_trie.lookup(e.first).value(), e.second);
+        }
+
+        std::sort(fold_ids.begin(), fold_ids.end());
+
+        long fold_start = os.tellp();
+
+        fold_trie.save(os);
+        Contiguous2dArray<uint32_t>(fold_ids, fold_keys.size()).save(os, count_bytes);
+
+        if (stats) {
+            stats->fold_trie_bytes = static_cast<long>(os.tellp()) - fold_start;
+        }
+    }
+
+    if (stats) {
+        stats->footer_time = seconds_since(start);
     }
 
     return 0;
 }
 
-namespace CTQ {
+// Transform pass figures, raw_sizes and compressed_sizes are those of all the clusters
+void save_transform_stats(CTQ::WriteStats *stats, double transform_time, double compression_time, const std::vector<uint32_t> &raw_sizes, const std::vector<uint32_t> &compressed_sizes) {
+    if (!stats) return;
 
-int write(const std::string &src, const std::string &dst, const std::vector<std::string> &paths, uint16_t cluster_size) {
-    std::ofstream output;
+    stats->transform_time          = transform_time;
+    stats->compression_time        = compression_time;
+    stats->cluster_raw_size        = size_distribution(raw_sizes);
+    stats->cluster_compressed_size = size_distribution(compressed_sizes);
+}
 
-    std::unique_ptr<parseState> parse_state = parse_input(src);
+inline bool is_ordered(const CTQ::WriteOptions &options) {
+    return options.order_path.size() || options.entry_order.size();
+}
 
-    if (parse_state == nullptr) {
-        return -1;
-    } 
+/**
+ * Clusters the kept entries of state, by first text at options.order_path or in the options.entry_order of their ids.
+ * Entries without such text or id follow in document order.
+ */
+void pack_entries(transformState &state, const CTQ::WriteOptions &options) {
+    const auto &kept = state.kept_entries;
+    std::vector<uint32_t> order(kept.size());
+    std::vector<char> data;
+    std::vector<uint32_t> entries;
+    size_t overhead = 0;
+
+    std::iota(order.begin(), order.end(), 0);
+
+    if (options.entry_order.size()) {
+        std::vector<std::pair<uint64_t, size_t>> ranks; // (id, rank)
+        std::vector<size_t> entry_ranks(kept.size(), SIZE_MAX);
+
+        for (size_t i = 0; i < options.entry_order.size(); ++i) {
+            ranks.emplace_back(options.entry_order[i], i);
+        }
 
-    output = std::ofstream(dst, std::ios::binary);
-    
-    if (!output) {
-        std::cout << "bad" << std::endl;
-        return -1;
-    }
+        std::sort(ranks.begin(), ranks.end());
 
-    // version
-    {
-        uint32_t major = CTQ_WRITER_VERSION_MAJOR;
-        uint32_t minor = CTQ_WRITER_VERSION_MINOR;
-        uint32_t patch = CTQ_WRITER_VERSION_PATCH;
+        for (size_t i = 0; i < kept.size(); ++i) {
+            auto it = std::lower_bound(ranks.begin(), ranks.end(), std::make_pair(state.ids[kept[i].idx], (size_t)0));
+
+            if (it != ranks.end() && it->first == state.ids[kept[i].idx]) {
+                entry_ranks[i] = it->second;
+            }
+        }
 
-        output.write((char*)&major, sizeof major);
-        output.write((char*)&minor, sizeof minor);
-        output.write((char*)&patch, sizeof patch);
+        std::stable_sort(order.begin(), order.end(), [&entry_ranks](uint32_t a, uint32_t b) { return entry_ranks[a] < entry_ranks[b]; });
+    } else {
+        std::stable_sort(order.begin(), order.end(), [&kept](uint32_t a, uint32_t b) {
+            return std::make_pair(kept[a].key.empty(), std::string_view(kept[a].key)) < std::make_pair(kept[b].key.empty(), std::string_view(kept[b].key));
+        });
     }
 
-    save_alphabets(output);
-    transform_input(src, output, *parse_state, paths, cluster_size);
+    auto flush = [&]() {
+        if (entries.empty()) return;
+
+        state.cluster_offsets.push_back(state.os.tellp());
+
+        for (const auto e : entries) {
+            state.cluster_offset_idx[e] = state.cluster_offsets.size() - 1;
+        }
+
+        write_entries(state, data, entries);
+        data.clear();
+        entries.clear();
+        overhead = 0;
+    };
+
+    for (const auto k : order) {
+        const keptEntry &e = kept[k];
+
+        if (entries.size() && data.size() + overhead + e.size + e.overhead > state.budget) {
+            flush();
+        }
+
+        state.pos[e.idx] = data.size();
+        data.insert(data.end(), state.kept_rows.begin() + e.start, state.kept_rows.begin() + e.start + e.size);
+        entries.push_back(e.idx);
+        overhead += e.overhead;
+    }
+
+    flush();
+}
+
+// The budget is shared by the shards, then by the postings of keys and of entries
+void set_posting_budget(postingRuns &id_mapping, postingRuns &paths_mapping, const CTQ::WriteOptions &options, size_t shard_cnt) {
+    size_t bytes = options.memory_budget / shard_cnt / 2;
+
+    if (options.memory_budget) {
+        id_mapping.set_budget(std::max<size_t>(bytes, 1), options.temp_dir, options.merge_fan_in);
+        paths_mapping.set_budget(std::max<size_t>(bytes, 1), options.temp_dir, options.merge_fan_in);
+    }
+}
+
+/**
+ * @param prepare Called once the header room is reserved, before src is transformed. 
+ *                Lets the caller emit clusters and postings of its own.
+ */
+int transform_input(const saxParser &parse, std::ostream &os, const std::vector<uint64_t> &ids, const CTQ::WriteOptions &options, bool delta = false, const std::function<void(transformState&)> &prepare = nullptr) {
+    const long start_pos = os.tellp();
+    std::vector<uint32_t> pos(ids.size());
+    std::vector<uint32_t> cluster_offset_idx(ids.size());
+    auto start = write_clock::now();
+
+    transformState state = transformState(ids, options.paths, pos, cluster_offset_idx, os, options.cluster_size);
+    xmlSAXHandler handler = { .startElement = transform_startElement, .endElement = transform_endElement, .characters = transform_characters };
+
+    state.delta      = delta;
+    state.reorder    = !delta && is_ordered(options);
+    state.order_path = options.order_path;
+    set_progress(state, "transform", options);
+    set_posting_budget(state.id_mapping, state.paths_mapping, options, 1);
+
+    // get room for header
+    size_t header_bytes = reserve_header(os, ids.size());
+
+    if (prepare) {
+        prepare(state);
+    }
+
+    if (parse(&handler, &state) < 0) {
+        return -1;
+    }
+
+    clear_ch_symbols();
+
+    if (state.unknown_text) {
+        std::cerr << "Text missing from the first pass" << std::endl;
+        return -1;
+    }
+
+    if (state.reorder) {
+        pack_entries(state, options);
+    }
+
+    if (state.cluster_overflow) {
+        std::cerr << "Entry too large for the cluster size field" << std::endl;
+        return -1;
+    }
+
+    save_transform_stats(options.stats, seconds_since(start), state.compression_time, state.raw_sizes, state.compressed_sizes);
+    return save_index(os, start_pos, header_bytes, ids, pos, cluster_offset_idx, state.id_mapping, state.paths_mapping, state.cluster_offsets, options.stats);
+}
+
+/**
+ * Shards are transformed in parallel into their own buffer, then appended in order.
+ * 
+ * @param shard_ids Sorted ids of each shard
+ */
+int transform_input(const std::string &src, std::ostream &os, const std::vector<uint64_t> &ids, const CTQ::WriteOptions &options, const teiShards &shards, const std::vector<std::vector<uint64_t>> &shard_ids) {
+    const long start_pos = os.tellp();
+    std::vector<uint32_t> pos(ids.size());
+    std::vector<uint32_t> cluster_offset_idx(ids.size());
+    std::vector<uint64_t> cluster_offsets;
+    postingRuns id_mapping;
+    postingRuns paths_mapping;
+    auto start = write_clock::now();
+    double compression_time = 0;
+    std::vector<uint32_t> raw_sizes;
+    std::vector<uint32_t> compressed_sizes;
+
+    std::vector<std::unique_ptr<std::iostream>> outputs; // in temporary files with a memory budget
+    std::vector<std::string> output_paths;
+    std::vector<std::unique_ptr<transformState>> states;
+    std::vector<std::future<int>> rvs;
+    xmlSAXHandler handler = { .startElement = transform_startElement, .endElement = transform_endElement, .characters = transform_characters };
+
+    size_t header_bytes = reserve_header(os, ids.size());
+
+    // shards spill before their postings are appended, these only merge runs once all are done
+    set_posting_budget(id_mapping, paths_mapping, options, 1);
+
+    for (size_t i = 0; i < shard_ids.size(); ++i) {
+        if (options.memory_budget) {
+            output_paths.push_back(temp_path(options.temp_dir, ".shard"));
+            outputs.emplace_back(new std::fstream(output_paths.back(), std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary));
+
+            if (!*outputs.back()) {
+                std::cerr << "Cannot write " << output_paths.back() << std::endl;
+                break;
+            }
+        } else {
+            outputs.emplace_back(new std::stringstream());
+        }
+
+        states.emplace_back(new transformState(ids, options.paths, pos, cluster_offset_idx, *outputs.back(), options.cluster_size));
+        set_posting_budget(states.back()->id_mapping, states.back()->paths_mapping, options, shard_ids.size());
+
+        rvs.push_back(std::async(std::launch::async, parse_shard, &handler, states.back().get(), std::cref(src), std::cref(shards), i));
+    }
+
+    for (size_t i = 0; i < shard_ids.size(); ++i) {
+        bool failed = i >= states.size() || rvs[i].get() < 0;
+
+        if (!failed && states[i]->unknown_text) {
+            std::cerr << "Text missing from the first pass" << std::endl;
+            failed = true;
+        }
+
+        if (!failed && states[i]->cluster_overflow) {
+            std::cerr << "Entry too large for the cluster size field" << std::endl;
+            failed = true;
+        }
+
+        if (failed) {
+            for (const auto &e : output_paths) {
+                std::remove(e.c_str());
+            }
+
+            return -1;
+        }
+
+        transformState &state = *states[i];
+        uint64_t base = os.tellp();
+
+        uint32_t cluster_base = cluster_offsets.size();
+
+        for (const auto e : state.cluster_offsets) {
+            cluster_offsets.push_back(base + e);
+        }
+
+        for (const auto e : shard_ids[i]) {
+            cluster_offset_idx[std::distance(ids.begin(), std::lower_bound(ids.begin(), ids.end(), e))] += cluster_base;
+        }
+
+        id_mapping.append(state.id_mapping);
+        paths_mapping.append(state.paths_mapping);
+
+        compression_time += state.compression_time;
+        raw_sizes.insert(raw_sizes.end(), state.raw_sizes.begin(), state.raw_sizes.end());
+        compressed_sizes.insert(compressed_sizes.end(), state.compressed_sizes.begin(), state.compressed_sizes.end());
+
+        if (outputs[i]->tellp() > 0) {
+            outputs[i]->seekg(0, std::ios::beg);
+            os << outputs[i]->rdbuf();
+        }
+
+        states[i].reset();
+        outputs[i].reset();
+    }
+
+    for (const auto &e : output_paths) {
+        std::remove(e.c_str());
+    }
+
+    clear_ch_symbols();
+
+    if (options.progress) {
+        options.progress("transform", ids.size(), true);
+    }
+
+    save_transform_stats(options.stats, seconds_since(start), compression_time, raw_sizes, compressed_sizes);
+    return save_index(os, start_pos, header_bytes, ids, pos, cluster_offset_idx, id_mapping, paths_mapping, cluster_offsets, options.stats);
+}
+
+int save_alphabets(std::ostream &os) {
+    unsigned size_bytes = file_layout.v2 ? 4 : 2;
+    uint64_t xalpha_sz = 0;
+
+    for (const auto &e : xml_alphabet) {
+        xalpha_sz += e.size() + 1;
+    }
+
+    if (xalpha_sz >> (8 * size_bytes)) {
+        std::cerr << "Xml alphabet too large" << std::endl;
+        return 1;
+    }
+
+    write_uint(os, xalpha_sz, size_bytes);
+
+    for (const auto &e : xml_alphabet) {
+        os.write(e.c_str(), e.size() + 1);
+    }
+
+
+    try {
+        ch_trie.save(os);
+    } catch (const xcdat::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Legacy files are written as 0.0.2
+void save_version(std::ostream &os) {
+    uint32_t major = file_layout.v2 ? CTQ_WRITER_VERSION_MAJOR : 0;
+    uint32_t minor = file_layout.v2 ? CTQ_WRITER_VERSION_MINOR : 0;
+    uint32_t patch = file_layout.v2 ? CTQ_WRITER_VERSION_PATCH : 2;
+
+    os.write((char*)&major, sizeof major);
+    os.write((char*)&minor, sizeof minor);
+    os.write((char*)&patch, sizeof patch);
+
+    if (file_layout.v2) {
+        file_layout.save(os);
+    }
+}
+
+/**
+ * @brief Picks the narrowest widths fitting the input, offsets are set when saving the index.
+ * 
+ * @return bool false when the input does not fit the legacy layout
+ */
+bool set_file_layout(const CTQ::WriteOptions &options, const std::vector<uint64_t> &ids) {
+    const uint64_t max_id = ids.size() ? ids.back() : 0;
+    const bool wide = options.wide_fields;
+
+    if (options.legacy_format) {
+        file_layout = FileLayout::legacy();
+
+        if (ids.size() >= (1U << 24) || options.paths.size() > 0xFF || options.cluster_size > UINT16_MAX || options.column_clusters || options.string_pool || options.trie_variant != 8 || options.fold_rules) {
+            std::cerr << "Input or options not supported by the legacy format" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    file_layout = FileLayout();
+
+    bool narrow_postings = !wide && ids.size() < (1U << 24) && options.paths.size() <= 0xFF;
+
+    file_layout.id_bytes           = (wide || max_id > UINT32_MAX) ? 8 : 4;
+    file_layout.pos_bytes          = (wide || options.cluster_size > UINT16_MAX) ? 4 : 2;
+    file_layout.cluster_idx_bytes  = 4;
+    file_layout.offset_bytes       = wide ? 8 : 4;
+    file_layout.posting_bytes      = narrow_postings ? 4 : 8;
+    file_layout.path_bits          = narrow_postings ? 8 : 16;
+    file_layout.cluster_size_bytes = file_layout.pos_bytes;
+    file_layout.flags              = FileLayout::varint_elements;
+
+    file_layout.set_trie_variant(options.trie_variant);
+
+    if (options.fold_rules & ~FoldRules::all) {
+        std::cerr << "Unsupported fold rules" << std::endl;
+        return false;
+    }
+
+    file_layout.set_fold_rules(options.fold_rules);
+
+    if (options.string_pool) {
+        file_layout.flags |= FileLayout::string_pool;
+    }
+
+    if (options.column_clusters) {
+        if (options.cluster_size <= column_header_bytes) {
+            std::cerr << "Cluster size too small for column clusters" << std::endl;
+            return false;
+        }
+
+        file_layout.flags |= FileLayout::column_clusters;
+    }
+
+    if (options.paths.size() > 0xFFFF) {
+        std::cerr << "Too many paths" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Sections of an existing file, as read by the update
+struct ctqFile {
+    ctqFile(const std::string &filename) : input(filename, std::ios::binary) {
+        uint32_t version[3];
+        uint32_t xalpha_sz = 0;
+        uint64_t cnt;
+
+        if (!input.good()) {
+            CTQ_WRITER_THROW("Cannot open file");
+        }
+
+        input.read((char*)version, sizeof version);
+
+        bool legacy = version[0] == 0 && version[1] == 0 && (version[2] == 1 || version[2] == 2);
+        bool v2     = version[0] == 0 && version[1] == 1 && version[2] == 0;
+
+        if (!legacy && !v2) {
+            CTQ_WRITER_THROW("Unsupported version");
+        }
+
+        if (v2) {
+            layout.load(input);
+
+            if (!layout.valid()) {
+                CTQ_WRITER_THROW("Unsupported layout");
+            }
+        } else {
+            layout = FileLayout::legacy();
+        }
+
+        xalpha_sz = read_uint<uint32_t>(input, layout.v2 ? 4 : 2);
+
+        std::string s = "";
+        for (uint32_t i = 0; i < xalpha_sz; ++i) {
+            char c = input.get();
+
+            if (c == 0) {
+                xml_alphabet.push_back(s);
+                s.clear();
+                continue;
+            }
+
+            s += c;
+        }
+
+        ch_trie.load(input, layout.trie_variant());
+
+        cnt = read_uint<uint64_t>(input, layout.count_bytes());
+
+        if (!input.good()) {
+            CTQ_WRITER_THROW("Corrupted file");
+        }
+
+        ids.resize(cnt);
+        pos.resize(cnt);
+        cluster_offset_idx.resize(cnt);
+
+        read_uints(input, ids.data(), cnt, layout.id_bytes);
+        read_uints(input, pos.data(), cnt, layout.pos_bytes);
+        read_uints(input, cluster_offset_idx.data(), cnt, layout.cluster_idx_bytes);
+        footer_start = read_uint<uint64_t>(input, layout.count_bytes());
+
+        input.seekg(footer_start, input.beg);
+
+        if (layout.posting_bytes == 8) {
+            id_mapping_wide = Contiguous2dArray<uint64_t>(input, layout.count_bytes());
+        } else {
+            id_mapping = Contiguous2dArray<uint32_t>(input, layout.count_bytes());
+        }
+
+        paths_mapping = Contiguous2dArray<uint32_t>(input, layout.count_bytes());
+
+        cnt = read_uint<uint64_t>(input, layout.count_bytes());
+
+        if (!input.good()) {
+            CTQ_WRITER_THROW("Corrupted file");
+        }
+
+        cluster_offsets.resize(cnt);
+        read_uints(input, cluster_offsets.data(), cnt, layout.offset_bytes);
+
+        if (v2 || version[2] >= 2) {
+            uint32_t text_cnt;
+
+            input.read((char*)&text_cnt, sizeof text_cnt);
+            ch_trie_ids.resize(text_cnt);
+            input.read((char*)ch_trie_ids.data(), text_cnt * sizeof ch_trie_ids[0]);
+        }
+
+        if (!input.good()) {
+            CTQ_WRITER_THROW("Corrupted file");
+        }
+    }
+
+    inline size_t key_cnt() const { return layout.posting_bytes == 8 ? id_mapping_wide.size() : id_mapping.size(); }
+
+    // calls f(entry idx, path idx) for each posting of a trie key
+    template<typename F>
+    void for_each_posting(uint32_t key, F f) const {
+        auto visit = [&](const auto &mapping) {
+            for (const auto e : mapping.row(key)) {
+                f((uint32_t)(e >> layout.path_bits), (uint32_t)(e & layout.path_mask()));
+            }
+        };
+
+        layout.posting_bytes == 8 ? visit(id_mapping_wide) : visit(id_mapping);
+    }
+
+    std::ifstream               input;
+    FileLayout                  layout;
+    std::vector<std::string>    xml_alphabet;
+    AnyTrie                     ch_trie;
+    std::vector<uint64_t>       ids;
+    std::vector<uint32_t>       pos;
+    std::vector<uint32_t>       cluster_offset_idx;
+    uint64_t                    footer_start;
+    Contiguous2dArray<uint32_t> id_mapping;
+    Contiguous2dArray<uint64_t> id_mapping_wide;
+    Contiguous2dArray<uint32_t> paths_mapping;
+    std::vector<uint64_t>       cluster_offsets;
+    std::vector<uint32_t>       ch_trie_ids;
+};
+
+/**
+ * Copies the clusters of file into state. Untouched clusters are copied as is,
+ * clusters holding removed entries are rebuilt from their remaining entries.
+ * 
+ * @param new_idx Index of each entry of file in state->ids, -1 if removed
+ */
+void copy_clusters(ctqFile &file, const std::vector<long> &new_idx, transformState &state) {
+    std::vector<std::vector<uint32_t>> cluster_entries(file.cluster_offsets.size());
+
+    for (uint32_t i = 0; i < file.ids.size(); ++i) {
+        cluster_entries[file.cluster_offset_idx[i]].push_back(i);
+    }
+
+    for (size_t c = 0; c < cluster_entries.size(); ++c) {
+        auto &entries = cluster_entries[c];
+        uint64_t begin = file.cluster_offsets[c];
+        uint64_t end   = c + 1 < file.cluster_offsets.size() ? file.cluster_offsets[c + 1] : file.footer_start;
+        bool touched   = std::any_of(entries.begin(), entries.end(), [&new_idx](uint32_t e) { return new_idx[e] < 0; });
+
+        file.input.seekg(begin, file.input.beg);
+
+        if (!touched) {
+            uint32_t cluster_size = read_uint<uint32_t>(file.input, file.layout.cluster_size_bytes);
+            std::vector<char> buf(end - begin - file.layout.cluster_size_bytes);
+            file.input.read(buf.data(), buf.size());
+
+            if (cluster_size >> (8 * file_layout.cluster_size_bytes)) {
+                CTQ_WRITER_THROW("Cluster too large for the output layout");
+            }
+
+            // the compressed payload is kept, the raw size is rewritten in the output width
+            state.cluster_offsets.push_back(state.os.tellp());
+            write_uint(state.os, cluster_size, file_layout.cluster_size_bytes);
+            state.os.write(buf.data(), buf.size());
+
+            for (const auto e : entries) {
+                state.pos[new_idx[e]] = file.pos[e];
+                state.cluster_offset_idx[new_idx[e]] = state.cluster_offsets.size() - 1;
+            }
+
+            continue;
+        }
+
+        uint32_t cluster_size = read_uint<uint32_t>(file.input, file.layout.cluster_size_bytes);
+        int compressed_size;
+
+        file.input.read((char*)&compressed_size, sizeof compressed_size);
+
+        if (!file.input.good() || compressed_size < 0) {
+            CTQ_WRITER_THROW("Corrupted file");
+        }
+
+        std::vector<char> inbuf(compressed_size);
+        std::vector<char> raw(cluster_size);
+        std::vector<char> data;
+        std::vector<uint32_t> starts; // of entries in raw, in cluster order
+        std::vector<uint32_t> kept;
+
+        file.input.read(inbuf.data(), compressed_size);
+
+        if (LZ4_decompress_safe(inbuf.data(), raw.data(), compressed_size, cluster_size) != (int)cluster_size) {
+            CTQ_WRITER_THROW("Corrupted file");
+        }
+
+        // entries are stored back to back
+        std::sort(entries.begin(), entries.end(), [&file](uint32_t a, uint32_t b) { return file.pos[a] < file.pos[b]; });
+
+        if (file.layout.has(FileLayout::column_clusters)) {
+            std::vector<char> columns;
+
+            columns.swap(raw);
+            columns_to_rows(columns, raw, starts);
+
+            if (starts.size() != entries.size()) {
+                CTQ_WRITER_THROW("Corrupted file");
+            }
+        } else {
+            for (const auto e : entries) {
+                starts.push_back(file.pos[e]);
+            }
+        }
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            uint32_t e = entries[i];
+            uint32_t entry_end = i + 1 < entries.size() ? starts[i + 1] : raw.size();
+
+            if (new_idx[e] < 0) continue;
+
+            state.pos[new_idx[e]] = data.size();
+            state.cluster_offset_idx[new_idx[e]] = state.cluster_offsets.size();
+            kept.push_back(new_idx[e]);
+            data.insert(data.end(), raw.begin() + starts[i], raw.begin() + entry_end);
+        }
+
+        if (data.size() == 0) continue;
+
+        state.cluster_offsets.push_back(state.os.tellp());
+        write_entries(state, data, kept);
+    }
+}
+
+// Writes the version, the layout and the alphabets, their time counts as alphabet time
+int save_prologue(std::ostream &os, CTQ::WriteStats *stats) {
+    auto start = write_clock::now();
+
+    save_version(os);
+    int rv = save_alphabets(os);
+
+    if (stats) {
+        stats->alphabet_time += seconds_since(start);
+    }
+
+    return rv == 0 ? 0 : -1;
+}
+
+void finish_stats(CTQ::WriteStats *stats, write_clock::time_point start, size_t entry_cnt) {
+    if (!stats) return;
+
+    stats->total_time = seconds_since(start);
+    stats->entry_cnt  = entry_cnt;
+}
+
+// Runs both passes, first_pass and second_pass reading the same input
+int write_input(const saxParser &first_pass, const saxParser &second_pass, const std::string &dst, const CTQ::WriteOptions &options) {
+    std::ofstream output;
+    chSymbolsGuard symbols_guard;
+    auto start = write_clock::now();
+
+    if (options.stats) {
+        *options.stats = CTQ::WriteStats();
+    }
+
+    std::unique_ptr<parseState> parse_state = parse_input(first_pass, options);
+
+    if (parse_state == nullptr || !set_file_layout(options, parse_state->ids)) {
+        return -1;
+    } 
+
+    output = std::ofstream(dst, std::ios::binary);
+    
+    if (!output) {
+        std::cout << "bad" << std::endl;
+        return -1;
+    }
+
+    if (save_prologue(output, options.stats) < 0) {
+        return -1;
+    }
+
+    int rv = transform_input(second_pass, output, parse_state->ids, options);
 
     output.close();
+
+    // no half written file left behind
+    if (rv < 0) {
+        std::remove(dst.c_str());
+        return rv;
+    }
+
+    finish_stats(options.stats, start, parse_state->ids.size());
     
-    return 0;
+    return rv;
+}
+
+static const int decode_repeats = 5; // timings per entry when tuning the cluster size
+
+/**
+ * Decompression time of each entry of the clusters written by state, as get does it:
+ * up to the entry end on row clusters when a later entry bounds it, whole clusters otherwise.
+ * Each decode is repeated decode_repeats times and the minimum is kept.
+ */
+std::vector<double> time_entry_decoding(const transformState &state, const std::string &clusters) {
+    std::vector<std::vector<uint32_t>> cluster_entries(state.cluster_offsets.size());
+    std::vector<char> raw;
+    std::vector<double> ret;
+
+    for (const auto &e : state.kept_entries) {
+        cluster_entries[state.cluster_offset_idx[e.idx]].push_back(state.pos[e.idx]);
+    }
+
+    for (size_t c = 0; c < cluster_entries.size(); ++c) {
+        auto &starts = cluster_entries[c];
+        const char *p = clusters.data() + state.cluster_offsets[c];
+        uint32_t raw_size = 0;
+        int compressed_size;
+
+        memcpy(&raw_size, p, file_layout.cluster_size_bytes);
+        memcpy(&compressed_size, p + file_layout.cluster_size_bytes, sizeof compressed_size);
+        p += file_layout.cluster_size_bytes + sizeof compressed_size;
+
+        raw.resize(raw_size);
+        std::sort(starts.begin(), starts.end());
+
+        for (size_t i = 0; i < starts.size(); ++i) {
+            uint32_t needed = i + 1 < starts.size() && !file_layout.has(FileLayout::column_clusters) ? starts[i + 1] : 0;
+            double best = 0;
+
+            // the fastest of a few runs, a single timing is mostly scheduler and cache noise
+            for (int r = 0; r < decode_repeats; ++r) {
+                auto start = write_clock::now();
+
+                if (needed) {
+                    LZ4_decompress_safe_partial(p, raw.data(), compressed_size, needed, raw_size);
+                } else {
+                    LZ4_decompress_safe(p, raw.data(), compressed_size, raw_size);
+                }
+
+                double us = std::chrono::duration<double, std::micro>(write_clock::now() - start).count();
+                best = r == 0 ? us : std::min(best, us);
+            }
+
+            ret.push_back(best);
+        }
+    }
+
+    return ret;
+}
+
+// Runs the parse pass and a transform pass keeping sampled entries, then clusters them at each candidate size
+uint32_t tune_input(const saxParser &first_pass, const saxParser &second_pass, const CTQ::WriteOptions &options, std::vector<CTQ::ClusterSizeTrial> &trials, double size_budget, size_t sample_cnt) {
+    const size_t window_cnt = 32;
+    std::vector<uint32_t> candidates { 4000, 8000, 16000, 32000, 64000, 128000, 256000 };
+    CTQ::WriteOptions sample_options = options;
+    chSymbolsGuard symbols_guard;
+
+    trials.clear();
+
+    if (options.legacy_format) {
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](uint32_t e) { return e > UINT16_MAX; }), candidates.end());
+    }
+
+    std::unique_ptr<parseState> parse_state = parse_input(first_pass, options);
+
+    // widths fitting the largest candidate
+    sample_options.cluster_size = candidates.back();
+
+    if (parse_state == nullptr || !set_file_layout(sample_options, parse_state->ids)) {
+        return 0;
+    }
+
+    const std::vector<uint64_t> &ids = parse_state->ids;
+    std::vector<uint32_t> pos(ids.size());
+    std::vector<uint32_t> cluster_offset_idx(ids.size());
+    std::stringstream sink;
+    transformState state(ids, options.paths, pos, cluster_offset_idx, sink, sample_options.cluster_size);
+    xmlSAXHandler handler = { .startElement = transform_startElement, .endElement = transform_endElement, .characters = transform_characters };
+
+    state.reorder       = true;
+    state.order_path    = options.order_path;
+    state.sample_stride = std::max<size_t>(1, ids.size() / window_cnt);
+    state.sample_window = std::max<size_t>(1, sample_cnt / window_cnt);
+    set_progress(state, "sample", options);
+
+    if (second_pass(&handler, &state) < 0) {
+        return 0;
+    }
+
+    clear_ch_symbols();
+
+    if (state.unknown_text) {
+        std::cerr << "Text missing from the first pass" << std::endl;
+        return 0;
+    }
+
+    size_t min_bytes = SIZE_MAX;
+
+    for (const auto size : candidates) {
+        std::stringstream clusters;
+        transformState trial(ids, options.paths, pos, cluster_offset_idx, clusters, size);
+        CTQ::ClusterSizeTrial row;
+
+        trial.kept_rows.swap(state.kept_rows);
+        trial.kept_entries.swap(state.kept_entries);
+
+        if (trial.budget == 0 || trial.budget > size) {
+            trial.kept_rows.swap(state.kept_rows);
+            trial.kept_entries.swap(state.kept_entries);
+            continue;
+        }
+
+        pack_entries(trial, options);
+
+        if (trial.cluster_overflow) {
+            trial.kept_rows.swap(state.kept_rows);
+            trial.kept_entries.swap(state.kept_entries);
+            continue;
+        }
+
+        std::vector<double> times = time_entry_decoding(trial, clusters.str());
+        std::sort(times.begin(), times.end());
+
+        row.cluster_size     = size;
+        row.cluster_cnt      = trial.cluster_offsets.size();
+        row.raw_bytes        = std::accumulate(trial.raw_sizes.begin(), trial.raw_sizes.end(), (size_t)0);
+        row.compressed_bytes = (size_t)clusters.tellp() + row.cluster_cnt * file_layout.offset_bytes;
+
+        if (times.size()) {
+            row.get_p50_us = times[times.size() / 2];
+            row.get_p99_us = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+        }
+
+        min_bytes = std::min(min_bytes, row.compressed_bytes);
+        trials.push_back(row);
+
+        trial.kept_rows.swap(state.kept_rows);
+        trial.kept_entries.swap(state.kept_entries);
+    }
+
+    CTQ::ClusterSizeTrial *best = nullptr;
+
+    for (auto &e : trials) {
+        if (e.compressed_bytes <= size_budget * min_bytes && (best == nullptr || e.get_p99_us < best->get_p99_us)) {
+            best = &e;
+        }
+    }
+
+    if (best == nullptr) {
+        std::cerr << "No entries to sample" << std::endl;
+        return 0;
+    }
+
+    best->chosen = true;
+
+    return best->cluster_size;
+}
+
+namespace CTQ {
+
+int write(const std::string &src, const std::string &dst, const std::vector<std::string> &paths, uint32_t cluster_size) {
+    WriteOptions options;
+
+    options.paths        = paths;
+    options.cluster_size = cluster_size;
+
+    return write(src, dst, options);
+}
+
+int write(const std::string &src, const std::string &dst, const WriteOptions &options) {
+    std::ofstream output;
+    std::unique_ptr<parseState> parse_state;
+    std::unique_ptr<teiShards> shards;
+    std::vector<std::vector<uint64_t>> shard_ids;
+    unsigned thread_cnt = options.thread_cnt ? options.thread_cnt : std::max(1U, std::thread::hardware_concurrency());
+    chSymbolsGuard symbols_guard;
+    auto start = write_clock::now();
+
+    // entries are ordered across the whole body, by a single transform pass
+    if (thread_cnt <= 1 || is_ordered(options)) {
+        return write_input(file_parser(src), file_parser(src), dst, options);
+    }
+
+    if (options.stats) {
+        *options.stats = WriteStats();
+    }
+
+    xmlInitParser();
+    shards = split_input(src, thread_cnt);
+
+    if (shards == nullptr) {
+        return -1;
+    }
+
+    parse_state = parse_input(src, *shards, shard_ids, options);
+
+    if (parse_state == nullptr || !set_file_layout(options, parse_state->ids)) {
+        return -1;
+    } 
+
+    output = std::ofstream(dst, std::ios::binary);
+    
+    if (!output) {
+        std::cout << "bad" << std::endl;
+        return -1;
+    }
+
+    if (save_prologue(output, options.stats) < 0) {
+        return -1;
+    }
+
+    int rv = transform_input(src, output, parse_state->ids, options, *shards, shard_ids);
+
+    output.close();
+    finish_stats(options.stats, start, parse_state->ids.size());
+    
+    return rv;
+}
+
+int write(std::istream &src, const std::string &dst, const WriteOptions &options) {
+    return write([&src](char *buf, size_t size) -> long {
+        src.read(buf, size);
+        return src.bad() ? -1 : src.gcount();
+    }, dst, options);
+}
+
+int write(const char *data, size_t size, const std::string &dst, const WriteOptions &options) {
+    auto parser = [data, size](xmlSAXHandler *handler, void *user_data) {
+        size_t offset = 0;
+
+        return parse_chunks(handler, user_data, [&](char *buf, size_t buf_size) -> long {
+            size_t len = std::min(buf_size, size - offset);
+
+            memcpy(buf, data + offset, len);
+            offset += len;
+
+            return len;
+        });
+    };
+
+    return write_input(parser, parser, dst, options);
+}
+
+uint32_t tune_cluster_size(const std::string &src, const WriteOptions &options, std::vector<ClusterSizeTrial> &trials, double size_budget, size_t sample_cnt) {
+    return tune_input(file_parser(src), file_parser(src), options, trials, size_budget, sample_cnt);
+}
+
+uint32_t tune_cluster_size(const char *data, size_t size, const WriteOptions &options, std::vector<ClusterSizeTrial> &trials, double size_budget, size_t sample_cnt) {
+    auto parser = [data, size](xmlSAXHandler *handler, void *user_data) {
+        size_t offset = 0;
+
+        return parse_chunks(handler, user_data, [&](char *buf, size_t buf_size) -> long {
+            size_t len = std::min(buf_size, size - offset);
+
+            memcpy(buf, data + offset, len);
+            offset += len;
+
+            return len;
+        });
+    };
+
+    return tune_input(parser, parser, options, trials, size_budget, sample_cnt);
+}
+
+int write(const ReadCallback &src, const std::string &dst, const WriteOptions &options) {
+    inputSpool spool;
+
+    spool.limit    = options.spool_budget;
+    spool.temp_dir = options.temp_dir;
+
+    ReadCallback record = spool.record(src);
+
+    auto first_pass  = [&](xmlSAXHandler *handler, void *user_data) { return parse_chunks(handler, user_data, record); };
+    auto second_pass = [&](xmlSAXHandler *handler, void *user_data) { return parse_chunks(handler, user_data, spool.replay()); };
+
+    return write_input(first_pass, second_pass, dst, options);
+}
+
+int update(const std::string &src, const std::string &delta, const std::string &dst, const std::vector<std::string> &paths, uint32_t cluster_size) {
+    WriteOptions options;
+
+    options.paths        = paths;
+    options.cluster_size = cluster_size;
+
+    return update(src, delta, dst, options);
+}
+
+int update(const std::string &src, const std::string &delta, const std::string &dst, const WriteOptions &options) {
+    auto start = write_clock::now();
+    ctqFile file(src);
+    std::ofstream output;
+    chSymbolsGuard symbols_guard;
+
+    if (options.stats) {
+        *options.stats = WriteStats();
+    }
+
+    std::unique_ptr<parseState> delta_state = parse_input(file_parser(delta), options, true);
+
+    if (delta_state == nullptr) {
+        return -1;
+    }
+
+    const std::vector<uint64_t> &added   = delta_state->ids;
+    const std::vector<uint64_t> &removed = delta_state->removed_ids;
+    std::vector<uint64_t> ids;
+    std::vector<long> new_idx(file.ids.size(), -1);
+    std::vector<std::string> keys(file.ch_trie.num_keys());
+
+    // ids, changed entries are removed then added back
+    {
+        auto is_removed = [&](uint64_t id) {
+            return std::binary_search(removed.begin(), removed.end(), id) || std::binary_search(added.begin(), added.end(), id);
+        };
+
+        std::copy_if(file.ids.begin(), file.ids.end(), std::back_inserter(ids), [&](uint64_t id) { return !is_removed(id); });
+        ids.insert(ids.end(), added.begin(), added.end());
+        std::sort(ids.begin(), ids.end());
+
+        for (size_t i = 0; i < file.ids.size(); ++i) {
+            if (!is_removed(file.ids[i])) {
+                new_idx[i] = std::distance(ids.begin(), std::lower_bound(ids.begin(), ids.end(), file.ids[i]));
+            }
+        }
+    }
+
+    auto alphabet_start = write_clock::now();
+
+    // alphabets, symbols of the delta are appended so the clusters can be copied as is
+    try {
+        std::vector<std::string> xalpha(file.xml_alphabet);
+
+        for (const auto &e : delta_state->xml_alpha.sorted()) {
+            if (std::find(file.xml_alphabet.begin(), file.xml_alphabet.end(), e) == file.xml_alphabet.end()) {
+                xalpha.push_back(e);
+            }
+        }
+
+        set_xml_alphabet(xalpha);
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[i] = file.ch_trie.decode(i);
+        }
+
+        std::set<std::string> ch_alpha(keys.begin(), keys.end());
+
+        for (uint32_t i = 0; i < delta_state->ch_alpha.size(); ++i) {
+            ch_alpha.emplace(delta_state->ch_alpha[i]);
+        }
+
+        ch_trie = AnyTrie(std::vector<std::string>(ch_alpha.begin(), ch_alpha.end()), file.ch_trie.bits());
+        set_ch_symbols(std::move(delta_state->ch_alpha));
+    } catch (const xcdat::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return -1;
+    }
+
+    auto trie_id = [&keys](uint32_t old_id) -> uint32_t { return ch_trie.lookup(keys[old_id]).value(); };
+
+    // cluster text ids of the copied clusters keep their meaning, new keys are appended
+    {
+        size_t text_cnt = file.ch_trie_ids.size() ? file.ch_trie_ids.size() : keys.size();
+
+        ch_trie_ids.clear();
+        ch_cluster_ids.assign(ch_trie.num_keys(), UINT32_MAX);
+
+        for (size_t i = 0; i < text_cnt; ++i) {
+            ch_trie_ids.push_back(trie_id(file.ch_trie_ids.size() ? file.ch_trie_ids[i] : i));
+            ch_cluster_ids[ch_trie_ids.back()] = i;
+        }
+
+        for (uint32_t i = 0; i < ch_cluster_ids.size(); ++i) {
+            if (ch_cluster_ids[i] == UINT32_MAX) {
+                ch_cluster_ids[i] = ch_trie_ids.size();
+                ch_trie_ids.push_back(i);
+            }
+        }
+    }
+
+    if (options.stats) {
+        options.stats->alphabet_time = seconds_since(alphabet_start);
+    }
+
+    if (!set_file_layout(options, ids)) {
+        return -1;
+    }
+
+    // copied clusters keep the element encoding and cluster layout of src
+    if ((file.layout.flags & FileLayout::cluster_flags) != (file_layout.flags & FileLayout::cluster_flags)) {
+        if (!file_layout.v2) {
+            std::cerr << "Cannot write the clusters of src to a legacy file" << std::endl;
+            return -1;
+        }
+
+        file_layout.flags = (file_layout.flags & ~FileLayout::cluster_flags) | (file.layout.flags & FileLayout::cluster_flags);
+    }
+
+    if (file.layout.has(FileLayout::string_pool) && file_layout.v2) {
+        file_layout.flags |= FileLayout::string_pool;
+    }
+
+    // the folded keys are rebuilt with the rules of src unless others are given
+    if (file.layout.fold_rules() && !file_layout.fold_rules()) {
+        if (!file_layout.v2) {
+            std::cerr << "Cannot write the folded keys of src to a legacy file" << std::endl;
+            return -1;
+        }
+
+        file_layout.set_fold_rules(file.layout.fold_rules());
+    }
+
+    // the trie is rebuilt with the variant of src
+    if (ch_trie.bits() != file_layout.trie_variant()) {
+        if (!file_layout.v2) {
+            std::cerr << "Cannot write the trie variant of src to a legacy file" << std::endl;
+            return -1;
+        }
+
+        file_layout.set_trie_variant(ch_trie.bits());
+    }
+
+    output = std::ofstream(dst, std::ios::binary);
+    
+    if (!output) {
+        std::cout << "bad" << std::endl;
+        return -1;
+    }
+
+    if (save_prologue(output, options.stats) < 0) {
+        return -1;
+    }
+
+    int rv = transform_input(file_parser(delta), output, ids, options, true, [&](transformState &state) {
+        copy_clusters(file, new_idx, state);
+
+        for (uint32_t i = 0; i < file.key_cnt(); ++i) {
+            file.for_each_posting(i, [&](uint32_t entry_idx, uint32_t path_idx) {
+                if (new_idx[entry_idx] >= 0) {
+                    state.id_mapping.add(trie_id(i), ((uint64_t)new_idx[entry_idx] << file_layout.path_bits) | path_idx);
+                }
+            });
+        }
+
+        for (uint32_t i = 0; i < file.paths_mapping.size(); ++i) {
+            if (new_idx[i] < 0) continue;
+
+            for (const auto e : file.paths_mapping.row(i)) {
+                state.paths_mapping.add(new_idx[i], trie_id(e));
+            }
+        }
+    });
+
+    output.close();
+    finish_stats(options.stats, start, ids.size());
+    
+    return rv;
 }
 
 }
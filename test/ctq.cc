@@ -1,11 +1,17 @@
 #include <string>
 #include <vector>
+#include <set>
 #include <cstring>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <filesystem>
 
 #include "catch2/catch_test_macros.hpp"
 #include "ctq_writer.h"
 #include "ctq_reader.h"
 #include "ctq_util.hh"
+#include "ctq_intern.hh"
 
 
 // regexp
@@ -20,10 +26,50 @@ TEST_CASE("2d array") {
     cvec.save(ss);
     Contiguous2dArray<int> cvecIO(ss);
 
+    // 64 bits counts and row starts, as in 0.1 files
+    std::stringstream wide;
+
+    cvec.save(wide, 8);
+    REQUIRE(wide.str().size() == 2 * 8 + vec.size() * 8 + cvec.value_cnt() * sizeof(int));
+    REQUIRE(ss.str().size() == 2 * 4 + vec.size() * 4 + cvec.value_cnt() * sizeof(int));
+
+    Contiguous2dArray<int> cvecWide(wide, 8);
+
     for (int i = 0; i < vec.size(); ++i) {
         REQUIRE(cvec[i] == vec[i]);
         REQUIRE(cvecIO[i] == vec[i]);
+        REQUIRE(cvecWide[i] == vec[i]);
+    }
+}
+
+TEST_CASE("varint") {
+    std::vector<uint32_t> values{ 0, 1, 127, 128, 16383, 16384, (1U << 21) - 1, 1U << 21, (1U << 28) - 1, 1U << 28, UINT32_MAX };
+    std::vector<char> buf;
+
+    for (const auto v : values) {
+        put_varint(buf, v);
+    }
+
+    REQUIRE(buf.size() == 1 + 1 + 1 + 2 + 2 + 3 + 3 + 4 + 4 + 5 + 5);
+
+    const char *p = buf.data();
+    const char *end = buf.data() + buf.size();
+
+    for (const auto v : values) {
+        uint32_t value;
+
+        REQUIRE(get_varint(p, end, value));
+        REQUIRE(value == v);
     }
+
+    uint32_t value;
+
+    REQUIRE(p == end);
+    REQUIRE(!get_varint(p, end, value));
+
+    // truncated
+    p = end - 5;
+    REQUIRE(!get_varint(p, end - 1, value));
 }
 
 TEST_CASE("simple") {
@@ -110,6 +156,25 @@ TEST_CASE("simple") {
             REQUIRE(find2.size() == 0);
             REQUIRE(find3.size() == 0);
         }
+
+        // query context
+        {
+            CTQ::QueryContext ctx;
+
+            for (size_t i = 0; i < keys.size(); ++i) {
+                REQUIRE(reader.find(ctx, keys[i]) == 1);
+                REQUIRE(ctx[0].key == keys[i]);
+                REQUIRE(ctx[0].id_cnt == 1);
+                REQUIRE(ctx[0].ids[0] == ids[i]);
+            }
+
+            REQUIRE(reader.find(ctx, "noun%", 0, 0, 0, "袱紗") == 1);
+            REQUIRE(ctx[0].key == "noun (common) (futsuumeishi)");
+
+            REQUIRE(reader.find(ctx, "p%") == reader.find("p%").size());
+            REQUIRE(reader.find(ctx, "fdsfsdsd") == 0);
+            REQUIRE(ctx.empty());
+        }
     }
 
     SECTION("C") {
@@ -165,6 +230,1318 @@ TEST_CASE("simple") {
             ctq_find_ret_free(find);
         }
 
+        // caller-owned query context
+        {
+            ctq_query_ctx *query = ctq_create_query_ctx();
+            const ctq_find_ret *ret = NULL;
+
+            for (size_t i = 0; i < keys.size(); ++i) {
+                REQUIRE(ctq_find_into(ctx, query, keys[i].c_str(), 0, 0, 0, "", 0, &ret) == 1);
+                REQUIRE(std::string(ret[0].key) == keys[i]);
+                REQUIRE(ret[0].id_cnt == 1);
+                REQUIRE(ret[0].ids[0] == ids[i]);
+                REQUIRE(ret[1].ids == NULL);
+            }
+
+            ctq_find_ret *arr = ctq_find(ctx, "p%", 0, 0, 0, "", 0);
+            long cnt = ctq_find_into(ctx, query, "p%", 0, 0, 0, "", 0, &ret);
+
+            REQUIRE(cnt > 0);
+
+            for (long i = 0; i < cnt; ++i) {
+                REQUIRE(std::string(ret[i].key) == arr[i].key);
+                REQUIRE(std::vector<uint64_t>(ret[i].ids, ret[i].ids + ret[i].id_cnt) == std::vector<uint64_t>(arr[i].ids, arr[i].ids + arr[i].id_cnt));
+            }
+
+            REQUIRE(arr[cnt].ids == NULL);
+            REQUIRE(ctq_find_into(ctx, query, "fdsfsdsd", 0, 0, 0, "", 0, &ret) == 0);
+            REQUIRE(ret[0].ids == NULL);
+
+            ctq_find_ret_free(arr);
+            ctq_destroy_query_ctx(query);
+        }
+
+        ctq_destroy_reader(ctx);
+    }
+}
+
+TEST_CASE("reader stats") {
+    const std::string output_filename = "dataset/simple.ctq";
+
+    CTQ::write("dataset/simple.tei", output_filename, { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" });
+
+    CTQ::Reader reader(output_filename, true);
+
+    reader.find("袱紗");
+    reader.find("noun%", 0, 0, 0, "袱紗");
+    reader.get(1010990);
+    reader.get(1565440);
+
+    auto stats = reader.stats();
+
+#ifdef CTQ_READER_STATS
+    auto histogram_total = [](const uint64_t *histogram) {
+        uint64_t total = 0;
+        for (int i = 0; i < CTQ_STATS_LATENCY_BUCKETS; ++i) total += histogram[i];
+        return total;
+    };
+
+    REQUIRE(stats.find_calls == 2);
+    REQUIRE(stats.get_calls == 2);
+    REQUIRE(stats.clusters_read == 2);
+    REQUIRE(stats.compressed_bytes > 0);
+    REQUIRE(stats.decompressed_bytes >= stats.compressed_bytes / 2);
+    REQUIRE(stats.trie_iterations >= 2);
+    REQUIRE(stats.postings_scanned >= 2);
+    REQUIRE(stats.filter_evaluations > 0);
+    REQUIRE(histogram_total(stats.find_latency_us) == 2);
+    REQUIRE(histogram_total(stats.get_latency_us) == 2);
+
+    ctq_ctx *ctx = ctq_create_reader(output_filename.c_str());
+    ctq_reader_stats c_stats;
+
+    free(ctq_get(ctx, 1011000));
+    REQUIRE(ctq_stats(ctx, &c_stats) == 0);
+    REQUIRE(c_stats.get_calls == 1);
+    REQUIRE(c_stats.clusters_read == 1);
+
+    ctq_destroy_reader(ctx);
+
+    reader.reset_stats();
+    REQUIRE(reader.stats().find_calls == 0);
+    REQUIRE(reader.stats().clusters_read == 0);
+#else
+    REQUIRE(stats.find_calls == 0);
+#endif
+}
+
+TEST_CASE("count and complete") {
+    const std::string output_filename = "dataset/simple.ctq";
+
+    CTQ::write("dataset/simple.tei", output_filename, { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" });
+
+    CTQ::Reader reader(output_filename);
+
+    auto found = [&](const std::string &keyword, int path_idx, const std::string &filter = "", int filter_path_idx = 0) {
+        size_t ret = 0;
+
+        for (const auto &e : reader.find(keyword, 0, 0, path_idx, filter, filter_path_idx)) {
+            ret += e.second.size();
+        }
+
+        return ret;
+    };
+
+    for (const auto &keyword : { "袱紗", "p%", "noun%", "noun (common) (futsuumeishi)", "a%", "missing", "", "%" }) {
+        for (int path_idx = 0; path_idx <= 3; ++path_idx) {
+            REQUIRE(reader.count(keyword, path_idx) == found(keyword, path_idx));
+            REQUIRE(reader.count(keyword, path_idx, "袱紗", 1) == found(keyword, path_idx, "袱紗", 1));
+            REQUIRE(reader.count(keyword, path_idx, "s%") == found(keyword, path_idx, "s%"));
+        }
+    }
+
+    REQUIRE(reader.count("noun (common) (futsuumeishi)") == 2);
+    REQUIRE(reader.count("noun (common) (futsuumeishi)", 0, "", 0, 1) == 1);
+    REQUIRE(reader.count("p%", 0, "", 0, 1) == 1);
+    REQUIRE(reader.count("") == 0);
+    REQUIRE(reader.count("%") > reader.count("p%"));
+
+    // keys of entries already found by a previous key are listed, lbl texts are outside of the paths
+    const std::vector<std::string> keys { "slovenly", "small cloth for wiping tea utensils", "small silk wrapper" };
+
+    REQUIRE(reader.find("s%").size() == 2);
+    REQUIRE(reader.complete("s", 100) == keys);
+    REQUIRE(reader.complete("s", 2) == std::vector<std::string>(keys.begin(), keys.begin() + 2));
+    REQUIRE(reader.complete("ふく", 10, 1) == std::vector<std::string>{ "ふくさ", "ふくよか" });
+    REQUIRE(reader.complete("ふく", 10, 2).empty());
+    REQUIRE(reader.complete("missing", 10).empty());
+
+    ctq_ctx *ctx = ctq_create_reader(output_filename.c_str());
+    char **completions = ctq_complete(ctx, "ふく", 10, 1);
+
+    REQUIRE(ctq_count(ctx, "p%", 0, "", 0, 0) == (long)found("p%", 0));
+    REQUIRE(completions != NULL);
+    REQUIRE(std::string(completions[0]) == "ふくさ");
+    REQUIRE(std::string(completions[1]) == "ふくよか");
+    REQUIRE(completions[2] == NULL);
+
+    ctq_complete_free(completions);
+    ctq_destroy_reader(ctx);
+}
+
+TEST_CASE("path sets") {
+    const std::string output_filename = "dataset/simple.ctq";
+
+    CTQ::write("dataset/simple.tei", output_filename, { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" });
+
+    CTQ::Reader reader(output_filename);
+
+    auto ids_of = [](const std::map<std::string, std::vector<uint64_t>> &found) {
+        std::set<uint64_t> ret;
+
+        for (const auto &e : found) {
+            ret.insert(e.second.begin(), e.second.end());
+        }
+
+        return ret;
+    };
+
+    for (const auto &keyword : { "袱紗", "p%", "noun%", "s%", "%", "missing" }) {
+        for (const auto &path_idxs : std::vector<std::vector<int>>{ { 1, 2 }, { 2, 3 }, { 1, 3 }, { 1, 2, 3 } }) {
+            CTQ::PathSet paths(path_idxs.begin(), path_idxs.end());
+            std::set<uint64_t> expected;
+
+            for (int path_idx : path_idxs) {
+                auto ids = ids_of(reader.find(keyword, 0, 0, path_idx));
+                expected.insert(ids.begin(), ids.end());
+            }
+
+            REQUIRE(ids_of(reader.find(keyword, 0, 0, paths)) == expected);
+            REQUIRE(reader.count(keyword, paths) == expected.size());
+        }
+
+        REQUIRE(reader.find(keyword, 0, 0, CTQ::PathSet{ 0, 2 }) == reader.find(keyword));
+        REQUIRE(reader.find(keyword, 0, 0, CTQ::PathSet{ 2 }) == reader.find(keyword, 0, 0, 2));
+    }
+
+    REQUIRE(reader.complete("ふく", 10, CTQ::PathSet{ 2, 3 }).empty());
+    REQUIRE(reader.complete("ふく", 10, CTQ::PathSet{ 1, 3 }) == std::vector<std::string>{ "ふくさ", "ふくよか" });
+
+    const int path_idxs[] = { 1, 3 };
+    ctq_ctx *ctx = ctq_create_reader(output_filename.c_str());
+    ctq_find_ret *arr = ctq_find_paths(ctx, "袱紗", 0, 0, path_idxs, 2, "", 0);
+
+    REQUIRE(arr != NULL);
+    REQUIRE(std::string(arr[0].key) == "袱紗");
+
+    ctq_find_ret_free(arr);
+    ctq_destroy_reader(ctx);
+}
+
+TEST_CASE("normalized find") {
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::string folded_filename = "dataset/simple_folded.ctq";
+
+    REQUIRE(fold_key("ＦＵＫＵ　ﾌｸｻ", FoldRules::width) == "FUKU フクサ");
+    REQUIRE(fold_key("ｶﾞｯｺｳ ﾊﾟﾝ", FoldRules::width | FoldRules::kana) == "がっこう ぱん");
+    REQUIRE(fold_key("Crêpe ÉCOLE", FoldRules::lower) == "crêpe école");
+    REQUIRE(fold_key("Ａ%", FoldRules::all) == "a%");
+
+    CTQ::WriteOptions options;
+    options.paths      = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    options.fold_rules = FoldRules::all;
+
+    REQUIRE(CTQ::write("dataset/simple.tei", output_filename, options.paths) == 0);
+    REQUIRE(CTQ::write("dataset/simple.tei", folded_filename, options) == 0);
+
+    CTQ::Reader plain(output_filename);
+    CTQ::Reader reader(folded_filename);
+
+    REQUIRE(reader.find("p%") == plain.find("p%"));
+    REQUIRE(reader.find("フクサ", 0, 0, 0, "", 0, true) == plain.find("ふくさ"));
+    REQUIRE(reader.find("ﾌｸｻ", 0, 0, 1, "", 0, true) == plain.find("ふくさ", 0, 0, 1));
+    REQUIRE(reader.find("ﾌｸ%", 0, 0, 0, "", 0, true) == plain.find("ふく%"));
+    REQUIRE(reader.find("ＳＭＡＬＬ Silk%", 0, 0, 0, "", 0, true) == plain.find("small silk%"));
+    REQUIRE(reader.find("Plump", 0, 0, 0, "", 0, true) == plain.find("plump"));
+    REQUIRE(reader.find("Plump").empty());
+    REQUIRE(reader.find("missing", 0, 0, 0, "", 0, true).empty());
+
+    bool thrown = false;
+
+    try {
+        plain.find("ふくさ", 0, 0, 0, "", 0, true);
+    } catch (const CTQ::reader_exception &) {
+        thrown = true;
+    }
+
+    REQUIRE(thrown);
+
+    // updates rebuild the folded keys with the rules of src
+    {
+        const std::string delta_filename  = "dataset/delta_folded.tei";
+        const std::string update_filename = "dataset/simple_folded_update.ctq";
+
+        std::ofstream(delta_filename) << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body>"
+            << "<entry xml:id=\"a2000000\"><form type=\"r_ele\"><orth>ふくろ</orth></form><sense><cit type=\"trans\"><quote>bag</quote></cit></sense></entry>"
+            << "</body></text></TEI>";
+
+        REQUIRE(CTQ::update(folded_filename, delta_filename, update_filename, options.paths) == 0);
+
+        CTQ::Reader updated(update_filename);
+
+        REQUIRE(updated.find("ふくろ").size() == 1);
+        REQUIRE(updated.find("ﾌｸﾛ", 0, 0, 0, "", 0, true) == updated.find("ふくろ"));
+        REQUIRE(updated.find("フクサ", 0, 0, 0, "", 0, true) == plain.find("ふくさ"));
+    }
+
+    ctq_ctx *ctx = ctq_create_reader(folded_filename.c_str());
+    ctq_find_ret *arr = ctq_find_normalized(ctx, "フクサ", 0, 0, 0, "", 0);
+
+    REQUIRE(arr != NULL);
+    REQUIRE(std::string(arr[0].key) == "ふくさ");
+
+    ctq_find_ret_free(arr);
+    ctq_destroy_reader(ctx);
+}
+
+TEST_CASE("entry order") {
+    const std::string output_filename  = "dataset/simple.ctq";
+    const std::string ordered_filename = "dataset/simple_ordered.ctq";
+    const std::string logged_filename  = "dataset/simple_logged.ctq";
+
+    CTQ::WriteOptions options;
+    options.paths        = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    options.cluster_size = 400;
+
+    REQUIRE(CTQ::write("dataset/simple.tei", output_filename, options) == 0);
+
+    CTQ::Reader plain(output_filename);
+    std::vector<uint64_t> ids;
+
+    for (const auto &e : plain.find("%")) {
+        ids.insert(ids.end(), e.second.begin(), e.second.end());
+    }
+
+    std::sort(ids.begin(), ids.end());
+    REQUIRE(ids.size() == 4);
+
+    // an access log visiting the entries out of document order
+    std::vector<uint64_t> log;
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        log.push_back(ids[(i * 3) % ids.size()]);
+    }
+
+    CTQ::WriteOptions ordered_options = options;
+    CTQ::WriteOptions logged_options  = options;
+
+    ordered_options.order_path = "/entry/form/orth";
+    logged_options.entry_order = log;
+    logged_options.thread_cnt  = 4;
+
+    REQUIRE(CTQ::write("dataset/simple.tei", ordered_filename, ordered_options) == 0);
+    REQUIRE(CTQ::write("dataset/simple.tei", logged_filename, logged_options) == 0);
+
+    CTQ::Reader ordered(ordered_filename);
+    CTQ::Reader logged(logged_filename);
+
+    for (const auto id : ids) {
+        REQUIRE(ordered.get(id) == plain.get(id));
+        REQUIRE(logged.get(id) == plain.get(id));
+    }
+
+    REQUIRE(ordered.find("p%") == plain.find("p%"));
+    REQUIRE(logged.find("noun%", 0, 0, 0, "袱紗") == plain.find("noun%", 0, 0, 0, "袱紗"));
+
+#ifdef CTQ_READER_STATS
+    plain.reset_stats();
+    logged.reset_stats();
+
+    for (const auto id : log) {
+        plain.get(id);
+        logged.get(id);
+    }
+
+    REQUIRE(logged.stats().clusters_read < plain.stats().clusters_read);
+#endif
+}
+
+TEST_CASE("cluster size tuning") {
+    const std::string output_filename = "dataset/simple_tuned.ctq";
+    std::vector<CTQ::ClusterSizeTrial> trials;
+    CTQ::WriteOptions options;
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    options.cluster_size = CTQ::tune_cluster_size("dataset/simple.tei", options, trials);
+    REQUIRE(options.cluster_size > 0);
+    REQUIRE(trials.size() > 1);
+
+    size_t min_bytes = SIZE_MAX;
+    size_t chosen_cnt = 0;
+
+    for (size_t i = 0; i < trials.size(); ++i) {
+        REQUIRE((i == 0 || trials[i - 1].cluster_size < trials[i].cluster_size));
+        REQUIRE(trials[i].cluster_cnt > 0);
+        REQUIRE(trials[i].get_p50_us <= trials[i].get_p99_us);
+        min_bytes = std::min(min_bytes, trials[i].compressed_bytes);
+    }
+
+    for (const auto &e : trials) {
+        if (e.chosen) {
+            ++chosen_cnt;
+            REQUIRE(e.cluster_size == options.cluster_size);
+            REQUIRE(e.compressed_bytes <= 2 * min_bytes);
+        }
+    }
+
+    REQUIRE(chosen_cnt == 1);
+    REQUIRE(CTQ::write("dataset/simple.tei", output_filename, options) == 0);
+
+    CTQ::Reader reader(output_filename);
+    REQUIRE(reader.find("袱紗").size() == 1);
+
+    // a budget of 1 keeps the smallest output
+    REQUIRE(CTQ::tune_cluster_size("dataset/simple.tei", options, trials, 1.0) > 0);
+
+    for (const auto &e : trials) {
+        if (e.chosen) {
+            REQUIRE(e.compressed_bytes == min_bytes);
+        }
+    }
+
+    options.legacy_format = true;
+    uint32_t legacy_size = CTQ::tune_cluster_size("dataset/simple.tei", options, trials);
+    REQUIRE(legacy_size > 0);
+    REQUIRE(legacy_size <= UINT16_MAX);
+    REQUIRE(trials.back().cluster_size <= UINT16_MAX);
+}
+
+TEST_CASE("find cache") {
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::vector<std::string> keywords { "袱紗", "p%", "noun%", "ああ", "missing" };
+    CTQ::ReaderOptions options;
+
+    CTQ::write("dataset/simple.tei", output_filename, { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" });
+
+    options.find_cache = 1 << 20;
+
+    CTQ::Reader reader(output_filename);
+    CTQ::Reader cached(output_filename, options);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (const auto &keyword : keywords) {
+            REQUIRE(cached.find(keyword) == reader.find(keyword));
+            REQUIRE(cached.find(keyword, 1, 1) == reader.find(keyword, 1, 1));
+            REQUIRE(cached.find(keyword, 0, 0, 1) == reader.find(keyword, 0, 0, 1));
+            REQUIRE(cached.find(keyword, 0, 0, 0, "袱紗", 1) == reader.find(keyword, 0, 0, 0, "袱紗", 1));
+        }
+    }
+
+    auto stats = cached.stats();
+
+    REQUIRE(stats.find_cache_bytes > 0);
+    REQUIRE(reader.stats().find_cache_bytes == 0);
+
+#ifdef CTQ_READER_STATS
+    REQUIRE(stats.find_cache_misses == 4 * keywords.size());
+    REQUIRE(stats.find_cache_hits == 4 * keywords.size());
+    REQUIRE(stats.find_cache_evictions == 0);
+    REQUIRE(stats.find_calls == 8 * keywords.size());
+#endif
+
+    // a budget holding a few results per shard
+    options.find_cache = 16 * 1024;
+    CTQ::Reader small(output_filename, options);
+
+    for (int i = 0; i < 200; ++i) {
+        REQUIRE(small.find("p%", i % 50, 1) == reader.find("p%", i % 50, 1));
+    }
+
+    REQUIRE(small.stats().find_cache_bytes <= options.find_cache);
+
+#ifdef CTQ_READER_STATS
+    REQUIRE(small.stats().find_cache_evictions > 0);
+#endif
+
+    // shared by threads
+    std::atomic<size_t> mismatches{0};
+    std::vector<std::thread> threads;
+    const auto expected = reader.find("p%");
+
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < 500; ++j) {
+                if (small.find("p%") != expected) ++mismatches;
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("preload") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple_preload.ctq";
+    const std::vector<uint64_t> ids { 1010990, 1011000, 1011010, 1565440 };
+    const std::vector<std::string> paths { "/entry/form/orth", "/entry/sense/cit/quote" };
+    CTQ::WriteOptions options;
+    CTQ::ReaderOptions reader_options;
+
+    options.paths        = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    options.cluster_size = 400;
+    reader_options.preload    = true;
+    reader_options.thread_cnt = 2;
+
+    for (bool columns : { false, true }) {
+        options.column_clusters = columns;
+        REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+
+        CTQ::Reader reader(output_filename);
+        CTQ::Reader preloaded(output_filename, reader_options);
+
+        REQUIRE(preloaded.stats().preload_bytes > 0);
+        REQUIRE(preloaded.stats().load_ns > 0);
+        REQUIRE(reader.stats().preload_bytes == 0);
+
+        for (const auto id : ids) {
+            REQUIRE(preloaded.get(id) == reader.get(id));
+            REQUIRE(preloaded.get(id, paths) == reader.get(id, paths));
+            REQUIRE(preloaded.get_texts(id) == reader.get_texts(id));
+        }
+
+        REQUIRE(preloaded.get(ids.back() + 1) == "");
+        REQUIRE(preloaded.stats().clusters_read == 0);
+    }
+
+    ctq_ctx *ctx = ctq_create_preloaded_reader(output_filename.c_str(), 0);
+    char *entry = ctq_get(ctx, 1010990);
+
+    REQUIRE(entry != nullptr);
+    REQUIRE(std::string(entry) == CTQ::Reader(output_filename).get(1010990));
+
+    free(entry);
+    ctq_destroy_reader(ctx);
+}
+
+TEST_CASE("update") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::string delta_filename  = "dataset/delta.tei";
+    const std::string update_filename = "dataset/simple_update.ctq";
+    const std::vector<std::string> paths { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    const std::string changed_entry = "<entry><form type=\"k_ele\"><orth>袱紗</orth></form><sense><cit type=\"trans\"><quote>silk wrapper</quote></cit></sense></entry>";
+    const std::string added_entry   = "<entry><form type=\"r_ele\"><orth>ふくろ</orth></form><sense><note type=\"pos\">noun (common) (futsuumeishi)</note><cit type=\"trans\"><quote>bag</quote></cit></sense></entry>";
+
+    {
+        std::ofstream delta(delta_filename);
+
+        delta << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body>"
+              << "<entry xml:id=\"a1011010\" type=\"delete\"/>"
+              << "<entry xml:id=\"a1010990\"><form type=\"k_ele\"><orth>袱紗</orth></form><sense><cit type=\"trans\"><quote>silk wrapper</quote></cit></sense></entry>"
+              << "<entry xml:id=\"a2000000\"><form type=\"r_ele\"><orth>ふくろ</orth></form><sense><note type=\"pos\">noun (common) (futsuumeishi)</note><cit type=\"trans\"><quote>bag</quote></cit></sense></entry>"
+              << "</body></text></TEI>";
+    }
+
+    // small clusters so that both copied and rebuilt clusters are exercised
+    CTQ::write(input_filename, output_filename, paths, 400);
+    REQUIRE(CTQ::update(output_filename, delta_filename, update_filename, paths, 400) == 0);
+
+    CTQ::Reader original(output_filename);
+    CTQ::Reader reader(update_filename);
+
+    // untouched
+    {
+        auto find = reader.find("嗚呼");
+
+        REQUIRE(find.size() == 1);
+        REQUIRE(find.begin()->second.front() == 1565440);
+        REQUIRE(reader.get(1565440) == original.get(1565440));
+        REQUIRE(reader.get(1011000) == original.get(1011000));
+    }
+
+    // removed
+    REQUIRE(reader.find("ふしだら").size() == 0);
+    REQUIRE(reader.find("dissolute").size() == 0);
+
+    // changed
+    {
+        auto find = reader.find("袱紗", 0, 0, 1);
+
+        REQUIRE(find.size() == 1);
+        REQUIRE(find.begin()->second.front() == 1010990);
+        REQUIRE(reader.find("crepe wrapper").size() == 0);
+        REQUIRE(reader.get(1010990) == changed_entry);
+    }
+
+    // added
+    {
+        auto find = reader.find("ふくろ", 0, 0, 1);
+        auto find2 = reader.find("noun%", 0, 0, 0, "ふくろ");
+
+        REQUIRE(find.size() == 1);
+        REQUIRE(find.begin()->second.front() == 2000000);
+        REQUIRE(reader.get(2000000) == added_entry);
+        REQUIRE(find2.size() == 1);
+    }
+}
+
+TEST_CASE("multi reader") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::vector<std::string> paths { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    CTQ::write(input_filename, output_filename, paths);
+
+    SECTION("C++") {
+        CTQ::Reader reader(output_filename);
+        CTQ::MultiReader multi({ output_filename, output_filename });
+
+        auto find = multi.find("袱紗");
+
+        REQUIRE(find.size() == 1);
+        REQUIRE(find.begin()->second == std::vector<uint64_t>{ CTQ::MultiReader::make_id(0, 1010990), CTQ::MultiReader::make_id(1, 1010990) });
+        REQUIRE(multi.get(find.begin()->second[1]) == reader.get(1010990));
+
+        // pagination over merged ids
+        auto page = multi.find("袱紗", 1, 1);
+
+        REQUIRE(page.size() == 1);
+        REQUIRE(page.begin()->second == std::vector<uint64_t>{ CTQ::MultiReader::make_id(1, 1010990) });
+        REQUIRE(multi.find("p%", 0, 0, 2).size() == reader.find("p%", 0, 0, 2).size());
+        REQUIRE(multi.get(CTQ::MultiReader::make_id(2, 1010990)) == "");
+    }
+
+    SECTION("C") {
+        const char *filenames[] = { output_filename.c_str(), output_filename.c_str() };
+        ctq_multi_ctx *ctx = ctq_create_multi_reader(filenames, 2);
+
+        REQUIRE(ctx != NULL);
+
+        ctq_find_ret *arr = ctq_multi_find(ctx, "嗚呼", 0, 0, 0, "", 0);
+
+        REQUIRE(arr != NULL);
+        REQUIRE(arr[0].id_cnt == 2);
+
+        char *entry = ctq_multi_get(ctx, arr[0].ids[1]);
+
+        REQUIRE(entry != NULL);
+        free(entry);
+
+        ctq_find_ret_free(arr);
+        ctq_destroy_multi_reader(ctx);
+    }
+
+    SECTION("pagination") {
+        // shards holding more ids than a page, keys of each shard interleaved with the other's in byte order
+        const std::vector<std::string> shard_filenames { "dataset/shard_a.ctq", "dataset/shard_b.ctq" };
+
+        for (size_t shard = 0; shard < shard_filenames.size(); ++shard) {
+            std::ofstream tei("dataset/shard.tei");
+
+            tei << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body>";
+
+            for (int i = 0; i < 8; ++i) {
+                tei << "<entry xml:id=\"a" << 3000000 + i << "\"><form><orth>p" << (char)('a' + 2 * i + shard) << "</orth></form></entry>";
+            }
+
+            tei << "</body></text></TEI>";
+            tei.close();
+
+            REQUIRE(CTQ::write("dataset/shard.tei", shard_filenames[shard], paths) == 0);
+        }
+
+        CTQ::MultiReader multi(shard_filenames);
+        std::vector<std::pair<std::string, uint64_t>> all;
+
+        for (const auto &e : multi.find("p%")) {
+            for (const auto id : e.second) all.emplace_back(e.first, id);
+        }
+
+        REQUIRE(all.size() == 16);
+        REQUIRE(std::is_sorted(all.begin(), all.end()));
+
+        for (size_t offset = 0; offset < all.size(); offset += 3) {
+            std::vector<std::pair<std::string, uint64_t>> page;
+
+            for (const auto &e : multi.find("p%", offset, 3)) {
+                for (const auto id : e.second) page.emplace_back(e.first, id);
+            }
+
+            REQUIRE(page == std::vector<std::pair<std::string, uint64_t>>(all.begin() + offset, all.begin() + std::min(all.size(), offset + 3)));
+        }
+    }
+
+    SECTION("ids too large for a shard") {
+        std::ofstream("dataset/shard.tei") << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body>"
+            << "<entry xml:id=\"a72057594037927936\"><form><orth>pa</orth></form></entry>"
+            << "</body></text></TEI>";
+
+        REQUIRE(CTQ::write("dataset/shard.tei", "dataset/shard_wide.ctq", paths) == 0);
+        REQUIRE(CTQ::Reader("dataset/shard_wide.ctq").find("pa").begin()->second.front() == 72057594037927936ULL);
+
+        bool thrown = false;
+
+        try {
+            CTQ::MultiReader multi({ output_filename, "dataset/shard_wide.ctq" });
+        } catch (const CTQ::reader_exception &) {
+            thrown = true;
+        }
+
+        REQUIRE(thrown);
+    }
+}
+
+// updates src into dst with a delta deleting entry a1011000
+static int update_deleting_a1011000(const std::string &src, const std::string &dst, const CTQ::WriteOptions &options) {
+    std::ofstream("dataset/delete_delta.tei") << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body><entry xml:id=\"a1011000\" type=\"delete\"/></body></text></TEI>";
+
+    return CTQ::update(src, "dataset/delete_delta.tei", dst, options);
+}
+
+TEST_CASE("reload") {
+    const std::string input_filename   = "dataset/simple.tei";
+    const std::string output_filename  = "dataset/simple.ctq";
+    const std::string updated_filename = "dataset/simple_reload.ctq";
+    CTQ::WriteOptions options;
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    CTQ::write(input_filename, output_filename, options);
+    REQUIRE(update_deleting_a1011000(output_filename, updated_filename, options) == 0);
+
+    const auto before = CTQ::Reader(output_filename).find("p%");
+    const auto after  = CTQ::Reader(updated_filename).find("p%");
+
+    REQUIRE(before != after);
+
+    SECTION("C++") {
+        CTQ::ReloadableReader reader(output_filename);
+        std::atomic<bool> done{false};
+        std::atomic<size_t> queries{0};
+        std::atomic<size_t> mismatches{0};
+        std::vector<std::thread> threads;
+
+        // queries run on either file while it is swapped
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&]() {
+                while (!done) {
+                    auto found = reader.find("p%");
+
+                    if (found != before && found != after) ++mismatches;
+                    ++queries;
+                }
+            });
+        }
+
+        while (queries == 0) {
+            std::this_thread::yield();
+        }
+
+        for (int i = 0; i < 20; ++i) {
+            reader.reload(i % 2 ? output_filename : updated_filename);
+        }
+
+        done = true;
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        REQUIRE(mismatches == 0);
+        REQUIRE(queries > 0);
+        REQUIRE(reader.generation() == 20);
+        REQUIRE(reader.find("p%") == before);
+
+        bool thrown = false;
+
+        try {
+            reader.reload("dataset/missing.ctq");
+        } catch (const CTQ::reader_exception &) {
+            thrown = true;
+        }
+
+        REQUIRE(thrown);
+        REQUIRE(reader.find("p%") == before);
+    }
+
+    SECTION("snapshots") {
+        CTQ::ReloadableReader reader(output_filename);
+
+        // more snapshots than threads at once, none waits
+        {
+            std::vector<CTQ::ReloadableReader::Snapshot> held;
+
+            for (int i = 0; i < 100; ++i) {
+                held.push_back(reader.acquire());
+            }
+
+            REQUIRE(held.back()->find("p%") == before);
+        }
+
+        // a reload from a thread holding a snapshot retires the previous file instead of waiting for itself
+        {
+            auto snapshot = reader.acquire();
+
+            reader.reload(updated_filename);
+
+            REQUIRE(snapshot->find("p%") == before);
+            REQUIRE(reader.find("p%") == after);
+        }
+
+        reader.reload(output_filename);
+        REQUIRE(reader.find("p%") == before);
+        REQUIRE(reader.generation() == 2);
+    }
+
+    SECTION("C") {
+        ctq_ctx *ctx = ctq_create_reader(output_filename.c_str());
+        auto get = [ctx](uint64_t id) {
+            char *entry = ctq_get(ctx, id);
+            std::string ret = entry ? entry : "";
+
+            free(entry);
+            return ret;
+        };
+
+        REQUIRE(get(1011000) == CTQ::Reader(output_filename).get(1011000));
+        REQUIRE(ctq_reload(ctx, updated_filename.c_str()) == 0);
+        REQUIRE(get(1011000) == CTQ::Reader(updated_filename).get(1011000));
+        REQUIRE(get(1011000) != CTQ::Reader(output_filename).get(1011000));
+        REQUIRE(ctq_reload(ctx, "dataset/missing.ctq") != 0);
+        REQUIRE(get(1011000) == CTQ::Reader(updated_filename).get(1011000));
+
         ctq_destroy_reader(ctx);
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("sharded write") {
+    const std::string input_filename   = "dataset/simple.tei";
+    const std::string output_filename  = "dataset/simple.ctq";
+    const std::string sharded_filename = "dataset/simple_sharded.ctq";
+    const std::vector<uint64_t> ids { 1010990, 1011000, 1011010, 1565440 };
+    CTQ::WriteOptions options;
+
+    options.paths      = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    options.thread_cnt = 3;
+
+    CTQ::write(input_filename, output_filename, options.paths);
+    REQUIRE(CTQ::write(input_filename, sharded_filename, options) == 0);
+
+    CTQ::Reader reader(output_filename);
+    CTQ::Reader sharded(sharded_filename);
+
+    for (const auto id : ids) {
+        REQUIRE(sharded.get(id) == reader.get(id));
+    }
+
+    for (const auto &keyword : { "p%", "noun%", "袱紗", "ああ", "s%" }) {
+        for (int path_idx = 0; path_idx <= 3; ++path_idx) {
+            REQUIRE(sharded.find(keyword, 0, 0, path_idx) == reader.find(keyword, 0, 0, path_idx));
+        }
+    }
+
+    REQUIRE(sharded.find("noun%", 0, 0, 0, "袱紗", 2) == reader.find("noun%", 0, 0, 0, "袱紗", 2));
+
+    // entry tags inside a comment filling the middle of the body, a CDATA section and a processing instruction
+    {
+        const std::string marked_filename = "dataset/marked.tei";
+        std::ofstream tei(marked_filename);
+        auto entry = [&](int i) {
+            tei << "<entry xml:id=\"a" << 4000000 + i << "\"><form><orth>m" << i << "</orth></form>"
+                << "<sense><note><![CDATA[<entry xml:id=\"a1\">]]></note></sense></entry><?pi <entry ?>";
+        };
+
+        tei << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body>";
+
+        for (int i = 0; i < 4; ++i) entry(i);
+
+        tei << "<!-- ";
+
+        for (int i = 0; i < 100; ++i) {
+            tei << "<entry xml:id=\"a" << 5000000 + i << "\"><form><orth>commented</orth></form></entry>";
+        }
+
+        tei << " -->";
+
+        for (int i = 4; i < 8; ++i) entry(i);
+
+        tei << "</body></text></TEI>";
+        tei.close();
+
+        REQUIRE(CTQ::write(marked_filename, output_filename, options.paths) == 0);
+        REQUIRE(CTQ::write(marked_filename, sharded_filename, options) == 0);
+
+        CTQ::Reader reader(output_filename);
+        CTQ::Reader sharded(sharded_filename);
+
+        REQUIRE(sharded.find("m%").size() == 8);
+        REQUIRE(sharded.find("m%") == reader.find("m%"));
+        REQUIRE(sharded.find("commented").size() == 0);
+        REQUIRE(sharded.get(4000007) == reader.get(4000007));
+    }
+}
+
+TEST_CASE("intern table") {
+    InternTable table;
+    const std::string long_text(100000, 'x');
+
+    REQUIRE(table.intern("sense") == 0);
+    REQUIRE(table.intern("form") == 1);
+    REQUIRE(table.intern(std::string("sense")) == 0);
+    REQUIRE(table.intern(long_text) == 2);
+    REQUIRE(table.size() == 3);
+    REQUIRE(table[1] == "form");
+    REQUIRE(table[2] == long_text);
+    REQUIRE(table.find("form") == 1);
+    REQUIRE(table.find("orth") == InternTable::npos);
+    REQUIRE(table.sorted() == std::vector<std::string>{ "form", "sense", long_text });
+
+    InternTable other;
+    other.intern("orth");
+    other.intern("form");
+
+    table.merge(other);
+    REQUIRE(table.size() == 4);
+    REQUIRE(table.find("orth") == 3);
+    REQUIRE(table.bytes() > long_text.size());
+}
+
+TEST_CASE("memory budget") {
+    const std::string input_filename    = "dataset/simple.tei";
+    const std::string output_filename   = "dataset/simple.ctq";
+    const std::string budgeted_filename = "dataset/simple_budgeted.ctq";
+    const std::string temp_dir          = "dataset/runs";
+    CTQ::WriteOptions options;
+    CTQ::WriteStats stats;
+
+    auto file_bytes = [](const std::string &filename) {
+        std::ifstream input(filename, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    };
+
+    std::filesystem::create_directory(temp_dir);
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    for (unsigned thread_cnt : { 1, 3 }) {
+        CTQ::WriteOptions budgeted = options;
+
+        options.thread_cnt     = thread_cnt;
+        budgeted.thread_cnt    = thread_cnt;
+        budgeted.memory_budget = 256;
+        budgeted.temp_dir      = temp_dir;
+        budgeted.stats         = &stats;
+
+        REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+        REQUIRE(CTQ::write(input_filename, budgeted_filename, budgeted) == 0);
+
+        // spilled runs merge to the same footer
+        REQUIRE(stats.posting_runs > 2);
+        REQUIRE(stats.id_mapping_bytes <= 256);
+        REQUIRE(file_bytes(budgeted_filename) == file_bytes(output_filename));
+        REQUIRE(std::filesystem::is_empty(temp_dir));
+    }
+
+    // more runs than merged at once, merged in several passes
+    for (unsigned thread_cnt : { 1, 3 }) {
+        CTQ::WriteOptions budgeted = options;
+
+        options.thread_cnt     = thread_cnt;
+        budgeted.thread_cnt    = thread_cnt;
+        budgeted.memory_budget = 1;
+        budgeted.merge_fan_in  = 2;
+        budgeted.temp_dir      = temp_dir;
+        budgeted.stats         = &stats;
+
+        REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+        REQUIRE(CTQ::write(input_filename, budgeted_filename, budgeted) == 0);
+
+        REQUIRE(stats.posting_runs > 4 * budgeted.merge_fan_in);
+        REQUIRE(file_bytes(budgeted_filename) == file_bytes(output_filename));
+        REQUIRE(std::filesystem::is_empty(temp_dir));
+    }
+
+    CTQ::Reader reader(budgeted_filename);
+    REQUIRE(reader.find("袱紗").size() == 1);
+
+    // missing temporary directory
+    options.memory_budget = 256;
+    options.temp_dir      = "dataset/missing";
+    REQUIRE(CTQ::write(input_filename, budgeted_filename, options) != 0);
+}
+
+TEST_CASE("stream write") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::string stream_filename = "dataset/simple_stream.ctq";
+    const std::string buffer_filename = "dataset/simple_buffer.ctq";
+    const std::vector<uint64_t> ids { 1010990, 1011000, 1011010, 1565440 };
+    CTQ::WriteOptions options;
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    CTQ::write(input_filename, output_filename, options);
+
+    std::ifstream input(input_filename, std::ios::binary);
+    std::string buffer((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    input.clear();
+    input.seekg(0);
+
+    REQUIRE(CTQ::write(input, stream_filename, options) == 0);
+    REQUIRE(CTQ::write(buffer.data(), buffer.size(), buffer_filename, options) == 0);
+
+    CTQ::Reader reader(output_filename);
+
+    for (const auto &filename : { stream_filename, buffer_filename }) {
+        CTQ::Reader other(filename);
+
+        for (const auto id : ids) {
+            REQUIRE(other.get(id) == reader.get(id));
+        }
+
+        REQUIRE(other.find("p%") == reader.find("p%"));
+        REQUIRE(other.find("noun%", 0, 0, 3) == reader.find("noun%", 0, 0, 3));
+    }
+
+    // truncated input
+    REQUIRE(CTQ::write(buffer.data(), buffer.size() / 2, buffer_filename, options) != 0);
+
+    // small reads, all but the first few spooled to a temporary file
+    const std::string temp_dir = "dataset/spool";
+    CTQ::WriteOptions spooled = options;
+    size_t offset = 0;
+    bool spilled = false;
+
+    std::filesystem::create_directory(temp_dir);
+    spooled.spool_budget = 256;
+    spooled.temp_dir     = temp_dir;
+
+    auto small_reads = [&](char *buf, size_t size) -> long {
+        size_t len = std::min({ size, (size_t)100, buffer.size() - offset });
+
+        memcpy(buf, buffer.data() + offset, len);
+        offset += len;
+        spilled |= !std::filesystem::is_empty(temp_dir);
+
+        return len;
+    };
+
+    REQUIRE(CTQ::write(small_reads, stream_filename, spooled) == 0);
+    REQUIRE(spilled);
+    REQUIRE(std::filesystem::is_empty(temp_dir));
+
+    CTQ::Reader other(stream_filename);
+
+    for (const auto id : ids) {
+        REQUIRE(other.get(id) == reader.get(id));
+    }
+
+    REQUIRE(other.find("p%") == reader.find("p%"));
+}
+
+TEST_CASE("write stats") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    std::vector<std::pair<std::string, size_t>> calls;
+    CTQ::WriteOptions options;
+    CTQ::WriteStats stats;
+
+    options.paths         = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    options.cluster_size  = 400;
+    options.progress_step = 1;
+    options.stats         = &stats;
+    options.progress      = [&calls](const char *phase, size_t entry_cnt, bool done) {
+        calls.emplace_back(std::string(phase) + (done ? " done" : ""), entry_cnt);
+    };
+
+    for (unsigned thread_cnt : { 1, 2 }) {
+        options.thread_cnt = thread_cnt;
+        calls.clear();
+
+        REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+
+        REQUIRE(stats.entry_cnt == 4);
+        REQUIRE(stats.total_time >= stats.parse_time + stats.transform_time);
+        REQUIRE(stats.transform_time > 0);
+        REQUIRE(stats.ch_alpha_bytes > 0);
+        REQUIRE(stats.id_mapping_bytes > 0);
+        REQUIRE(stats.paths_mapping_bytes > 0);
+        REQUIRE(stats.cluster_raw_size.count > 1);
+        REQUIRE(stats.cluster_raw_size.count == stats.cluster_compressed_size.count);
+        REQUIRE(stats.cluster_raw_size.max <= options.cluster_size);
+        REQUIRE(stats.cluster_raw_size.min <= stats.cluster_raw_size.p50);
+
+        REQUIRE(calls.size() >= 2);
+        REQUIRE(calls.back() == std::make_pair(std::string("transform done"), (size_t)4));
+    }
+
+    REQUIRE(calls.size() == 2); // sharded passes only report their end
+}
+
+TEST_CASE("file layout") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::string layout_filename = "dataset/simple_layout.ctq";
+    const std::vector<uint64_t> ids { 1010990, 1011000, 1011010, 1565440 };
+    CTQ::WriteOptions options;
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+
+    REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+
+    CTQ::Reader reader(output_filename);
+
+    REQUIRE(reader.get_writer_version() == "0.1.0");
+    REQUIRE(reader.layout().id_bytes == 4);
+    REQUIRE(reader.layout().posting_bytes == 4);
+    REQUIRE(reader.layout().has(FileLayout::varint_elements));
+
+    auto require_same = [&](const std::string &filename) {
+        CTQ::Reader other(filename);
+
+        for (const auto id : ids) {
+            REQUIRE(other.get(id) == reader.get(id));
+        }
+
+        for (const auto &keyword : { "p%", "noun%", "袱紗", "ああ" }) {
+            for (int path_idx = 0; path_idx <= 3; ++path_idx) {
+                REQUIRE(other.find(keyword, 0, 0, path_idx) == reader.find(keyword, 0, 0, path_idx));
+            }
+        }
+
+        REQUIRE(other.find("noun%", 0, 0, 0, "袱紗", 1) == reader.find("noun%", 0, 0, 0, "袱紗", 1));
+        REQUIRE(other.find("noun%", 0, 0, 0, "袱紗", 2) == reader.find("noun%", 0, 0, 0, "袱紗", 2));
+    };
+
+    SECTION("legacy") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.legacy_format = true;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        REQUIRE(CTQ::Reader(layout_filename).get_writer_version() == "0.0.2");
+        REQUIRE(!CTQ::Reader(layout_filename).layout().v2);
+        require_same(layout_filename);
+
+        // legacy clusters are carried over by an update
+        const std::string updated_filename = "dataset/simple_layout_updated.ctq";
+        std::ofstream("dataset/empty_delta.tei") << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body></body></text></TEI>";
+
+        REQUIRE(CTQ::update(layout_filename, "dataset/empty_delta.tei", updated_filename, options) == 0);
+        REQUIRE(CTQ::Reader(updated_filename).layout().v2);
+        REQUIRE(!CTQ::Reader(updated_filename).layout().has(FileLayout::varint_elements));
+        require_same(updated_filename);
+
+        layout_options.cluster_size = 100000;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) != 0);
+    }
+
+    SECTION("wide") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.wide_fields = true;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        REQUIRE(CTQ::Reader(layout_filename).layout().posting_bytes == 8);
+        REQUIRE(CTQ::Reader(layout_filename).layout().path_bits == 16);
+        REQUIRE(CTQ::Reader(layout_filename).layout().offset_bytes == 8);
+        require_same(layout_filename);
+    }
+
+    SECTION("large clusters") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.cluster_size = 100000;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        REQUIRE(CTQ::Reader(layout_filename).layout().pos_bytes == 4);
+        require_same(layout_filename);
+    }
+
+    SECTION("entries larger than a cluster") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.cluster_size = 64;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+        require_same(layout_filename);
+    }
+
+    SECTION("entry larger than the cluster size field") {
+        const std::string large_filename = "dataset/large_entry.tei";
+        std::ofstream tei(large_filename);
+        CTQ::WriteOptions layout_options = options;
+
+        tei << "<?xml version=\"1.0\" encoding=\"UTF-8\"?><TEI><text><body><entry xml:id=\"a1\"><form><orth>large</orth></form>";
+
+        for (int i = 0; i < 30000; ++i) {
+            tei << "<sense><note>n" << i << "</note></sense>";
+        }
+
+        tei << "</entry></body></text></TEI>";
+        tei.close();
+
+        // 16 bits cluster sizes, the write fails and leaves no file
+        std::remove(layout_filename.c_str());
+        REQUIRE(CTQ::write(large_filename, layout_filename, layout_options) != 0);
+        REQUIRE(!std::filesystem::exists(layout_filename));
+
+        layout_options.wide_fields = true;
+        REQUIRE(CTQ::write(large_filename, layout_filename, layout_options) == 0);
+
+        CTQ::Reader other(layout_filename);
+
+        REQUIRE(other.layout().cluster_size_bytes == 4);
+        REQUIRE(other.get(1).find("n29999") != std::string::npos);
+    }
+
+    SECTION("columns") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.column_clusters = true;
+        layout_options.cluster_size    = 400;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        CTQ::Reader columns(layout_filename);
+
+        REQUIRE(columns.layout().has(FileLayout::column_clusters));
+        require_same(layout_filename);
+
+        for (const auto id : ids) {
+            REQUIRE(columns.get_texts(id) == reader.get_texts(id));
+        }
+
+        REQUIRE(reader.get_texts(1010990).front() == "袱紗");
+
+        // rebuilt clusters are split again, copied ones kept
+        const std::string updated_filename = "dataset/simple_layout_updated.ctq";
+
+        REQUIRE(update_deleting_a1011000(layout_filename, updated_filename, options) == 0);
+
+        CTQ::Reader updated(updated_filename);
+
+        REQUIRE(updated.layout().has(FileLayout::column_clusters));
+        REQUIRE(updated.find("嗚呼", 0, 0, 1) == reader.find("嗚呼", 0, 0, 1));
+
+        for (const auto id : { 1010990, 1011010, 1565440 }) {
+            REQUIRE(updated.get(id) == reader.get(id));
+            REQUIRE(updated.get_texts(id) == reader.get_texts(id));
+        }
+
+        layout_options.legacy_format = true;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) != 0);
+    }
+
+    SECTION("string pool") {
+        CTQ::WriteOptions layout_options = options;
+        CTQ::WriteStats stats;
+
+        layout_options.string_pool = true;
+        layout_options.stats       = &stats;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        REQUIRE(CTQ::Reader(layout_filename).layout().has(FileLayout::string_pool));
+        REQUIRE(stats.string_pool_bytes > 0);
+        require_same(layout_filename);
+
+        for (const auto id : ids) {
+            REQUIRE(CTQ::Reader(layout_filename).get_texts(id) == reader.get_texts(id));
+        }
+
+        // kept by updates
+        const std::string updated_filename = "dataset/simple_layout_updated.ctq";
+
+        REQUIRE(update_deleting_a1011000(layout_filename, updated_filename, options) == 0);
+        REQUIRE(CTQ::Reader(updated_filename).layout().has(FileLayout::string_pool));
+        REQUIRE(CTQ::Reader(updated_filename).get(1010990) == reader.get(1010990));
+    }
+
+    SECTION("trie variants") {
+        CTQ::WriteOptions layout_options = options;
+
+        REQUIRE(reader.layout().trie_variant() == 8);
+
+        for (unsigned bits : { 7, 15, 16 }) {
+            layout_options.trie_variant = bits;
+            REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+            REQUIRE(CTQ::Reader(layout_filename).layout().trie_variant() == bits);
+            require_same(layout_filename);
+        }
+
+        // kept by updates
+        const std::string updated_filename = "dataset/simple_layout_updated.ctq";
+
+        REQUIRE(update_deleting_a1011000(layout_filename, updated_filename, options) == 0);
+        REQUIRE(CTQ::Reader(updated_filename).layout().trie_variant() == 16);
+        REQUIRE(CTQ::Reader(updated_filename).find("嗚呼", 0, 0, 1) == reader.find("嗚呼", 0, 0, 1));
+
+        layout_options.trie_variant = 9;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) != 0);
+
+        layout_options.trie_variant  = 7;
+        layout_options.legacy_format = true;
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) != 0);
+    }
+
+    SECTION("more than 7 paths") {
+        CTQ::WriteOptions layout_options = options;
+
+        layout_options.paths = { "/a1", "/a2", "/a3", "/a4", "/a5", "/a6", "/a7", "/a8", "/entry/form/orth" };
+        REQUIRE(CTQ::write(input_filename, layout_filename, layout_options) == 0);
+
+        CTQ::Reader other(layout_filename);
+
+        REQUIRE(other.find("袱紗", 0, 0, 9).size() == 1);
+        REQUIRE(other.find("袱紗", 0, 0, 1).size() == 0);
+    }
+}
+
+TEST_CASE("projection") {
+    const std::string input_filename  = "dataset/simple.tei";
+    const std::string output_filename = "dataset/simple.ctq";
+    const std::string columns_filename = "dataset/simple_columns.ctq";
+    const std::vector<std::string> paths { "/entry/form/orth", "/entry/sense/cit/quote" };
+    CTQ::WriteOptions options;
+
+    options.paths = { "/entry/form/orth", "/entry/sense/cit/quote", "/entry/sense/note" };
+    REQUIRE(CTQ::write(input_filename, output_filename, options) == 0);
+
+    options.column_clusters = true;
+    REQUIRE(CTQ::write(input_filename, columns_filename, options) == 0);
+
+    SECTION("C++") {
+        CTQ::Reader reader(output_filename);
+        CTQ::Reader columns(columns_filename);
+
+        auto ret = reader.get(1010990, paths);
+
+        REQUIRE(ret.size() == 2);
+        REQUIRE(ret["/entry/form/orth"] == std::vector<std::string>{ "袱紗", "帛紗", "服紗", "ふくさ" });
+        REQUIRE(ret["/entry/sense/cit/quote"].front() == "small silk wrapper");
+        REQUIRE(ret["/entry/sense/cit/quote"].size() == 3);
+
+        // skipped subtrees do not shift the texts of the following ones
+        ret = reader.get(1010990, { "/entry/sense/cit/quote" });
+
+        REQUIRE(ret.size() == 1);
+        REQUIRE(ret["/entry/sense/cit/quote"].back() == "crepe wrapper");
+
+        ret = reader.get(1011000, { "/entry/form/lbl" });
+
+        REQUIRE(ret["/entry/form/lbl"].front() == "rarely-used kanji form");
+        REQUIRE(reader.get(1011000, { "/entry/nothing" }).empty());
+        REQUIRE(reader.get(1011000, {}).empty());
+
+        for (const uint64_t id : { 1010990, 1011000, 1011010, 1565440 }) {
+            REQUIRE(columns.get(id, paths) == reader.get(id, paths));
+            REQUIRE(reader.get(id, { "/entry/sense/note" }) == columns.get(id, { "/entry/sense/note" }));
+            REQUIRE(reader.get(id, { "/entry/form/orth" })["/entry/form/orth"].size() > 0);
+        }
+    }
+
+    SECTION("C") {
+        ctq_ctx *ctx = ctq_create_reader(output_filename.c_str());
+        const char *c_paths[] = { "/entry/form/orth", "/entry/sense/cit/quote" };
+
+        ctq_get_paths_ret *arr = ctq_get_paths(ctx, 1010990, c_paths, 2);
+
+        REQUIRE(arr != NULL);
+        REQUIRE(std::string(arr[0].path) == "/entry/form/orth");
+        REQUIRE(arr[0].text_cnt == 4);
+        REQUIRE(std::string(arr[0].texts[0]) == "袱紗");
+        REQUIRE(std::string(arr[1].path) == "/entry/sense/cit/quote");
+        REQUIRE(arr[2].path == NULL);
+
+        ctq_get_paths_ret_free(arr);
+
+        REQUIRE(ctq_get_paths(ctx, 1010990, c_paths, 0) == NULL);
+
+        ctq_destroy_reader(ctx);
+    }
+}